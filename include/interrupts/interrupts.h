@@ -121,12 +121,14 @@ __attribute__((interrupt)) void irq_15(interrupt_frame* frame);
 __attribute__((interrupt)) void test_int(interrupt_frame* frame);
 __attribute__((interrupt)) void spurious_int(interrupt_frame* frame);
 __attribute__((interrupt)) void call_int(interrupt_frame* frame);
+__attribute__((interrupt)) void shootdown_int(interrupt_frame* frame);
 
 __attribute__((interrupt)) void hpet_periodic_int(interrupt_frame* frame);
 __attribute__((interrupt)) void hpet_oneshot_int(interrupt_frame* frame);
 
 __attribute__((naked)) void apic_int();
 __attribute__((naked)) void yield_int();
+__attribute__((naked)) void reschedule_int();
 
 [[gnu::always_inline]] inline void
     prepare_call_int(std_k::callable<void>* target) {
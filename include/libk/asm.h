@@ -118,10 +118,42 @@ inline void enable_interrupts() { asm volatile("sti"); };
 
 inline void disable_interrupts() { asm volatile("cli"); };
 
+inline uint64_t save_and_disable_interrupts() {
+    uint64_t flags;
+    asm volatile("pushfq \n\t\
+         pop %[flags] \n\t\
+         cli"
+                 : [flags] "=r"(flags)
+                 :
+                 : "memory");
+    return flags;
+};
+
+inline void restore_interrupts(uint64_t flags) {
+    if (flags & (1 << 9)) { enable_interrupts(); }
+};
+
 inline void trigger_breakpoint() { asm volatile("int $3"); };
 
 inline void halt() { asm volatile("hlt"); };
 
+// MONITOR and MWAIT are reported in leaf 1
+inline bool mwait_supported() {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) { return false; }
+    return (ecx & (1 << 3));
+};
+
+// Arms the monitor on the cache line holding the address
+inline void monitor(const volatile void* address) {
+    asm volatile("monitor" : : "a"(address), "c"(0), "d"(0) : "memory");
+};
+
+// Waits until the monitored line is written to, or an interrupt arrives
+inline void mwait(uint32_t hints = 0) {
+    asm volatile("mwait" : : "a"(hints), "c"(0) : "memory");
+};
+
 inline uint64_t pop_64() {
     uint64_t value;
     asm volatile("\
@@ -192,6 +224,14 @@ inline uint64_t rd_rand() {
     return value;
 }
 
+// Timestamp counter, read only once everything before it has finished
+inline uint64_t read_tsc() {
+    uint32_t low;
+    uint32_t high;
+    asm volatile("lfence \n\t rdtsc" : "=a"(low), "=d"(high) : : "memory");
+    return ((uint64_t)high << 32) | low;
+}
+
 inline void out_byte(unsigned char byte, uint16_t port) {
     asm volatile("movw %[port], %%dx \n\t\
          movb %[value], %%al \n\t\
@@ -190,6 +190,40 @@ template<class T> void insertion_sort_pointer(T* array[], int num_items) {
         index++;
     }
 }
+template<class T> void heap_sift_down(T array[], int start, int num_items) {
+
+    int parent = start;
+    while (1) {
+        int largest = parent;
+        int left    = (parent * 2) + 1;
+        int right   = left + 1;
+
+        if (left < num_items && array[left] > array[largest]) largest = left;
+        if (right < num_items && array[right] > array[largest]) largest = right;
+
+        if (largest == parent) return;
+
+        T temp         = array[parent];
+        array[parent]  = array[largest];
+        array[largest] = temp;
+        parent         = largest;
+    }
+}
+
+template<class T> void heap_sort(T array[], int num_items) {
+
+    // Build a max-heap, then repeatedly move the top to the end
+    for (int i = (num_items / 2) - 1; i >= 0; i--) {
+        heap_sift_down<T>(array, i, num_items);
+    }
+
+    for (int end = num_items - 1; end > 0; end--) {
+        T temp     = array[0];
+        array[0]   = array[end];
+        array[end] = temp;
+        heap_sift_down<T>(array, 0, end);
+    }
+}
 } // namespace std_k
 
 #endif
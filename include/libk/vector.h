@@ -2,6 +2,7 @@
 #define PINT_VECTOR_H
 
 #include "common.h"
+#include "memory/p_memory.h"
 
 namespace std_k {
 
@@ -83,14 +84,35 @@ template<class T> class vector {
 
     size_t current_size;
     size_t current_capacity;
+
+    bool reallocate(size_t new_capacity);
 };
 
+// Elements that can be moved byte by byte are left to realloc, which can
+//  often grow the array without copying it. Returns false if the caller
+//  has to move them itself
+template<class T> bool vector<T>::reallocate(size_t new_capacity) {
+    if constexpr (is_trivially_copyable<T>::value
+                  && is_trivially_destructible<T>::value) {
+        if (new_capacity == 0 || current_array == nullptr) { return false; }
+
+        T* new_array
+            = (T*)realloc((void*)current_array, sizeof(T) * new_capacity);
+        if (new_array == nullptr) { return false; }
+
+        current_array    = new_array;
+        current_capacity = new_capacity;
+        return true;
+    } else {
+        (void)new_capacity;
+        return false;
+    }
+}
+
 template<class T> void vector<T>::resize(size_t new_size) {
     if (new_size > current_size) {
-        // TODO: Use realloc instead
-
         // Check if within current capacity
-        if (new_size >= current_capacity) {
+        if (new_size >= current_capacity && !reallocate(new_size * 2)) {
             // Need new, larger array
             T* new_array     = new T[new_size * 2];
             current_capacity = new_size * 2;
@@ -172,7 +194,8 @@ template<class T> vector<T>& vector<T>::operator=(vector<T>&& x) {
 }
 
 template<class T> void vector<T>::push_back(const T value) {
-    if ((current_size + 1) > current_capacity) {
+    if ((current_size + 1) > current_capacity
+        && !reallocate(current_capacity * 2)) {
         // Reallocate to larger array
         T* new_array = new T[current_capacity * 2];
         current_capacity *= 2;
@@ -220,7 +243,8 @@ template<class T> void vector<T>::pop_back() {
 
 template<class T>
 size_t vector<T>::insert(const size_t position, const T value) {
-    if ((current_size + 1) > current_capacity) {
+    if ((current_size + 1) > current_capacity
+        && !reallocate(current_capacity ? current_capacity * 2 : 4)) {
         // Reallocate to larger array
         current_capacity = (current_capacity ? current_capacity * 2 : 4);
         T* new_array     = new T[current_capacity];
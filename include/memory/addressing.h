@@ -1,36 +1,134 @@
 #ifndef ADDRESSING_H
 #define ADDRESSING_H
 
+#include "libk/cstring.h"
+#include "libk/mutex.h"
 #include "libk/vector.h"
+#include "memory/frames.h"
 #include "memory/p_memory.h"
 #include "memory/paging.h"
+#include "memory/pcid.h"
+#include "memory/range_allocator.h"
+#include "memory/shootdown.h"
 #include "memory/sub_memory.h"
 
 #include <stddef.h>
 #include <stdint.h>
 
 namespace paging {
+
+// Indices of the level 4 entries reaching the kernel's half, short of the
+//  two used for the kernel's image and each space's table windows
+constexpr size_t kernel_first_pdp = 256;
+constexpr size_t kernel_end_pdp   = 510;
+
+// And the one below the user's half, holding the identity maps
+constexpr size_t identity_map_pdp = 0;
+
+// The heap starts at the bottom of the kernel's half, under PDPs that every
+//  space shares, rather than next to the image, where each space has a PDP
+//  of its own for the windows
+constexpr uintptr_t kernel_heap_base = 0xffff800000000000;
+
+// Whether a level 4 entry is one of those shared by every space
+inline bool kernel_slot(size_t index) {
+    return index == identity_map_pdp
+           || (index >= kernel_first_pdp && index < kernel_end_pdp);
+}
+
+// What every new level 4 table starts out as, with all of the kernel's PDPs
+//  made at boot, so its entries never change and are never copied around
+extern page_level_4_table kernel_level_4_template;
+
 void initialize_table_mapping(page_level_4_table* level_4_table);
 
+// Lock over the tables of an address space, which the core holding it can
+//  take again, as building new tables may need to map more memory. Frames
+//  for new tables are stocked before it's taken, so the allocators aren't
+//  entered while it's held, and come pre-zeroed where the core has any
+class table_mutex {
+    static constexpr uint32_t no_owner     = ~(uint32_t)0;
+    static constexpr size_t   spare_target = 8;
+
+    struct spare_frame {
+        uintptr_t frame;
+        bool      zeroed;
+    };
+
+    std_k::mutex base;
+    uint32_t     owner;
+    uint32_t     depth;
+
+    std_k::mutex stock_lock;
+    spare_frame  spare_frames[spare_target];
+    size_t       num_spare;
+
+  public:
+    table_mutex()
+        : owner(no_owner)
+        , depth(0)
+        , num_spare(0) {}
+
+    // Disables interrupts while held, returning the flags to restore
+    uint64_t lock();
+    void     unlock(uint64_t flags);
+
+    bool held_here();
+
+    // Only meaningful while held by the caller
+    inline bool outermost() const { return depth == 1; }
+    inline bool needs_stock() const {
+        return __atomic_load_n(&num_spare, __ATOMIC_ACQUIRE)
+               < (spare_target / 2);
+    }
+
+    // Tops up the spare frames, must not be held by the caller
+    void stock();
+
+    // Frame for a new table, from the spares if this core holds the lock,
+    //  with zeroed set if it's already been cleared. 0 if none are left
+    uintptr_t take_frame(bool& zeroed);
+
+    inline uintptr_t take_frame() {
+        bool zeroed;
+        return take_frame(zeroed);
+    }
+};
+
 struct address_space {
     paging::page_level_4_table*                 primary_table;
     std_k::vector<paging::page_level_4_table*>* shared_tables = nullptr;
 
     sub_mem_manager sub_page_memory;
+    table_mutex     table_lock;
+    range_allocator free_ranges;
 
-    void* next_alloc_address = (void*)PAGE_SIZE;
+    // Set once the space has shared its tables with a clone, after which
+    //  anything writing to them has to take its own copy first
+    bool copy_on_write = false;
+
+    // Tags the space's translations on each core, along with where its level
+    //  4 table is, found the first time it's loaded
+    uint64_t  space_id;
+    uintptr_t table_address = 0;
+
+    // Set once anything has been mapped into the user's half
+    bool user_mappings = false;
 
     address_space() {
-        // Need to create new lvl4 table
+        space_id = __atomic_add_fetch(&next_space_id, 1, __ATOMIC_RELAXED);
+
+        // All of the user's half is free to start with
+        free_ranges.initialize(user_half_start,
+                               user_half_end - user_half_start, false);
+
+        // Need to create new lvl4 table, already holding the kernel's half
         primary_table = new paging::page_level_4_table;
+        std_k::memcpy(primary_table, &kernel_level_4_template,
+                      sizeof(page_level_4_table));
 
         // Initialize the bare minimum mapping in top 2 pdps
         paging::initialize_table_mapping(primary_table);
-
-        // Copy over higher half of kernel mapping
-        for (int i = 0; i < 254; i++) {
-            primary_table->data[i + 256] = paging::pml4_table->data[i + 256];
-        }
     }
 
     address_space(address_space* parent_space)
@@ -73,14 +171,42 @@ struct address_space {
         return shared_tables;
     }
 
-    void* get_new_address(size_t needed_size) {
-        void* return_address = next_alloc_address;
-        next_alloc_address
-            = (void*)((uintptr_t)next_alloc_address + needed_size);
+    /**
+     * @brief Creates a copy of this space which shares everything in it,
+     *          with tables and pages only being copied once either side
+     *          writes to them
+     *
+     * @return address_space*   The new space, or nullptr if it couldn't be
+     *                          made
+     */
+    address_space* clone();
+
+    // Spaces without anything of their own only hold the kernel's half,
+    //  which is the same for every space. Linked spaces fill in each
+    //  other's tables, so the user's half is looked at until it's in use
+    inline bool has_user_mappings() {
+        if (!user_mappings) {
+            for (size_t i = (user_half_start / page_directory_pointer_size);
+                 i < kernel_first_pdp; i++) {
+                if (primary_table->data[i] != 0) {
+                    user_mappings = true;
+                    break;
+                }
+            }
+        }
+        return user_mappings;
+    }
 
-        // Round to next page-aligned address
-        next_alloc_address = paging::round_up_page_aligned(next_alloc_address);
-        return return_address;
+    inline page_directory_pointer_table_entry* level_4_entry(size_t index) {
+        return &primary_table->data[index];
+    }
+
+    void* get_new_address(size_t needed_size, size_t alignment = PAGE_SIZE) {
+        return (void*)free_ranges.allocate(needed_size, alignment);
+    }
+
+    void release_address(void* address, size_t size) {
+        free_ranges.release((uintptr_t)address, size);
     }
 
     void identity_map_page(uintptr_t target_address);
@@ -89,19 +215,15 @@ struct address_space {
 
     void identity_map_region(uintptr_t target_address, size_t size);
 
-    void map_page_to(uintptr_t source_address, uintptr_t target_address,
-                     bool lock_override = false);
-    void map_pt_to(uintptr_t source_address, uintptr_t target_address,
-                   bool lock_override = false);
-    void map_pd_to(uintptr_t source_address, uintptr_t target_address,
-                   bool lock_override = false);
+    void map_page_to(uintptr_t source_address, uintptr_t target_address);
+    void map_pt_to(uintptr_t source_address, uintptr_t target_address);
+    void map_pd_to(uintptr_t source_address, uintptr_t target_address);
 
     void map_region_to(uintptr_t source_address, uintptr_t target_address,
-                       size_t size, bool lock_override = false);
+                       size_t size);
 
     inline page_directory_pointer_table*
-        get_page_directory_pointer_table(uintptr_t virtual_address,
-                                         bool      lock_override = false) {
+        get_page_directory_pointer_table(uintptr_t virtual_address) {
 
         // Check if it has a matching PDP entry in the level 4 table
         int  l4_index = ((virtual_address % page_level_4_table_size)
@@ -109,35 +231,36 @@ struct address_space {
         bool exists   = (primary_table->data[l4_index] != 0);
         if (!exists) {
             // Create new page directory pointer table
-            uintptr_t p_address = (uintptr_t)palloc(lock_override);
+            bool      zeroed;
+            uintptr_t p_address = table_lock.take_frame(zeroed);
+            if (p_address == 0) { return nullptr; }
             page_directory_pointer_table* target_pdp = &pdp_tables[l4_index];
-            map_page_to(p_address, (uintptr_t)target_pdp, lock_override);
-            for (int i = 0; i < 512; i++) { target_pdp->data[i] = 0; }
+            map_page_to(p_address, (uintptr_t)target_pdp);
+            if (!zeroed) {
+                for (int i = 0; i < 512; i++) { target_pdp->data[i] = 0; }
+            }
 
-            // Set into table(s)
-            // Indices 0-255 cover the user-space
-            if (l4_index < 255) {
-                // Copy to all
+            // Set into table(s). Only the user's half can be missing one,
+            //  as the kernel's PDPs were all made before any space existed
+            uintptr_t entry = (uintptr_t)p_address | pdp_present
+                              | pdp_write_enabled;
+            if (shared_tables != nullptr) {
                 for (size_t i = 0; i < shared_tables->size(); i++) {
-                    shared_tables->at(i)->data[l4_index] = (uintptr_t)p_address
-                                                           | pdp_present
-                                                           | pdp_write_enabled;
+                    shared_tables->at(i)->data[l4_index] = entry;
                 }
             } else {
-                pml4_table->data[l4_index]
-                    = (uintptr_t)p_address | pdp_present | pdp_write_enabled;
+                primary_table->data[l4_index] = entry;
             }
         }
 
         return &pdp_tables[l4_index];
     };
 
-    inline page_directory_table* get_page_directory(uintptr_t virtual_address,
-                                                    bool      lock_override
-                                                    = false) {
+    inline page_directory_table* get_page_directory(uintptr_t virtual_address) {
 
         page_directory_pointer_table* parent_table
-            = get_page_directory_pointer_table(virtual_address, lock_override);
+            = get_page_directory_pointer_table(virtual_address);
+        if (parent_table == nullptr) { return nullptr; }
 
         // Check if it has a matching PD entry in the PDP table
         int master_index = ((virtual_address % page_level_4_table_size)
@@ -148,10 +271,14 @@ struct address_space {
 
         if (!exists) {
             // Create new page directory table
-            uintptr_t             p_address = (uintptr_t)palloc(lock_override);
+            bool      zeroed;
+            uintptr_t p_address = table_lock.take_frame(zeroed);
+            if (p_address == 0) { return nullptr; }
             page_directory_table* target_pd = &pd_tables[master_index];
-            map_page_to(p_address, (uintptr_t)target_pd, lock_override);
-            for (int i = 0; i < 512; i++) { target_pd->data[i] = 0; }
+            map_page_to(p_address, (uintptr_t)target_pd);
+            if (!zeroed) {
+                for (int i = 0; i < 512; i++) { target_pd->data[i] = 0; }
+            }
             parent_table->data[parent_index]
                 = (uintptr_t)p_address | pd_present | pd_write_enabled;
         }
@@ -159,11 +286,11 @@ struct address_space {
         return &pd_tables[master_index];
     };
 
-    inline page_table* get_page_table(uintptr_t virtual_address,
-                                      bool      lock_override = false) {
+    inline page_table* get_page_table(uintptr_t virtual_address) {
 
         page_directory_table* parent_table
-            = get_page_directory(virtual_address, lock_override);
+            = get_page_directory(virtual_address);
+        if (parent_table == nullptr) { return nullptr; }
 
         // Check if it has a matching PT entry in the PD table
         int master_index
@@ -174,10 +301,14 @@ struct address_space {
 
         if (!exists) {
             // Create new page directory pointer table
-            uintptr_t   p_address = (uintptr_t)palloc(lock_override);
+            bool      zeroed;
+            uintptr_t p_address = table_lock.take_frame(zeroed);
+            if (p_address == 0) { return nullptr; }
             page_table* target_pt = &pt_tables[master_index];
-            map_page_to(p_address, (uintptr_t)target_pt, lock_override);
-            for (int i = 0; i < 512; i++) { target_pt->data[i] = 0; }
+            map_page_to(p_address, (uintptr_t)target_pt);
+            if (!zeroed) {
+                for (int i = 0; i < 512; i++) { target_pt->data[i] = 0; }
+            }
             parent_table->data[parent_index]
                 = (uintptr_t)p_address | pt_present | pt_write_enabled;
         }
@@ -185,18 +316,47 @@ struct address_space {
         return &pt_tables[master_index];
     };
 
-    inline page_entry* get_page(uintptr_t virtual_address,
-                                bool      lock_override = false) {
+    inline page_entry* get_page(uintptr_t virtual_address) {
 
-        page_table* target_pt = get_page_table(virtual_address, lock_override);
+        page_table* target_pt = get_page_table(virtual_address);
+        if (target_pt == nullptr) { return nullptr; }
 
         // Return the corresponding page entry
         virtual_address %= page_table_size;
         return &(target_pt->data[virtual_address / PAGE_SIZE]);
     };
 
+    // Frame of the 4K page holding the address, which may be part of a
+    //  larger page. 0 if there wasn't the memory for its tables
     inline uintptr_t virt_to_phys(void* virtual_address) {
-        return (*get_page((uintptr_t)(virtual_address)) & real_address_bitmask);
+        uintptr_t address = (uintptr_t)virtual_address;
+
+        page_directory_pointer_table* upper
+            = get_page_directory_pointer_table(address);
+        if (upper == nullptr) { return 0; }
+
+        page_directory_entry pdp_entry
+            = upper->data[(address % page_directory_pointer_size)
+                          / page_directory_size];
+        if ((pdp_entry & pd_present) && (pdp_entry & pd_large_pages)) {
+            return (pdp_entry & physical_address_bitmask
+                    & ~(page_directory_size - 1))
+                   + round_down_page_aligned(address % page_directory_size);
+        }
+
+        page_directory_table* middle = get_page_directory(address);
+        if (middle == nullptr) { return 0; }
+
+        page_table_entry pd_entry
+            = middle->data[(address % page_directory_size) / page_table_size];
+        if ((pd_entry & pt_present) && (pd_entry & pt_large_pages)) {
+            return (pd_entry & physical_address_bitmask
+                    & ~(page_table_size - 1))
+                   + round_down_page_aligned(address % page_table_size);
+        }
+
+        page_entry* entry = get_page(address);
+        return (entry != nullptr) ? (*entry & real_address_bitmask) : 0;
     };
 };
 
@@ -212,23 +372,36 @@ extern void* kernel_end;
 struct kernel_only_address_space {
 
     sub_mem_manager sub_page_memory;
+    slab_allocator  slab_memory;
+    table_mutex     table_lock;
+    range_allocator free_ranges;
 
-    void* next_alloc_address;
+    // The kernel's half is never shared copy-on-write
+    static constexpr bool copy_on_write = false;
 
     kernel_only_address_space()
         : sub_page_memory(sub_page_memory)
-        , next_alloc_address(next_alloc_address) {}
+        , slab_memory(slab_memory)
+        , table_lock(table_lock)
+        , free_ranges(free_ranges) {}
 
     void initialize();
 
-    void* get_new_address(size_t needed_size) {
-        void* return_address = next_alloc_address;
-        next_alloc_address
-            = (void*)((uintptr_t)next_alloc_address + needed_size);
+    void* get_new_address(size_t needed_size, size_t alignment = PAGE_SIZE) {
+        return (void*)free_ranges.allocate(needed_size, alignment);
+    }
+
+    void release_address(void* address, size_t size) {
+        free_ranges.release((uintptr_t)address, size);
+    }
 
-        // Round to next page-aligned address
-        next_alloc_address = paging::round_up_page_aligned(next_alloc_address);
-        return return_address;
+    // Takes the range only if it's entirely free, for growing in place
+    bool claim_address(void* address, size_t size) {
+        return free_ranges.claim((uintptr_t)address, size);
+    }
+
+    inline page_directory_pointer_table_entry* level_4_entry(size_t index) {
+        return &pml4_table->data[index];
     }
 
     void identity_map_page(uintptr_t target_address);
@@ -237,19 +410,15 @@ struct kernel_only_address_space {
 
     void identity_map_region(uintptr_t target_address, size_t size);
 
-    void map_page_to(uintptr_t source_address, uintptr_t target_address,
-                     bool lock_override = false);
-    void map_pt_to(uintptr_t source_address, uintptr_t target_address,
-                   bool lock_override = false);
-    void map_pd_to(uintptr_t source_address, uintptr_t target_address,
-                   bool lock_override = false);
+    void map_page_to(uintptr_t source_address, uintptr_t target_address);
+    void map_pt_to(uintptr_t source_address, uintptr_t target_address);
+    void map_pd_to(uintptr_t source_address, uintptr_t target_address);
 
     void map_region_to(uintptr_t source_address, uintptr_t target_address,
-                       size_t size, bool lock_override = false);
+                       size_t size);
 
     inline page_directory_pointer_table*
-        get_page_directory_pointer_table(uintptr_t virtual_address,
-                                         bool      lock_override = false) {
+        get_page_directory_pointer_table(uintptr_t virtual_address) {
 
         // Check if it has a matching PDP entry in the level 4 table
         int  l4_index = ((virtual_address % page_level_4_table_size)
@@ -257,10 +426,14 @@ struct kernel_only_address_space {
         bool exists   = (pml4_table->data[l4_index] != 0);
         if (!exists) {
             // Create new page directory pointer table
-            uintptr_t p_address = (uintptr_t)palloc(lock_override);
+            bool      zeroed;
+            uintptr_t p_address = table_lock.take_frame(zeroed);
+            if (p_address == 0) { return nullptr; }
             page_directory_pointer_table* target_pdp = &pdp_tables[l4_index];
-            map_page_to(p_address, (uintptr_t)target_pdp, lock_override);
-            for (int i = 0; i < 512; i++) { target_pdp->data[i] = 0; }
+            map_page_to(p_address, (uintptr_t)target_pdp);
+            if (!zeroed) {
+                for (int i = 0; i < 512; i++) { target_pdp->data[i] = 0; }
+            }
 
             // Set into table(s)
             pml4_table->data[l4_index]
@@ -270,12 +443,11 @@ struct kernel_only_address_space {
         return &pdp_tables[l4_index];
     };
 
-    inline page_directory_table* get_page_directory(uintptr_t virtual_address,
-                                                    bool      lock_override
-                                                    = false) {
+    inline page_directory_table* get_page_directory(uintptr_t virtual_address) {
 
         page_directory_pointer_table* parent_table
-            = get_page_directory_pointer_table(virtual_address, lock_override);
+            = get_page_directory_pointer_table(virtual_address);
+        if (parent_table == nullptr) { return nullptr; }
 
         // Check if it has a matching PD entry in the PDP table
         int master_index = ((virtual_address % page_level_4_table_size)
@@ -286,10 +458,14 @@ struct kernel_only_address_space {
 
         if (!exists) {
             // Create new page directory table
-            uintptr_t             p_address = (uintptr_t)palloc(lock_override);
+            bool      zeroed;
+            uintptr_t p_address = table_lock.take_frame(zeroed);
+            if (p_address == 0) { return nullptr; }
             page_directory_table* target_pd = &pd_tables[master_index];
-            map_page_to(p_address, (uintptr_t)target_pd, lock_override);
-            for (int i = 0; i < 512; i++) { target_pd->data[i] = 0; }
+            map_page_to(p_address, (uintptr_t)target_pd);
+            if (!zeroed) {
+                for (int i = 0; i < 512; i++) { target_pd->data[i] = 0; }
+            }
             parent_table->data[parent_index]
                 = (uintptr_t)p_address | pd_present | pd_write_enabled;
         }
@@ -297,11 +473,11 @@ struct kernel_only_address_space {
         return &pd_tables[master_index];
     };
 
-    inline page_table* get_page_table(uintptr_t virtual_address,
-                                      bool      lock_override = false) {
+    inline page_table* get_page_table(uintptr_t virtual_address) {
 
         page_directory_table* parent_table
-            = get_page_directory(virtual_address, lock_override);
+            = get_page_directory(virtual_address);
+        if (parent_table == nullptr) { return nullptr; }
 
         // Check if it has a matching PT entry in the PD table
         int master_index
@@ -312,10 +488,14 @@ struct kernel_only_address_space {
 
         if (!exists) {
             // Create new page directory pointer table
-            uintptr_t   p_address = (uintptr_t)palloc(lock_override);
+            bool      zeroed;
+            uintptr_t p_address = table_lock.take_frame(zeroed);
+            if (p_address == 0) { return nullptr; }
             page_table* target_pt = &pt_tables[master_index];
-            map_page_to(p_address, (uintptr_t)target_pt, lock_override);
-            for (int i = 0; i < 512; i++) { target_pt->data[i] = 0; }
+            map_page_to(p_address, (uintptr_t)target_pt);
+            if (!zeroed) {
+                for (int i = 0; i < 512; i++) { target_pt->data[i] = 0; }
+            }
             parent_table->data[parent_index]
                 = (uintptr_t)p_address | pt_present | pt_write_enabled;
         }
@@ -323,24 +503,709 @@ struct kernel_only_address_space {
         return &pt_tables[master_index];
     };
 
-    inline page_entry* get_page(uintptr_t virtual_address,
-                                bool      lock_override = false) {
+    inline page_entry* get_page(uintptr_t virtual_address) {
 
-        page_table* target_pt = get_page_table(virtual_address, lock_override);
+        page_table* target_pt = get_page_table(virtual_address);
+        if (target_pt == nullptr) { return nullptr; }
 
         // Return the corresponding page entry
         virtual_address %= page_table_size;
         return &(target_pt->data[virtual_address / PAGE_SIZE]);
     };
 
+    // Frame of the 4K page holding the address, which may be part of a
+    //  larger page. 0 if there wasn't the memory for its tables
     inline uintptr_t virt_to_phys(void* virtual_address) {
-        return (*get_page((uintptr_t)(virtual_address)) & real_address_bitmask);
+        uintptr_t address = (uintptr_t)virtual_address;
+
+        page_directory_pointer_table* upper
+            = get_page_directory_pointer_table(address);
+        if (upper == nullptr) { return 0; }
+
+        page_directory_entry pdp_entry
+            = upper->data[(address % page_directory_pointer_size)
+                          / page_directory_size];
+        if ((pdp_entry & pd_present) && (pdp_entry & pd_large_pages)) {
+            return (pdp_entry & physical_address_bitmask
+                    & ~(page_directory_size - 1))
+                   + round_down_page_aligned(address % page_directory_size);
+        }
+
+        page_directory_table* middle = get_page_directory(address);
+        if (middle == nullptr) { return 0; }
+
+        page_table_entry pd_entry
+            = middle->data[(address % page_directory_size) / page_table_size];
+        if ((pd_entry & pt_present) && (pd_entry & pt_large_pages)) {
+            return (pd_entry & physical_address_bitmask
+                    & ~(page_table_size - 1))
+                   + round_down_page_aligned(address % page_table_size);
+        }
+
+        page_entry* entry = get_page(address);
+        return (entry != nullptr) ? (*entry & real_address_bitmask) : 0;
     };
 };
 
 #pragma GCC diagnostic pop
 
 extern kernel_only_address_space kernel_address_space;
+
+// The kernel's tables are reached the same way from every space, so can be
+//  edited with whatever is loaded
+inline address_space* enter_tables(kernel_only_address_space&) {
+    return nullptr;
+}
+inline void leave_tables(kernel_only_address_space&, address_space*) {}
+
+// A space's own tables are only reached through its windows while it's
+//  loaded, so it's switched to for the length of a transaction on it
+inline address_space* enter_tables(address_space& space) {
+    return enter_address_space(&space);
+}
+inline void leave_tables(address_space& space, address_space* previous) {
+    leave_address_space(&space, previous);
+}
+
+/**
+ * @brief Groups updates to an address space's tables under a single hold of
+ *          its table lock, with entries being written directly and the TLB
+ *          only being flushed once, on every core, when committed
+ *
+ * @tparam space_type   address_space or kernel_only_address_space
+ */
+template<class space_type> class mapping_transaction {
+    space_type&    space;
+    uint64_t       saved_flags;
+    address_space* previous_space;
+    bool           committed = false;
+
+    // Addresses whose old mappings were replaced, past the threshold the
+    //  whole TLB is flushed instead
+    uintptr_t stale_pages[flush_page_threshold];
+    size_t    num_stale = 0;
+
+    // Last page table written to, for runs of 4K entries
+    page_table* current_table = nullptr;
+    uintptr_t   current_base  = 0;
+
+    // Set while a large entry is being broken up, or a shared table copied,
+    //  which has to finish without the tables being released
+    bool splitting = false;
+
+    // Set once a table couldn't be made for want of a frame, after which
+    //  whatever needed it is left unmapped
+    bool out_of_frames = false;
+
+    // Stocks the spare table frames when running low, which can only be done
+    //  with the tables released
+    inline void restock() {
+        if (!splitting && space.table_lock.outermost()
+            && space.table_lock.needs_stock()) {
+            leave_tables(space, previous_space);
+            space.table_lock.unlock(saved_flags);
+            space.table_lock.stock();
+            saved_flags    = space.table_lock.lock();
+            previous_space = enter_tables(space);
+        }
+    }
+
+    inline void stale(uintptr_t address) {
+        if (num_stale < flush_page_threshold) {
+            stale_pages[num_stale] = address;
+        }
+        num_stale++;
+    }
+
+    // Points a table window at a new table, flushed straight away as the
+    //  window is written through immediately
+    inline void map_window(uintptr_t table_frame, void* window) {
+        map_page(table_frame, (uintptr_t)window);
+        refresh_page(window);
+        current_table = nullptr;
+    }
+
+    inline page_directory_entry* pdp_entry(uintptr_t target_address) {
+        // Tables still shared with a clone can't be written to
+        if (space.copy_on_write && target_address >= user_half_start
+            && target_address < user_half_end) {
+            unshare(target_address, false);
+        }
+
+        page_directory_pointer_table* table
+            = space.get_page_directory_pointer_table(target_address);
+        if (table == nullptr) {
+            out_of_frames = true;
+            return nullptr;
+        }
+
+        return &table->data[(target_address % page_directory_pointer_size)
+                            / page_directory_size];
+    }
+
+    // Directory entry for the address, breaking up a 1 GiB page over it
+    page_table_entry* pd_entry(uintptr_t target_address) {
+        page_directory_entry* parent = pdp_entry(target_address);
+        if (parent == nullptr) { return nullptr; }
+        if ((*parent & pd_present) && (*parent & pd_large_pages)
+            && !split_pd(target_address, parent)) {
+            return nullptr;
+        }
+
+        page_directory_table* directory
+            = space.get_page_directory(target_address);
+        if (directory == nullptr) {
+            out_of_frames = true;
+            return nullptr;
+        }
+
+        return &directory->data[(target_address % page_directory_size)
+                                / page_table_size];
+    }
+
+    // Replaces a 1 GiB entry with a directory of 2 MiB entries, which is
+    //  filled before being swapped in. Left as it is if there's no frame
+    //  for the directory
+    bool split_pd(uintptr_t target_address, page_directory_entry* entry) {
+        uintptr_t frame = *entry & physical_address_bitmask
+                          & ~(page_directory_size - 1);
+        uintptr_t new_directory = space.table_lock.take_frame();
+        if (new_directory == 0) {
+            out_of_frames = true;
+            return false;
+        }
+
+        bool was_splitting = splitting;
+        splitting               = true;
+
+        page_directory_table* window
+            = &pd_tables[(target_address % page_level_4_table_size)
+                         / page_directory_size];
+        map_window(new_directory, window);
+        for (size_t i = 0; i < 512; i++) {
+            window->data[i] = (frame + (i * page_table_size)) | pt_present
+                              | pt_write_enabled | pt_large_pages;
+        }
+
+        *entry    = new_directory | pd_present | pd_write_enabled;
+        splitting = was_splitting;
+        stale(target_address);
+        return true;
+    }
+
+    // Replaces a 2 MiB entry with a table of 4K entries
+    bool split_pt(uintptr_t target_address, page_table_entry* entry) {
+        uintptr_t frame
+            = *entry & physical_address_bitmask & ~(page_table_size - 1);
+        uintptr_t new_table = space.table_lock.take_frame();
+        if (new_table == 0) {
+            out_of_frames = true;
+            return false;
+        }
+
+        bool was_splitting = splitting;
+        splitting               = true;
+
+        page_table* window
+            = &pt_tables[(target_address % page_level_4_table_size)
+                         / page_table_size];
+        map_window(new_table, window);
+        for (size_t i = 0; i < 512; i++) {
+            window->data[i]
+                = (frame + (i * PAGE_SIZE)) | p_present | p_write_enabled;
+        }
+
+        *entry    = new_table | pt_present | pt_write_enabled;
+        splitting = was_splitting;
+        stale(target_address);
+        return true;
+    }
+
+    /**
+     * @brief Gives the space its own copy of a table it shares with a clone.
+     *          The entries in it are marked first, in the shared table as
+     *          well, so neither side can write through them without copying
+     *          them in turn
+     *
+     * @param entry         Entry pointing at the shared table
+     * @param window        Window the table is seen through
+     * @param base          First address covered by the table
+     * @param child_size    Size covered by each entry of the table
+     * @return              False, with nothing shared, if there wasn't the
+     *                      memory for the copy or to count the table's
+     *                      frames
+     */
+    bool unshare_table(uint64_t* entry, uint64_t* window, uintptr_t base,
+                       size_t child_size) {
+
+        // The present, write and copy-on-write bits sit in the same place at
+        //  every level, so each is handled the same way
+        uintptr_t frame = *entry & physical_address_bitmask;
+        if (frame_refs.sharers(frame) == 0) {
+            // Everyone else has already taken their own copy
+            *entry = (*entry | p_write_enabled) & ~(uint64_t)p_copy_on_write;
+            return true;
+        }
+
+        uintptr_t new_table = space.table_lock.take_frame();
+        if (new_table == 0) {
+            out_of_frames = true;
+            return false;
+        }
+
+        // Every count is backed before anything is marked, so sharing can't
+        //  fail partway. Splitting doesn't change what's mapped, so is fine
+        //  to leave done if it does
+        for (size_t i = 0; i < 512; i++) {
+            if (!(window[i] & p_present)) { continue; }
+
+            // Large pages are only ever shared as whole tables of smaller ones
+            bool split = true;
+            if (child_size != PAGE_SIZE && (window[i] & pt_large_pages)) {
+                split = (child_size == page_directory_size)
+                            ? split_pd(base + (i * child_size), &window[i])
+                            : split_pt(base + (i * child_size), &window[i]);
+            }
+
+            if (!split
+                || !frame_refs.prepare(window[i] & physical_address_bitmask)) {
+                pfree(new_table);
+                return false;
+            }
+        }
+        frame_refs.release(frame);
+
+        for (size_t i = 0; i < 512; i++) {
+            if (!(window[i] & p_present)) { continue; }
+
+            window[i] = (window[i] & ~(uint64_t)p_write_enabled)
+                        | p_copy_on_write;
+            frame_refs.share(window[i] & physical_address_bitmask);
+        }
+
+        copy_frame(new_table, window);
+        *entry = new_table | (*entry & ~physical_address_bitmask
+                              & ~(uint64_t)p_copy_on_write)
+                 | p_write_enabled;
+        map_window(new_table, window);
+        return true;
+    }
+
+    bool unshare_path(uintptr_t target_address, bool include_page) {
+        size_t    l4_index = target_address / page_directory_pointer_size;
+        uintptr_t base     = l4_index * page_directory_pointer_size;
+        uint64_t* entry    = space.level_4_entry(l4_index);
+        if (!(*entry & pdp_present)) { return false; }
+        if (*entry & pdp_copy_on_write) {
+            if (!unshare_table(entry, pdp_tables[l4_index].data, base,
+                               page_directory_size)) {
+                return false;
+            }
+        }
+
+        entry = &pdp_tables[l4_index].data[(target_address - base)
+                                            / page_directory_size];
+        base  = target_address - (target_address % page_directory_size);
+        if (!(*entry & pd_present)) { return false; }
+        if (*entry & pd_large_pages) { return (*entry & pd_write_enabled); }
+
+        uint64_t* directory
+            = pd_tables[target_address / page_directory_size].data;
+        if (*entry & pd_copy_on_write) {
+            if (!unshare_table(entry, directory, base, page_table_size)) {
+                return false;
+            }
+        }
+
+        entry = &directory[(target_address - base) / page_table_size];
+        base  = target_address - (target_address % page_table_size);
+        if (!(*entry & pt_present)) { return false; }
+        if (*entry & pt_large_pages) { return (*entry & pt_write_enabled); }
+
+        uint64_t* table = pt_tables[target_address / page_table_size].data;
+        if (*entry & pt_copy_on_write) {
+            if (!unshare_table(entry, table, base, PAGE_SIZE)) {
+                return false;
+            }
+        }
+        if (!include_page) { return false; }
+
+        entry = &table[(target_address - base) / PAGE_SIZE];
+        if (!(*entry & p_present)) { return false; }
+        if (*entry & p_copy_on_write) {
+            uintptr_t page   = target_address - (target_address % PAGE_SIZE);
+            uintptr_t shared = *entry & physical_address_bitmask;
+            if (frame_refs.sharers(shared) != 0) {
+                // Still readable through the shared frame while copying, and
+                //  only let go of once there's a copy to replace it with
+                uintptr_t copy = space.table_lock.take_frame();
+                if (copy == 0) {
+                    out_of_frames = true;
+                    return false;
+                }
+
+                copy_frame(copy, (void*)page);
+                frame_refs.release(shared);
+                *entry = copy | (*entry & ~physical_address_bitmask);
+            }
+            *entry = (*entry | p_write_enabled) & ~(uint64_t)p_copy_on_write;
+            stale(page);
+        }
+        return (*entry & p_write_enabled);
+    }
+
+    // Takes copies of every shared table over the address, and of the page
+    //  itself if asked to. Returns whether the page can now be written to
+    inline bool unshare(uintptr_t target_address, bool include_page) {
+        bool was_splitting = splitting;
+        splitting          = true;
+        frame_refs.lock.lock();
+
+        bool writable = unshare_path(target_address, include_page);
+
+        frame_refs.lock.unlock();
+        splitting = was_splitting;
+        return writable;
+    }
+
+    // Page table for the address, breaking up a 2 MiB page over it
+    page_table* table_for(uintptr_t target_address) {
+        restock();
+
+        page_table_entry* parent = pd_entry(target_address);
+        if (parent == nullptr) { return nullptr; }
+        if ((*parent & pt_present) && (*parent & pt_large_pages)
+            && !split_pt(target_address, parent)) {
+            return nullptr;
+        }
+
+        page_table* target_table = space.get_page_table(target_address);
+        if (target_table == nullptr) {
+            out_of_frames = true;
+            return nullptr;
+        }
+
+        current_base  = target_address - (target_address % page_table_size);
+        current_table = target_table;
+        return target_table;
+    }
+
+    inline page_entry* page_for(uintptr_t target_address) {
+        page_table* target_table = current_table;
+        if (target_table == nullptr
+            || (target_address - current_base) >= page_table_size) {
+            target_table = table_for(target_address);
+            if (target_table == nullptr) { return nullptr; }
+        }
+
+        return &target_table->data[(target_address % page_table_size)
+                                   / PAGE_SIZE];
+    }
+
+  public:
+    mapping_transaction(space_type& target_space)
+        : space(target_space) {
+        saved_flags    = space.table_lock.lock();
+        previous_space = enter_tables(space);
+        restock();
+    }
+
+    ~mapping_transaction() { commit(); }
+
+    // Whether anything was left unmapped for want of a frame for its tables
+    inline bool failed() const { return out_of_frames; }
+
+    void map_page(uintptr_t source_address, uintptr_t target_address) {
+        page_entry* target_entry = page_for(target_address);
+        if (target_entry == nullptr) { return; }
+
+        page_entry old_entry = *target_entry;
+        *target_entry        = (source_address & real_address_bitmask)
+                        | p_present | p_write_enabled;
+
+        // Nothing to invalidate for a previously empty entry
+        if (old_entry & p_present) { stale(target_address); }
+    }
+
+    // Maps 2 MiB, with a single large entry if the table isn't split yet
+    void map_pt(uintptr_t source_address, uintptr_t target_address) {
+        source_address -= (source_address % page_table_size);
+        target_address -= (target_address % page_table_size);
+        restock();
+
+        page_table_entry* target_entry = pd_entry(target_address);
+        if (target_entry == nullptr) { return; }
+        if ((*target_entry & pt_present) && !(*target_entry & pt_large_pages)) {
+            // Already split into a page table, fill that table instead
+            for (size_t i = 0; i < 512; i++) {
+                map_page(source_address + (i * PAGE_SIZE),
+                         target_address + (i * PAGE_SIZE));
+            }
+            return;
+        }
+
+        page_table_entry old_entry = *target_entry;
+        *target_entry = source_address | pt_present | pt_write_enabled
+                        | pt_large_pages;
+        if (old_entry & pt_present) { stale(target_address); }
+    }
+
+    // Maps 1 GiB, with a single large entry if the processor supports it
+    //  and the directory isn't split yet
+    void map_pd(uintptr_t source_address, uintptr_t target_address) {
+        source_address -= (source_address % page_directory_size);
+        target_address -= (target_address % page_directory_size);
+        restock();
+
+        page_directory_entry* target_entry = pdp_entry(target_address);
+        if (target_entry == nullptr) { return; }
+        if (!use_gigabyte_pages
+            || ((*target_entry & pd_present)
+                && !(*target_entry & pd_large_pages))) {
+            // Already split, or no 1 GiB pages here, so use 2 MiB entries
+            for (size_t i = 0; i < 512; i++) {
+                map_pt(source_address + (i * page_table_size),
+                       target_address + (i * page_table_size));
+            }
+            return;
+        }
+
+        page_directory_entry old_entry = *target_entry;
+        *target_entry = source_address | pd_present | pd_write_enabled
+                        | pd_large_pages;
+        if (old_entry & pd_present) { stale(target_address); }
+    }
+
+    void map_region(uintptr_t source_address, uintptr_t target_address,
+                    size_t size) {
+
+        // Ensure that addresses (and size) fall along page lines
+        size += (target_address % PAGE_SIZE);
+        target_address -= (target_address % PAGE_SIZE);
+        source_address -= (source_address % PAGE_SIZE);
+
+        while (size && !out_of_frames) {
+            // Use the largest page that both addresses line up with
+            uintptr_t alignment = (source_address | target_address);
+            if ((size >= page_directory_size)
+                && ((alignment & (page_directory_size - 1)) == 0)) {
+                map_pd(source_address, target_address);
+                source_address += page_directory_size;
+                target_address += page_directory_size;
+                size -= page_directory_size;
+
+            } else if ((size >= page_table_size)
+                       && ((alignment & (page_table_size - 1)) == 0)) {
+                map_pt(source_address, target_address);
+                source_address += page_table_size;
+                target_address += page_table_size;
+                size -= page_table_size;
+
+            } else {
+                map_page(source_address, target_address);
+                source_address += PAGE_SIZE;
+                target_address += PAGE_SIZE;
+                size = (size > PAGE_SIZE) ? (size - PAGE_SIZE) : 0;
+            }
+        }
+    }
+
+    // Clears every mapping in the region, large pages only partly covered
+    //  by it are broken up first
+    void unmap_region(uintptr_t target_address, size_t size) {
+
+        // Ensure that addresses (and size) fall along page lines
+        size += (target_address % PAGE_SIZE);
+        target_address -= (target_address % PAGE_SIZE);
+
+        while (size) {
+            size_t step = PAGE_SIZE;
+
+            page_directory_entry* upper = pdp_entry(target_address);
+            page_table_entry*     middle;
+            if (upper == nullptr || !(*upper & pd_present)) {
+                // Nothing mapped in this whole 1 GiB
+                step = page_directory_size
+                       - (target_address % page_directory_size);
+
+            } else if ((*upper & pd_large_pages)
+                       && (target_address % page_directory_size) == 0
+                       && size >= page_directory_size) {
+                *upper = 0;
+                stale(target_address);
+                step = page_directory_size;
+
+            } else if ((middle = pd_entry(target_address)) == nullptr
+                       || !(*middle & pt_present)) {
+                step = page_table_size - (target_address % page_table_size);
+
+            } else if ((*middle & pt_large_pages)
+                       && (target_address % page_table_size) == 0
+                       && size >= page_table_size) {
+                *middle = 0;
+                stale(target_address);
+                step = page_table_size;
+
+            } else {
+                page_entry* target_entry = page_for(target_address);
+                if (target_entry != nullptr && (*target_entry & p_present)) {
+                    *target_entry = 0;
+                    stale(target_address);
+                }
+            }
+
+            target_address += step;
+            size = (size > step) ? (size - step) : 0;
+        }
+    }
+
+    // Maps a 4K page only if nothing is there yet, returning whether it did
+    bool fill_page(uintptr_t source_address, uintptr_t target_address) {
+        page_entry* target_entry = page_for(target_address);
+        if (target_entry == nullptr || (*target_entry & p_present)) {
+            return false;
+        }
+
+        *target_entry = (source_address & real_address_bitmask) | p_present
+                        | p_write_enabled;
+        return true;
+    }
+
+    // Entry for a 4K page, creating its tables, for entries that are kept
+    //  up by hand afterwards. nullptr if the tables couldn't be made
+    inline page_entry* entry_for(uintptr_t target_address) {
+        return page_for(target_address);
+    }
+
+    /**
+     * @brief Clears the 4K mappings in a region, handing back the frames
+     *          they pointed at
+     *
+     * @param target_address    Start of the region
+     * @param size              Size of the region
+     * @param frames            Filled with the frames that were mapped
+     * @param max_frames        Stops once this many frames have been found
+     * @param num_frames        Set to the number of frames found
+     * @return size_t           Bytes of the region gone through
+     */
+    size_t take_pages(uintptr_t target_address, size_t size, uintptr_t* frames,
+                      size_t max_frames, size_t& num_frames) {
+        size_t done = 0;
+        num_frames  = 0;
+
+        while (done < size && num_frames < max_frames) {
+            size_t step = PAGE_SIZE;
+
+            page_directory_entry* upper = pdp_entry(target_address);
+            page_table_entry*     middle;
+            if (upper == nullptr || !(*upper & pd_present)
+                || (*upper & pd_large_pages)) {
+                // Nothing of ours in this whole 1 GiB
+                step = page_directory_size
+                       - (target_address % page_directory_size);
+
+            } else if ((middle = pd_entry(target_address)) == nullptr
+                       || !(*middle & pt_present)
+                       || (*middle & pt_large_pages)) {
+                step = page_table_size - (target_address % page_table_size);
+
+            } else {
+                page_entry* target_entry = page_for(target_address);
+                if (target_entry != nullptr && (*target_entry & p_present)) {
+                    frames[num_frames++]
+                        = *target_entry & physical_address_bitmask;
+                    *target_entry = 0;
+                    stale(target_address);
+                }
+            }
+
+            target_address += step;
+            done += step;
+        }
+
+        return (done < size) ? done : size;
+    }
+
+    /**
+     * @brief Points the space's windows at the tables under one of its level
+     *          4 entries, for a space given tables made elsewhere
+     *
+     * @param l4_index  Level 4 entry the tables are under
+     * @return          False if there wasn't the memory for the windows
+     */
+    bool adopt_tables(size_t l4_index) {
+        page_directory_pointer_table_entry entry
+            = *space.level_4_entry(l4_index);
+        if (!(entry & pdp_present)) { return true; }
+
+        page_directory_pointer_table* pdp = &pdp_tables[l4_index];
+        map_window(entry & physical_address_bitmask, pdp);
+        if (out_of_frames) { return false; }
+
+        for (size_t i = 0; i < 512; i++) {
+            if (!(pdp->data[i] & pd_present)
+                || (pdp->data[i] & pd_large_pages)) {
+                continue;
+            }
+
+            size_t                pd_index  = (l4_index * 512) + i;
+            page_directory_table* directory = &pd_tables[pd_index];
+            map_window(pdp->data[i] & physical_address_bitmask, directory);
+            if (out_of_frames) { return false; }
+
+            for (size_t j = 0; j < 512; j++) {
+                if (!(directory->data[j] & pt_present)
+                    || (directory->data[j] & pt_large_pages)) {
+                    continue;
+                }
+
+                map_window(directory->data[j] & physical_address_bitmask,
+                           &pt_tables[(pd_index * 512) + j]);
+                if (out_of_frames) { return false; }
+            }
+        }
+        return true;
+    }
+
+    // Takes a copy of whatever is shared over an address that was written
+    //  to, returning false if it isn't writable even then
+    bool resolve_write(uintptr_t target_address) {
+        if (!space.copy_on_write || target_address < user_half_start
+            || target_address >= user_half_end) {
+            return false;
+        }
+        return unshare(target_address, true);
+    }
+
+    // Releases the tables, then flushes whatever was replaced everywhere
+    void commit() {
+        if (committed) { return; }
+        committed = true;
+
+        bool nested = !space.table_lock.outermost();
+        leave_tables(space, previous_space);
+        space.table_lock.unlock(saved_flags);
+
+        if (nested) {
+            // Nested transactions only ever fill empty window entries, and
+            //  the tables are still held further up, so stay local
+            if (num_stale > flush_page_threshold) {
+                refresh_all_pages();
+            } else {
+                for (size_t i = 0; i < num_stale; i++) {
+                    refresh_page((void*)stale_pages[i]);
+                }
+            }
+        } else {
+            shootdown(stale_pages, num_stale);
+        }
+    }
+};
+
+// Handles a write to a page the space shares with a clone, returning false
+//  if the fault was for anything else
+bool copy_on_write_fault(address_space* space, uintptr_t address);
+
 } // namespace paging
 
 #endif
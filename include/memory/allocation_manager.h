@@ -8,10 +8,6 @@
 #include <stddef.h>
 #include <stdint.h>
 
-class allocation_manager;
-
-extern allocation_manager kernel_allocation_manager;
-
 struct allocation_info {
     uintptr_t        address;
     chunking::chunk* chunks;
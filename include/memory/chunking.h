@@ -3,9 +3,11 @@
 
 #include "addressing.h"
 #include "libk/callable.h"
+#include "libk/cstring.h"
 #include "libk/functional.h"
 #include "libk/mutex.h"
 #include "memory/chunking_predef.h"
+#include "memory/mem_stats.h"
 #include "memory/p_memory.h"
 #include "memory/paging.h"
 #include "system/error.h"
@@ -43,118 +45,173 @@ struct chunk {
         return (void*)((uintptr_t)target + size);
     }
 
-    void* lock_override_map_to(void* target, int lock_override_index) {
-        paging::kernel_address_space.map_region_to(
-            p_start, (uintptr_t)target, size, (lock_override_index == 0));
-        return (void*)((uintptr_t)target + size);
+    // Ordered by physical address
+    friend bool operator<(const chunk& lhs, const chunk& rhs) {
+        return (lhs.p_start < rhs.p_start);
+    }
+    friend bool operator>(const chunk& lhs, const chunk& rhs) {
+        return rhs < lhs;
     }
 };
 
+constexpr unsigned int RESERVOIR_BLOCK_CHUNKS
+    = (RESERVOIR_BLOCK_SIZE - (2 * sizeof(void*))) / sizeof(chunk);
+
+// Fixed-size piece of a reservoir's stack. Blocks emptied by taking chunks
+//  are left above the top of the stack, ready to be filled again
+struct chunk_block {
+    chunk_block* below;
+    chunk_block* above;
+    chunk        chunks[RESERVOIR_BLOCK_CHUNKS];
+};
+static_assert(sizeof(chunk_block) <= RESERVOIR_BLOCK_SIZE);
+
+extern chunk_block reservoir_blocks[MAX_NUMA_DOMAINS][NUM_MEMORY_PILES];
+
+// Stack of free chunks of a single size, made of linked blocks so it can
+//  grow without anything being copied. Every block below the top one is
+//  kept full, so pushing and popping never has to look past the top
 struct chunk_reservoir {
+    unsigned int domain;
     unsigned int pile_index;
     size_t       chunk_size;
 
-    chunk* start;
-    chunk* last;
-    chunk* end;
-
   private:
-    std_k::mutex access_lock;
-    bool         can_free_reservoir;
+    chunk_block* top;
+    unsigned int top_count;
+    int          total;
 
-  public:
-    chunk_reservoir()
-        : pile_index(pile_index)
-        , chunk_size(chunk_size)
-        , start(start)
-        , last(last)
-        , end(end)
-        , access_lock()
-        , can_free_reservoir(can_free_reservoir) {}
-    chunk_reservoir(unsigned int pile_index)
-        : pile_index(pile_index)
-        , can_free_reservoir(false) {
-        chunk_size = (PAGE_SIZE << (pile_index * 4));
+    std_k::mutex access_lock;
 
-        start = &reservoir_chunks[pile_index][1];
-        last  = &reservoir_chunks[pile_index][0];
-        end   = &reservoir_chunks[pile_index + 1][0];
-    }
+    // Size at which the next coalescing pass is made
+    int next_coalesce;
 
-    int size() { return (last - start) + 1; }
+    // Buffer the chunks are sorted in while coalescing, only ever grown
+    //  by callers that aren't holding any other allocator locks
+    chunk* scratch;
+    int    scratch_size;
 
-    chunk get_chunk(bool lock_override = false);
+    bool grow_scratch();
 
-    void get_chunks(int num_chunks, chunk* target_buffer,
-                    bool lock_override = false) {
+    // Pushes the chunks, returning the new size. Blocks are only ever
+    //  allocated with the lock released, so taking chunks from this same
+    //  reservoir to build one is fine
+    int push_chunks(chunk* new_chunks, int num_chunks);
 
-        if (!lock_override) access_lock.lock();
+    // These expect the lock to be held
+    inline bool has_room() const {
+        return top_count < RESERVOIR_BLOCK_CHUNKS || top->above != nullptr;
+    }
 
-        for (int i = 0; i < num_chunks; i++) {
-            target_buffer[i] = get_chunk(true);
+    inline void push(chunk new_chunk) {
+        if (top_count == RESERVOIR_BLOCK_CHUNKS) {
+            top       = top->above;
+            top_count = 0;
         }
+        top->chunks[top_count++] = new_chunk;
+        total++;
+    }
 
-        if (!lock_override) access_lock.unlock();
-
-        return;
+    inline bool pop(chunk& value) {
+        if (top_count == 0) {
+            if (top->below == nullptr) { return false; }
+            top       = top->below;
+            top_count = RESERVOIR_BLOCK_CHUNKS;
+        }
+        value = top->chunks[--top_count];
+        total--;
+        return true;
     }
 
-    void add_chunk(chunk new_chunk, bool lock_override = false) {
+    // Links a new, empty block in straight above the top one
+    inline void link_block(chunk_block* block) {
+        block->below = top;
+        block->above = top->above;
+        if (top->above != nullptr) { top->above->below = block; }
+        top->above = block;
+    }
 
-        if (new_chunk.size == 0) { return; }
+  public:
+    chunk_reservoir()
+        : domain(domain)
+        , pile_index(pile_index)
+        , chunk_size(chunk_size)
+        , top(top)
+        , top_count(top_count)
+        , total(total)
+        , access_lock()
+        , next_coalesce(next_coalesce)
+        , scratch(scratch)
+        , scratch_size(scratch_size) {}
+    chunk_reservoir(unsigned int domain, unsigned int pile_index)
+        : domain(domain)
+        , pile_index(pile_index)
+        , top(&reservoir_blocks[domain][pile_index])
+        , top_count(0)
+        , total(0)
+        , next_coalesce(RESERVOIR_DEFAULT_SIZE)
+        , scratch(nullptr)
+        , scratch_size(0) {
+        chunk_size = (PAGE_SIZE << (pile_index * 4));
 
-        if (!lock_override) { access_lock.lock(); }
+        top->below = nullptr;
+        top->above = nullptr;
+    }
 
-        // Calculate new position
-        chunk* new_position = (chunk*)((uintptr_t)last + sizeof(chunk));
+    int size() { return __atomic_load_n(&total, __ATOMIC_RELAXED); }
 
-        // Check if this would be a valid location
-        if ((uintptr_t)new_position > (uintptr_t)end) {
-            // Get new, larger array
-            unsigned int current_count
-                = (((uintptr_t)end - (uintptr_t)start) / sizeof(chunk));
+    chunk get_chunk();
 
-            chunk* new_start
-                = (chunk*)lock_override_alloc((sizeof(chunk) * 2), pile_index);
-            chunk* new_end  = &new_start[current_count * 2];
-            chunk* new_last = (chunk*)((uintptr_t)new_start
-                                       + ((uintptr_t)last - (uintptr_t)start));
+    void get_chunks(int num_chunks, chunk* target_buffer) {
+        int taken = take_chunks(target_buffer, num_chunks);
 
-            chunk* source = start;
-            chunk* dest   = new_start;
-            while ((uintptr_t)dest < (uintptr_t)new_last) {
-                *dest  = *source;
-                source = (chunk*)((uintptr_t)source + sizeof(chunk));
-                dest   = (chunk*)((uintptr_t)dest + sizeof(chunk));
-            }
+        // Anything short is rebuilt from other sizes, a chunk at a time
+        for (int i = taken; i < num_chunks; i++) {
+            target_buffer[i] = get_chunk();
+        }
+    }
 
-            start = new_start;
-            end   = new_end;
-            last  = new_last;
+    void add_chunk(chunk new_chunk) { add_chunks(&new_chunk, 1); }
 
-            if (can_free_reservoir) {
-                lock_override_free(start, pile_index);
-            } else {
-                can_free_reservoir = true;
-            }
+    // Without can_grow, a coalescing pass this sets off only uses the
+    //  scratch space that's already there, for callers under a pile lock
+    void add_chunks(chunk* new_chunks, int num_chunks, bool can_grow = true) {
+        if (push_chunks(new_chunks, num_chunks) >= next_coalesce) {
+            coalesce(can_grow);
         }
+    }
 
-        // Put this chunk in the new position
-        last  = (chunk*)((uintptr_t)last + sizeof(chunk));
-        *last = new_chunk;
+    // Removes up to max_chunks chunks, without breaking down larger ones,
+    //  copying them out a block at a time from the top of the stack
+    int take_chunks(chunk* target_buffer, int max_chunks) {
 
-        if (!lock_override) { access_lock.unlock(); }
-    }
+        access_lock.lock();
 
-    void add_chunks(chunk* new_chunks, int num_chunks,
-                    bool lock_override = false) {
+        int num_chunks = 0;
+        while (num_chunks < max_chunks && total > 0) {
+            if (top_count == 0) {
+                top       = top->below;
+                top_count = RESERVOIR_BLOCK_CHUNKS;
+            }
 
-        if (!lock_override) access_lock.lock();
+            int batch = max_chunks - num_chunks;
+            if (batch > (int)top_count) { batch = top_count; }
 
-        for (int i = 0; i < num_chunks; i++) { add_chunk(new_chunks[i], true); }
+            top_count -= batch;
+            std_k::memcpy(&target_buffer[num_chunks], &top->chunks[top_count],
+                          sizeof(chunk) * batch);
+            num_chunks += batch;
+            total -= batch;
+        }
 
-        if (!lock_override) access_lock.unlock();
+        access_lock.unlock();
+        return num_chunks;
     }
+
+    // Merges aligned runs of chunks into chunks of the next size, which
+    //  go to the next reservoir. can_grow is passed on to any pass that
+    //  sets off there
+    void coalesce(bool can_grow = true);
 };
 
 inline unsigned int get_chunk_index(size_t size) {
@@ -187,108 +244,172 @@ inline unsigned int get_num_chunks(size_t size,
 struct chunk_pile {
 
     unsigned int pile_index = 0;
+    unsigned int domain     = 0;
     size_t       chunk_size = 0;
 
+    // Chunks that had to be taken from another domain's reservoir
+    size_t remote_chunks = 0;
+
   private:
-    chunk                                     chunks[CHUNKS_PER_PILE];
-    int                                       next_chunk   = -1;
-    threading::process*                       refresh_task = 0;
-    std_k::mutex                              refresh_task_active;
-    std_k::preset_function<void(chunk_pile&)> refresh_task_call;
+    chunk chunks[CHUNKS_PER_PILE];
+    int   next_chunk = -1;
+
+    // Set once the pile drops below its low watermark, for the core to top
+    //  it back up the next time it's idle
+    bool refill_wanted = false;
 
     std_k::mutex access_lock;
 
+    // Moves chunks over from the reservoir until the pile is back up to
+    //  its high watermark, taking the reservoir's lock once per batch.
+    //  Expects the pile's own lock to be held
+    void refill() {
+        chunk_reservoir& reservoir = memory_reservoirs[domain][pile_index];
+
+        refill_wanted = false;
+        int wanted    = (int)PILE_HIGH_WATERMARK - size();
+        if (wanted <= 0) { return; }
+
+        int taken = reservoir.take_chunks(&chunks[next_chunk + 1], wanted);
+
+        // Nothing ready to go, so let the reservoir rebuild some from
+        //  other sizes, which leaves the rest of them ready for a batch
+        if (taken == 0) {
+            chunk rebuilt = reservoir.get_chunk();
+            if (rebuilt.size == 0) { return; }
+
+            chunks[++next_chunk] = rebuilt;
+            taken
+                = reservoir.take_chunks(&chunks[next_chunk + 1], wanted - 1);
+        }
+
+        next_chunk += taken;
+        mem_stats::count(mem_stats::pile_refill, pile_index);
+    }
+
   public:
-    chunk_pile()
-        : refresh_task_call(refill_chunks, *this) {};
-    chunk_pile(unsigned int pile_index)
+    chunk_pile() {};
+    chunk_pile(unsigned int pile_index, unsigned int domain)
         : pile_index(pile_index)
-        , refresh_task_call(refill_chunks, *this) {
+        , domain(domain) {
 
         // Set chunk size
         chunk_size = (PAGE_SIZE << (pile_index * 4));
 
         // Fill chunks from reservoir
         for (unsigned int i = 0; i < CHUNKS_PER_PILE; i++) {
-            chunks[i] = memory_reservoirs[pile_index].get_chunk();
+            chunks[i] = memory_reservoirs[domain][pile_index].get_chunk();
             if (chunks[i].size) { next_chunk = i; }
         }
-
-        // Create refill process
-        refresh_task = new threading::process(4, 1, &refresh_task_call);
-        refresh_task->config.wait_on_end = true;
     }
 
     int size() { return (next_chunk + 1); }
 
-    static void refill_chunks(chunk_pile& target) {
-
-        target.access_lock.lock();
+    // Tops the pile up if it has dropped below its low watermark, for a
+    //  core with nothing else to do. Interrupts stay off while the lock is
+    //  held, as the scheduler can leave the idle loop for good at any time
+    void idle_refill() {
+        if (!__atomic_load_n(&refill_wanted, __ATOMIC_RELAXED)) { return; }
 
-        while (target.next_chunk < (int)(CHUNKS_PER_PILE - 1)) {
-            target.next_chunk++;
-            target.chunks[target.next_chunk]
-                = memory_reservoirs[target.pile_index].get_chunk();
-            if (target.chunks[target.next_chunk].size == 0) {
-                target.next_chunk--;
-                break;
-            }
+        uint64_t flags = save_and_disable_interrupts();
+        if (access_lock.try_lock()) {
+            refill();
+            access_lock.unlock();
         }
-
-        target.refresh_task_active.unlock();
-        target.access_lock.unlock();
+        restore_interrupts(flags);
     }
 
-    chunk get_chunk(bool pile_lock_override      = false,
-                    bool reservoir_lock_override = false) {
+    chunk get_chunk(bool pile_lock_override = false) {
 
         if (!pile_lock_override) { access_lock.lock(); }
 
-        // Get the next chunk
-        chunk value;
+        // An empty pile is refilled right away, in a single batch
+        if (next_chunk < 0) {
+            mem_stats::count(mem_stats::reservoir_fallback, pile_index);
+            refill();
+        } else {
+            mem_stats::count(mem_stats::pile_hit, pile_index);
+        }
+
+        chunk value(0, 0);
         if (next_chunk > -1) {
-            // Try to grab from this pile
             value = chunks[next_chunk];
             next_chunk--;
+        }
+        if (next_chunk < (int)PILE_LOW_WATERMARK) { refill_wanted = true; }
 
-            if (!pile_lock_override) { access_lock.unlock(); }
-        } else {
-            if (!pile_lock_override) { access_lock.unlock(); }
+        if (!pile_lock_override) { access_lock.unlock(); }
+
+        // Only go to other domains once this one is out entirely
+        if (value.size == 0) {
+            value = take_remote_chunk();
+        }
+
+        return value;
+    }
+
+    chunk take_remote_chunk() {
+        for (unsigned int i = 0; i < topology.num_domains; i++) {
+            if (i == domain) { continue; }
 
-            // Try to grab from reservoir
-            value = memory_reservoirs[pile_index].get_chunk(
-                reservoir_lock_override);
+            chunk value = memory_reservoirs[i][pile_index].get_chunk();
+            if (value.size != 0) {
+                __atomic_add_fetch(&remote_chunks, 1, __ATOMIC_RELAXED);
+                mem_stats::count(mem_stats::remote_take, pile_index);
+                return value;
+            }
         }
 
-        // Send a thread to refill chunks
-        if (!pile_lock_override && next_chunk < (int)(CHUNKS_PER_PILE / 4)
-            && !refresh_task_active.is_locked()) {
-            if (refresh_task_active.try_lock()) {
-                refresh_task->rounds = 1;
-                threading::system_scheduler.add_process(refresh_task);
+        return chunk(0, 0);
+    }
+
+    void return_chunk(chunk returned_chunk) {
+
+        if (returned_chunk.size == 0) { return; }
+
+        // Chunks from other domains go straight back home
+        unsigned int home = topology.get_domain(returned_chunk.p_start);
+        if (home != domain) {
+            memory_reservoirs[home][pile_index].add_chunk(returned_chunk);
+            return;
+        }
+
+        chunk spilled_chunks[PILE_SPILL_COUNT];
+        int   num_spilled = 0;
+
+        access_lock.lock();
+
+        // When full, the oldest half of the pile goes back to the reservoir
+        if (next_chunk >= (int)(CHUNKS_PER_PILE - 1)) {
+            num_spilled = PILE_SPILL_COUNT;
+            for (int i = 0; i < num_spilled; i++) {
+                spilled_chunks[i] = chunks[i];
+            }
+            for (int i = num_spilled; i <= next_chunk; i++) {
+                chunks[i - num_spilled] = chunks[i];
             }
+            next_chunk -= num_spilled;
         }
 
-        return value;
+        next_chunk++;
+        chunks[next_chunk] = returned_chunk;
+
+        access_lock.unlock();
+
+        if (num_spilled) {
+            mem_stats::count(mem_stats::pile_spill, pile_index);
+            memory_reservoirs[domain][pile_index].add_chunks(spilled_chunks,
+                                                             num_spilled);
+        }
     }
 
     void get_chunks(int num_chunks, chunk* target_buffer,
-                    bool pile_lock_override      = false,
-                    bool reservoir_lock_override = false) {
+                    bool pile_lock_override = false) {
 
         if (!pile_lock_override) access_lock.lock();
 
         for (int i = 0; i < num_chunks; i++) {
-            target_buffer[i] = get_chunk(true, reservoir_lock_override);
-        }
-
-        // Send a thread to refill chunks
-        if (!pile_lock_override && next_chunk < (int)(CHUNKS_PER_PILE / 4)
-            && !refresh_task_active.is_locked()) {
-            if (refresh_task_active.try_lock()) {
-                refresh_task->rounds = 1;
-                threading::system_scheduler.add_process(refresh_task);
-            }
+            target_buffer[i] = get_chunk(true);
         }
 
         if (!pile_lock_override) access_lock.unlock();
@@ -297,6 +418,8 @@ struct chunk_pile {
     }
 };
 
+void add_to_domain(chunk new_chunk);
+void distribute_domains();
 void turn_to_chunks(uintptr_t start_address, size_t size);
 void construct_chunks(multiboot_boot_info* mb_info);
 void mmap_to_chunks(multiboot_mmap_entry target);
@@ -9,14 +9,22 @@ struct chunk_pile;
 struct chunk_reservoir;
 struct chunk;
 
+constexpr unsigned int MAX_NUMA_DOMAINS       = 8;
 constexpr unsigned int NUM_MEMORY_PILES       = 6;
 constexpr unsigned int CHUNKS_PER_PILE        = 0x20;
+constexpr unsigned int PILE_SPILL_COUNT       = CHUNKS_PER_PILE / 2;
+constexpr unsigned int PILE_LOW_WATERMARK     = CHUNKS_PER_PILE / 4;
+constexpr unsigned int PILE_HIGH_WATERMARK    = (CHUNKS_PER_PILE * 3) / 4;
 constexpr unsigned int RESERVOIR_DEFAULT_SIZE = 128;
+constexpr unsigned int RESERVOIR_BLOCK_SIZE   = 2048;
+constexpr unsigned int COALESCE_BATCH_SIZE    = 0x40;
 
-extern chunk reservoir_chunks[NUM_MEMORY_PILES][RESERVOIR_DEFAULT_SIZE];
-extern chunk_reservoir memory_reservoirs[NUM_MEMORY_PILES];
+extern chunk_reservoir memory_reservoirs[MAX_NUMA_DOMAINS][NUM_MEMORY_PILES];
 
-#define get_chunk_size(index) PAGE_SIZE << (index * 4)
+#define get_chunk_size(index) (PAGE_SIZE << ((index) * 4))
+
+// Tops up any of this core's piles that ran low, from its idle loop
+void refill_piles();
 
 } // namespace chunking
 
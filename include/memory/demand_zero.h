@@ -0,0 +1,72 @@
+#ifndef DEMAND_ZERO_H
+#define DEMAND_ZERO_H
+
+#include "libk/mutex.h"
+#include "memory/range_allocator.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace paging {
+
+// Allocations at least this large only reserve their addresses, with each
+//  page being filled in with zeroes when it's first touched
+constexpr size_t demand_zero_threshold = 0x100000; // 1 MiB
+
+#define RESERVATION_INITIAL_CAPACITY 0x40
+
+// Reserved ranges, sorted by address so the fault handler can find the one
+//  a fault landed in. The array is grown with eagerly mapped memory, as a
+//  fault in it would need the lock that's already held
+class reservation_table {
+    std_k::mutex lock;
+    std_k::mutex grow_lock;
+
+    address_range* ranges;
+    size_t         count;
+    size_t         capacity;
+
+    address_range initial_ranges[RESERVATION_INITIAL_CAPACITY];
+
+    size_t index_after(uintptr_t address) const;
+    void   grow();
+
+  public:
+    reservation_table()
+        : ranges(initial_ranges)
+        , count(0)
+        , capacity(RESERVATION_INITIAL_CAPACITY) {}
+
+    bool add(address_range target);
+    void remove(uintptr_t start);
+
+    // Changes the size of the range starting at the address
+    void resize(uintptr_t start, size_t size);
+
+    // Finds the range holding the address, returning false if there's none
+    bool find(uintptr_t address, address_range& found);
+};
+
+/**
+ * @brief Reserves addresses for an allocation without backing them
+ *
+ * @param size      Bytes needed, rounded up to a whole page
+ * @param alignment Needed alignment of the start of the allocation
+ * @return void*    Start of the reservation, or nullptr if none was left
+ */
+void* demand_zero_alloc(size_t size, size_t alignment = PAGE_SIZE);
+
+// Hands back the pages touched so far, then the addresses themselves
+void demand_zero_free(uintptr_t address);
+
+// Extends a reservation over the addresses right after it, returning false
+//  if they aren't free
+bool demand_zero_grow(uintptr_t address, size_t new_size);
+
+// Backs the page holding a faulting address, returning false if the address
+//  isn't in a reservation
+bool demand_zero_fault(uintptr_t address);
+
+} // namespace paging
+
+#endif
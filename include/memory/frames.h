@@ -0,0 +1,101 @@
+#ifndef FRAMES_H
+#define FRAMES_H
+
+#include "libk/mutex.h"
+#include "memory/p_memory.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace paging {
+
+constexpr size_t frame_refs_coverage = 0x8000000000; // 512 GiB
+constexpr size_t frame_refs_entries  = frame_refs_coverage / PAGE_SIZE;
+constexpr size_t frame_refs_window_size
+    = frame_refs_entries * sizeof(uint32_t);
+constexpr size_t frame_refs_window_pages = frame_refs_window_size / PAGE_SIZE;
+
+#define ZERO_POOL_SIZE 0x40
+
+// Frames already zeroed by a core while it had nothing else to do
+struct zero_pool {
+    size_t    count = 0;
+    uintptr_t frames[ZERO_POOL_SIZE];
+};
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Winit-self"
+
+// Number of extra owners of each physical frame, for frames shared between
+//  address spaces. Frames with a single owner are never touched here, so
+//  the counts are only backed for frames that have been shared
+class frame_ref_map {
+    uint32_t* counts;
+
+    uint64_t     backed[frame_refs_window_pages / 64];
+    std_k::mutex backing_lock;
+
+    bool back_page(size_t window_page);
+
+    inline bool is_backed(size_t window_page) {
+        return __atomic_load_n(&backed[window_page / 64], __ATOMIC_ACQUIRE)
+               & ((uint64_t)1 << (window_page % 64));
+    }
+
+    inline uint32_t* count_for(uintptr_t frame) {
+        size_t index = frame / PAGE_SIZE;
+        if (counts == nullptr || index >= frame_refs_entries) return nullptr;
+        return &counts[index];
+    }
+
+  public:
+    // Held over anything that shares or releases frames, so a table can't
+    //  be copied by one address space while another is taking it back
+    std_k::mutex lock;
+
+    // Filled by initialize, which runs before global constructors
+    frame_ref_map()
+        : counts(counts)
+        , backing_lock(backing_lock)
+        , lock(lock) {}
+
+    void initialize(uint32_t* window);
+
+    uint32_t sharers(uintptr_t frame);
+
+    // Makes sure the frame's count is backed, so sharing it can't fail.
+    //  Returns false if there's no memory left to back it with
+    bool prepare(uintptr_t frame);
+
+    // Adds an owner to the frame, returning false if its count couldn't be
+    //  backed
+    bool share(uintptr_t frame);
+
+    // Drops an owner of the frame, returning true if the caller was the
+    //  last one, and so has it to itself
+    bool release(uintptr_t frame);
+};
+
+#pragma GCC diagnostic pop
+
+extern frame_ref_map frame_refs;
+
+// Sets up the per-core windows used below, must be done before they're
+//  needed somewhere nothing can be allocated
+bool prepare_frame_windows();
+
+// Fills a frame with zeroes through this core's window
+void zero_frame(uintptr_t frame);
+
+// Fills a frame with a copy of a mapped page
+void copy_frame(uintptr_t frame, const void* source);
+
+// Takes a frame from this core's zeroed pool, or 0 if it has run dry
+uintptr_t take_zeroed_frame();
+
+// Tops up this core's zeroed pool, for cores with nothing else to do
+void refill_zeroed_frames();
+
+} // namespace paging
+
+#endif
@@ -0,0 +1,89 @@
+#ifndef MEM_STATS_H
+#define MEM_STATS_H
+
+#include "memory/chunking_predef.h"
+#include "memory/sub_memory.h"
+#include "threading/threading.h"
+#include "threading/topology.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace mem_stats {
+
+// Events counted separately for each chunk size
+enum chunk_event : unsigned int {
+    pile_hit,           // Served straight from a core's pile
+    reservoir_fallback, // Pile was empty, so its reservoir was used
+    remote_take,        // Taken from another domain's reservoir
+    pile_refill,        // Batch of chunks moved into a pile
+    pile_spill,         // Full pile handed half of itself back
+    reservoir_split,    // Larger chunk broken down to refill a reservoir
+    reservoir_steal,    // Larger chunk taken from another core's pile
+    NUM_CHUNK_EVENTS
+};
+
+// Events counted once for the whole heap
+enum heap_event : unsigned int {
+    slab_alloc,
+    slab_free,
+    slab_refill, // Magazine was empty, so the depot was used
+    slab_flush,  // Magazine was full, so half went back to the depot
+    sub_alloc,
+    sub_free,
+    sub_region, // New sub-page region was made
+    chunk_alloc,
+    chunk_free,
+    chunk_grow, // Chunk allocation grown where it was
+    chunk_move, // Chunk allocation grown by remapping it elsewhere
+    reservation,
+    reservation_fault,
+    NUM_HEAP_EVENTS
+};
+
+// Counts kept by a single core, which is the only one to write them. They
+//  aren't updated atomically, so a count can be lost now and then if a
+//  process is moved to another core partway through one
+struct core_counters {
+    uint64_t chunk_events[NUM_CHUNK_EVENTS][chunking::NUM_MEMORY_PILES];
+    uint64_t heap_events[NUM_HEAP_EVENTS];
+    uint64_t slab_classes[SLAB_NUM_CLASSES];
+
+    void clear();
+    void merge(const core_counters& source);
+} __attribute__((aligned(64)));
+
+// Used until each core has its own, shared by every core until then
+extern core_counters boot_counters;
+
+// Value of the system timer when the counters were last reset
+extern uint64_t window_start;
+
+inline core_counters* local_counters() {
+    if (!threading::threads_started) { return &boot_counters; }
+    return current_thread()->mem_counters;
+}
+
+inline void count(chunk_event event, unsigned int pile_index) {
+    local_counters()->chunk_events[event][pile_index]++;
+}
+
+inline void count(heap_event event) {
+    local_counters()->heap_events[event]++;
+}
+
+inline void count_slab(unsigned int size_class) {
+    core_counters* counters = local_counters();
+    counters->heap_events[slab_alloc]++;
+    counters->slab_classes[size_class]++;
+}
+
+// Sums every core's counts into the target
+void gather(core_counters& target);
+
+// Starts a new sampling window, clearing every core's counts
+void reset();
+
+} // namespace mem_stats
+
+#endif
@@ -41,15 +41,14 @@ void memory_init(multiboot_boot_info* mb_info);
 
 void* bootstrap_malloc(size_t size);
 void* malloc(size_t size);
-void* lock_override_alloc(size_t size, int override_lock_index = -1);
 void* aligned_alloc(size_t size, size_t alignment);
+void* realloc(void* target_address, size_t new_size);
 
-uintptr_t bootstrap_palloc(bool lock_override = false);
-uintptr_t palloc(bool lock_override = false);
+uintptr_t bootstrap_palloc();
+uintptr_t palloc();
 
 void free(void* target_address);
 void pfree(uintptr_t physical_address);
-void lock_override_free(void* target_address, int override_lock_index = -1);
 
 inline bool cmp_swap(uint64_t* target, uint64_t cmp_value, uint64_t new_value) {
     uint64_t result;
@@ -0,0 +1,104 @@
+#ifndef PAGE_INFO_H
+#define PAGE_INFO_H
+
+#include "libk/mutex.h"
+#include "memory/p_memory.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace chunking {
+struct chunk;
+}
+
+namespace paging {
+
+enum page_owner : uint8_t {
+    page_unused = 0,
+    page_slab,
+    page_sub_region,
+    page_chunk,
+    page_reserved,
+};
+
+// Metadata for a single page of the kernel heap, found directly from the
+//  page's virtual address
+struct page_descriptor {
+    page_owner owner;
+
+    // Slab size class, or pile index of a single chunk allocation
+    uint8_t  size_class;
+    uint16_t reserved;
+    uint32_t num_chunks;
+
+    // Single chunk allocations keep their chunk here, larger ones keep an
+    //  out-of-line list of chunks, and reservations keep their size
+    union {
+        uintptr_t        p_start;
+        chunking::chunk* chunks;
+        size_t           length;
+    };
+};
+static_assert(sizeof(page_descriptor) == 16);
+
+constexpr size_t page_info_coverage = 0x8000000000; // 512 GiB
+constexpr size_t page_info_entries  = page_info_coverage / PAGE_SIZE;
+constexpr size_t page_info_window_size
+    = page_info_entries * sizeof(page_descriptor);
+constexpr size_t page_info_window_pages = page_info_window_size / PAGE_SIZE;
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Winit-self"
+
+// Flat array of descriptors covering the kernel heap, with the pages of the
+//  array itself only being backed once a descriptor in them is claimed
+class page_info_map {
+    page_descriptor* descriptors;
+    uintptr_t        base;
+
+    uint64_t     backed[page_info_window_pages / 64];
+    std_k::mutex backing_lock;
+
+    void back_page(size_t window_page);
+
+    inline bool is_backed(size_t window_page) {
+        return __atomic_load_n(&backed[window_page / 64], __ATOMIC_ACQUIRE)
+               & ((uint64_t)1 << (window_page % 64));
+    }
+
+  public:
+    // Filled by initialize, which runs before global constructors
+    page_info_map()
+        : descriptors(descriptors)
+        , base(base)
+        , backing_lock(backing_lock) {}
+
+    void initialize(uintptr_t heap_base, page_descriptor* window);
+
+    inline bool covers(uintptr_t address) const {
+        return descriptors != nullptr && address >= base
+               && (address - base) < page_info_coverage;
+    }
+
+    // Returns nullptr if the address was never claimed
+    inline page_descriptor* get(uintptr_t address) {
+        if (!covers(address)) return nullptr;
+
+        size_t index = (address - base) / PAGE_SIZE;
+        if (!is_backed((index * sizeof(page_descriptor)) / PAGE_SIZE)) {
+            return nullptr;
+        }
+
+        return &descriptors[index];
+    }
+
+    page_descriptor* claim(uintptr_t address, page_owner owner);
+};
+
+#pragma GCC diagnostic pop
+
+extern page_info_map page_info;
+
+} // namespace paging
+
+#endif
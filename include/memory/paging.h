@@ -3,6 +3,7 @@
 
 #include "memory/p_memory.h"
 
+#include <cpuid.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -15,6 +16,19 @@ constexpr uint64_t page_level_4_table_size
     = (page_directory_pointer_size * 512);
 constexpr uintptr_t real_address_bitmask = ~(0xfff);
 
+// Everything between these belongs to an address space's own half. The
+//  first level 4 entry is left out, as it holds the kernel's identity maps
+//  of devices and boot data, and is shared by every space
+constexpr uintptr_t user_half_start = page_directory_pointer_size;
+constexpr uintptr_t user_half_end   = page_directory_pointer_size * 256;
+
+// Large entries keep their PAT bit at bit 12, so the frame of one also needs
+//  to be masked down to the size of the page
+constexpr uintptr_t physical_address_bitmask = 0x000ffffffffff000;
+
+// Past this many stale pages, reloading CR3 is cheaper than invlpg on each
+constexpr size_t flush_page_threshold = 32;
+
 typedef uint64_t page_entry;
 typedef struct {
     page_entry data[512];
@@ -56,7 +70,10 @@ enum page_flags {
     p_accessed              = (1 << 5),
 
     p_dirty  = (1 << 6),
-    p_global = (1 << 8)
+    p_global = (1 << 8),
+
+    // Free for software, marks pages shared with a clone
+    p_copy_on_write = (1 << 9),
 };
 
 enum page_table_flags {
@@ -68,16 +85,24 @@ enum page_table_flags {
     pt_accessed              = (1 << 5),
 
     pt_large_pages = (1 << 7),
+
+    pt_copy_on_write = (1 << 9),
 };
 
 enum page_directory_flags {
     pd_present       = (1 << 0),
-    pd_write_enabled = (1 << 1)
+    pd_write_enabled = (1 << 1),
+
+    pd_large_pages = (1 << 7),
+
+    pd_copy_on_write = (1 << 9),
 };
 
 enum page_directory_pointer_flags {
     pdp_present       = (1 << 0),
-    pdp_write_enabled = (1 << 1)
+    pdp_write_enabled = (1 << 1),
+
+    pdp_copy_on_write = (1 << 9),
 };
 
 inline void* round_up_page_aligned(void* target) {
@@ -116,8 +141,57 @@ inline void refresh_all_pages() {
 };
 
 inline void refresh_page(void* target) {
-    asm volatile("invlpg %[target]" : : [target] "m"(target));
+    asm volatile("invlpg (%[target])" : : [target] "r"(target) : "memory");
+};
+
+inline void load_table(uint64_t cr3_value) {
+    asm volatile("movq %[value], %%cr3" : : [value] "r"(cr3_value) : "memory");
+};
+
+enum invpcid_type : uint64_t {
+    invpcid_address     = 0, // One address, for one PCID
+    invpcid_single      = 1, // Everything for one PCID
+    invpcid_all_global  = 2, // Everything, global pages included
+    invpcid_all_context = 3, // Everything but global pages
 };
+
+inline void invalidate_pcid(invpcid_type type, uint64_t pcid,
+                            uintptr_t address = 0) {
+    struct {
+        uint64_t  pcid;
+        uintptr_t address;
+    } descriptor = {pcid, address};
+
+    asm volatile("invpcid %[descriptor], %[type]"
+                 :
+                 : [descriptor] "m"(descriptor), [type] "r"((uint64_t)type)
+                 : "memory");
+};
+
+// Process-context identifiers are reported in leaf 1
+inline bool pcid_supported() {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) { return false; }
+    return (ecx & (1 << 17));
+};
+
+// And the INVPCID instruction in leaf 7
+inline bool invpcid_supported() {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) { return false; }
+    return (ebx & (1 << 10));
+};
+
+// 1 GiB pages are optional, and reported in extended leaf 0x80000001
+inline bool gigabyte_pages_supported() {
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx)) { return false; }
+    return (edx & (1 << 26));
+};
+
+// Checked once as the kernel's space is set up, as CPUID is too slow to
+//  run for every mapping
+extern bool use_gigabyte_pages;
 } // namespace paging
 
 #endif
\ No newline at end of file
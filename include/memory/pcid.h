@@ -0,0 +1,78 @@
+#ifndef PCID_H
+#define PCID_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace paging {
+
+struct address_space;
+
+// PCIDs handed out by each core, the first always being the kernel's own
+constexpr unsigned int PCID_SLOTS = 8;
+
+// Set in a CR3 value to keep what's cached for its PCID
+constexpr uint64_t PCID_NO_FLUSH = (uint64_t)1 << 63;
+
+// Id of the kernel's own tables, spaces being numbered from 1
+constexpr uint64_t KERNEL_SPACE_ID = 0;
+
+// Source of the ids address spaces are tagged with, which aren't reused
+extern uint64_t next_space_id;
+
+// Which space each of a core's PCIDs was last given to, so switching back
+//  to a space can keep its translations until its PCID is taken by another
+struct pcid_cache {
+    bool enabled = false;
+
+    uint64_t     owners[PCID_SLOTS];
+    unsigned int next_victim = 1;
+
+    // PCIDs holding translations that are out of date, to be flushed the
+    //  next time they're loaded
+    uint32_t stale = 0;
+
+    uint64_t       loaded       = KERNEL_SPACE_ID;
+    address_space* loaded_space = nullptr;
+    uintptr_t      kernel_table = 0;
+
+    pcid_cache() {
+        owners[0] = KERNEL_SPACE_ID;
+        for (unsigned int i = 1; i < PCID_SLOTS; i++) { owners[i] = ~0UL; }
+    }
+};
+
+// Turns on PCIDs for the current core, when it has them
+void pcid_init();
+
+/**
+ * @brief Loads a space's tables on the current core, tagged with a PCID
+ *          so nothing cached for other spaces has to be flushed
+ *
+ * @param space     Space to load, or nullptr for the kernel's own tables.
+ *                  Nothing is done if it's already loaded
+ */
+void load_address_space(address_space* space);
+
+/**
+ * @brief Loads a space on the current core so its tables can be edited
+ *          through the windows, which only ever reach the loaded tables
+ *
+ * @param space             Space about to be edited
+ * @return address_space*   Whatever was loaded before, to be handed back to
+ *                          leave_address_space
+ */
+address_space* enter_address_space(address_space* space);
+
+// Puts back what was loaded before enter_address_space, unless the space
+//  belongs to the running task, which is left loaded as the scheduler
+//  would load it from then on anyway
+void leave_address_space(address_space* space, address_space* previous);
+
+// Invalidates pages on the current core, under every PCID it's handed out.
+//  Past flush_page_threshold everything is flushed instead
+void flush_local(const uintptr_t* pages, size_t num_pages);
+
+} // namespace paging
+
+#endif
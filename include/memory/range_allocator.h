@@ -0,0 +1,126 @@
+#ifndef RANGE_ALLOCATOR_H
+#define RANGE_ALLOCATOR_H
+
+#include "libk/mutex.h"
+#include "memory/p_memory.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace paging {
+
+#define RANGE_INITIAL_CAPACITY 0x40
+#define RANGE_GROW_HEADROOM    0x10
+
+#define RANGE_CACHE_SIZE     0x10
+#define RANGE_CACHE_MAX_SIZE 0x1000000 // 16 MiB
+
+struct address_range {
+    uintptr_t start;
+    size_t    size;
+
+    inline uintptr_t end() const { return start + size; }
+};
+
+// Recently freed ranges kept by a single core, handed straight back out
+//  for requests of the same size
+struct range_cache {
+    size_t        count = 0;
+    address_range ranges[RANGE_CACHE_SIZE];
+};
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Winit-self"
+
+// Free ranges of an address space's virtual addresses, kept both in address
+//  order, for merging neighbours, and in size order, for finding the best
+//  fit. The arrays are only ever grown with the lock released, as growing
+//  them needs an allocation of its own, so anything that would need another
+//  entry checks for room before changing them. Ranges freed while they're
+//  full and can't be grown wait in the pending list until the next grow
+class range_allocator {
+    std_k::mutex lock;
+    std_k::mutex grow_lock;
+
+    address_range* by_address;
+    address_range* by_size;
+    size_t         count;
+    size_t         capacity;
+    size_t         total_free;
+
+    address_range pending[RANGE_GROW_HEADROOM];
+    size_t        pending_count;
+
+    bool per_core_caches;
+
+    address_range initial_by_address[RANGE_INITIAL_CAPACITY];
+    address_range initial_by_size[RANGE_INITIAL_CAPACITY];
+
+    static inline bool size_before(const address_range& lhs,
+                                   const address_range& rhs) {
+        return (lhs.size < rhs.size)
+               || (lhs.size == rhs.size && lhs.start < rhs.start);
+    }
+
+    size_t address_index(uintptr_t start) const;
+    size_t size_index(const address_range& target) const;
+
+    void insert_range(address_range target);
+    void remove_range(size_t index);
+    bool add_free(address_range target);
+
+    bool      carve(address_range source, uintptr_t start, size_t size);
+    uintptr_t take_range(size_t size, size_t alignment);
+
+    range_cache* local_cache();
+    void         grow();
+
+  public:
+    // Filled by initialize, so it can be used before global constructors
+    range_allocator()
+        : lock(lock)
+        , grow_lock(grow_lock)
+        , by_address(by_address)
+        , by_size(by_size)
+        , count(count)
+        , capacity(capacity)
+        , total_free(total_free)
+        , pending_count(pending_count)
+        , per_core_caches(per_core_caches) {}
+
+    void initialize(uintptr_t start, size_t size, bool use_core_caches);
+
+    /**
+     * @brief Reserves a range of addresses
+     *
+     * @param size          Bytes needed, rounded up to a whole page
+     * @param alignment     Needed alignment of the start of the range
+     * @param can_grow      Whether the free lists may be grown, which has
+     *                      to be avoided while holding allocator locks
+     * @return uintptr_t    Start of the range, or 0 if none was left
+     */
+    uintptr_t allocate(size_t size, size_t alignment = PAGE_SIZE,
+                       bool can_grow = true);
+
+    // Returns a range, merging it with any free neighbours
+    void release(uintptr_t start, size_t size);
+
+    // Reserves a specific range, if every address in it is free
+    bool claim(uintptr_t start, size_t size, bool can_grow = true);
+
+    // Takes on the free ranges of another allocator, for a cloned space
+    void copy_from(range_allocator& source);
+
+    inline size_t free_space() const {
+        return __atomic_load_n(&total_free, __ATOMIC_RELAXED);
+    }
+    inline size_t num_ranges() const {
+        return __atomic_load_n(&count, __ATOMIC_RELAXED);
+    }
+};
+
+#pragma GCC diagnostic pop
+
+} // namespace paging
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef SHOOTDOWN_H
+#define SHOOTDOWN_H
+
+#include "libk/mutex.h"
+#include "memory/paging.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+namespace paging {
+
+constexpr uint8_t SHOOTDOWN_VECTOR = 0xa2;
+
+// Invalidations waiting to be run by a single core, which are gathered up
+//  so that one IPI covers everything queued before the core gets to them
+struct alignas(64) shootdown_queue {
+    std_k::mutex lock;
+
+    // Only cores that have come online can be holding translations
+    bool online = false;
+
+    uintptr_t pages[flush_page_threshold];
+    size_t    num_pages   = 0;
+    bool      full_flush  = false;
+    bool      ipi_pending = false;
+
+    // Each batch of requests gets a new generation, which the core
+    //  publishes once it has run everything up to it
+    uint64_t requested = 0;
+    uint64_t completed = 0;
+};
+
+// Marks the current core as able to hold translations, from here on it'll
+//  be sent shootdowns
+void tlb_online();
+
+/**
+ * @brief Invalidates pages on every core that may be holding them, and
+ *          waits until they've all done so
+ *
+ * @param pages         Addresses to invalidate
+ * @param num_pages     Number of addresses, past flush_page_threshold every
+ *                      core flushes its whole TLB instead
+ */
+void shootdown(const uintptr_t* pages, size_t num_pages);
+
+// Has every core flush its whole TLB
+inline void shootdown_all() { shootdown(nullptr, flush_page_threshold + 1); }
+
+// Runs whatever is queued for the current core
+void service_shootdowns();
+
+} // namespace paging
+
+#endif
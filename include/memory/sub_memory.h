@@ -2,6 +2,7 @@
 #define P_SUB_MEMORY_H
 
 #include "libk/misc.h"
+#include "libk/mutex.h"
 #include "memory/p_memory.h"
 #include "stddef.h"
 #include "stdint.h"
@@ -14,8 +15,6 @@
 #define SUB_PAGE_DATA_PER_PAGE \
     ((PAGE_SIZE - SUB_PAGE_INFO_DATA_OFFSET) - SUB_PAGE_INFO_SIZE)
 
-struct allocation_entry;
-
 struct sub_mem_region_info {
     uint8_t entry[SUB_PAGE_INFO_SIZE];
 
@@ -130,8 +129,6 @@ struct sub_mem_region {
         }
     }
 
-    void* operator new(size_t size) { return aligned_alloc(size, PAGE_SIZE); }
-
     void* allocate_space(size_t size) {
 
         // Convert size to number of entries
@@ -141,7 +138,7 @@ struct sub_mem_region {
 
         if (target_index == (unsigned int)~(0)) { return (void*)0; }
 
-        total_space_free -= (size);
+        total_space_free -= (entries * SUB_PAGE_INFO_SIZE_PER_BYTE);
         return (void*)(&data[target_index * SUB_PAGE_INFO_SIZE_PER_BYTE]);
     }
 
@@ -164,7 +161,7 @@ struct sub_mem_region {
 
         if (target_index == (unsigned int)~(0)) { return (void*)0; }
 
-        total_space_free -= (size);
+        total_space_free -= (entries * SUB_PAGE_INFO_SIZE_PER_BYTE);
         return (void*)(&data[target_index * SUB_PAGE_INFO_SIZE_PER_BYTE]);
     }
 
@@ -173,50 +170,123 @@ struct sub_mem_region {
         unsigned int target_index
             = (unsigned int)((uintptr_t)target - (uintptr_t)&data[0])
               / SUB_PAGE_INFO_SIZE_PER_BYTE;
+        total_space_free
+            += (info.entry[target_index] * SUB_PAGE_INFO_SIZE_PER_BYTE);
         info.return_space(target_index);
     }
 
+    size_t space_size(void* target) const {
+        unsigned int target_index
+            = (unsigned int)((uintptr_t)target - (uintptr_t)&data[0])
+              / SUB_PAGE_INFO_SIZE_PER_BYTE;
+        return info.entry[target_index] * SUB_PAGE_INFO_SIZE_PER_BYTE;
+    }
+
 } __attribute__((packed, aligned(PAGE_SIZE)));
 
 class sub_mem_manager {
     sub_mem_region first_region __attribute__((aligned(PAGE_SIZE)));
-    uintptr_t      earliest_address;
-    uintptr_t      latest_address;
+    std_k::mutex   lock;
+
+    sub_mem_region* new_region();
 
   public:
-    sub_mem_manager() {
-        earliest_address = (uintptr_t)&first_region;
-        latest_address   = earliest_address + PAGE_SIZE;
-    }
+    sub_mem_manager() {}
     sub_mem_manager(sub_mem_manager& source)
         : first_region(source.first_region)
-        , earliest_address(source.earliest_address)
-        , latest_address(source.latest_address) {}
-
-    inline bool owns_allocation(uintptr_t address) {
-        // Check rough bounds
-        if (address >= earliest_address && address <= latest_address) {
-            sub_mem_region* current_region = &first_region;
-
-            while (1) {
-                if (address >= (uintptr_t)current_region
-                    && address <= ((uintptr_t)current_region + PAGE_SIZE))
-                    return true;
-
-                if ((uintptr_t)current_region->next_region)
-                    current_region = current_region->next_region;
-                else
-                    return false;
-            }
-        } else {
-            return false;
-        }
+        , lock(source.lock) {}
+
+    inline bool owns_first_region(uintptr_t address) {
+        return (address >= (uintptr_t)&first_region
+                && address < ((uintptr_t)&first_region + PAGE_SIZE));
     }
 
     void* sub_alloc(size_t size);
     void* sub_aligned_alloc(size_t size, size_t alignment);
 
+    // Region pages are found through their page descriptor, except for
+    //  the first region which lives with the kernel itself
+    void sub_free(uintptr_t address);
     bool try_sub_free(uintptr_t address);
+
+    // Bytes set aside for an allocation, which can be more than was asked
+    inline size_t sub_size(uintptr_t address) const {
+        return ((const sub_mem_region*)(address & ~(PAGE_SIZE - 1)))
+            ->space_size((void*)address);
+    }
+};
+
+// Slab allocator for small objects, split into power-of-two size classes
+#define SLAB_MIN_SHIFT     4
+#define SLAB_MIN_SIZE      (1 << SLAB_MIN_SHIFT)
+#define SLAB_MAX_SIZE      2048
+#define SLAB_NUM_CLASSES   8
+#define SLAB_MAGAZINE_SIZE 32
+#define SLAB_CLASS_WINDOW  ((size_t)0x8000000)
+#define SLAB_WINDOW_SIZE   (SLAB_CLASS_WINDOW * SLAB_NUM_CLASSES)
+
+struct slab_object {
+    slab_object* next;
+};
+
+// Per-CPU stack of free objects for a single size class
+struct slab_magazine {
+    unsigned int count = 0;
+    void*        objects[SLAB_MAGAZINE_SIZE];
+};
+
+// Set of magazines owned by one logical core, one for each size class
+struct slab_cache {
+    slab_magazine magazines[SLAB_NUM_CLASSES];
+} __attribute__((aligned(64)));
+
+// Shared pool of free objects for a single size class, each class being
+//  given its own range of virtual addresses to grow into
+struct slab_depot {
+    std_k::mutex lock;
+    slab_object* free_list  = nullptr;
+    size_t       free_count = 0;
+
+    size_t    object_size = 0;
+    uintptr_t next_page   = 0;
+    uintptr_t window_end  = 0;
+} __attribute__((aligned(64)));
+
+class slab_allocator {
+    slab_depot depots[SLAB_NUM_CLASSES];
+    uintptr_t  start = 0;
+    uintptr_t  end   = 0;
+
+  public:
+    slab_allocator() {}
+
+    void initialize(uintptr_t window_start);
+
+    inline bool available() const { return start != 0; }
+    inline bool owns_allocation(uintptr_t address) const {
+        return address >= start && address < end;
+    }
+
+    static inline unsigned int get_class(size_t size) {
+        if (size <= SLAB_MIN_SIZE) return 0;
+        return (64 - __builtin_clzl(size - 1)) - SLAB_MIN_SHIFT;
+    }
+    inline size_t get_object_size(uintptr_t address) const {
+        return depots[(address - start) / SLAB_CLASS_WINDOW].object_size;
+    }
+
+    void* slab_alloc(size_t size);
+    void* slab_aligned_alloc(size_t size, size_t alignment);
+    void  slab_free(uintptr_t address);
+
+  private:
+    void* depot_take(unsigned int size_class);
+    void  depot_return(unsigned int size_class, slab_object* first,
+                       slab_object* last, size_t count);
+
+    void refill(slab_magazine& magazine, unsigned int size_class);
+    void flush(slab_magazine& magazine, unsigned int size_class);
+    bool grow(unsigned int size_class);
 };
 
 #endif
@@ -5,21 +5,19 @@
 #include "stddef.h"
 #include "stdint.h"
 
-class allocation_manager;
-struct allocation_info;
-struct allocation_entry;
+void* chunk_alloc(size_t size);
+void* aligned_chunk_alloc(size_t size, size_t alignment);
 
-allocation_entry* chunk_alloc(size_t size);
-allocation_entry* aligned_chunk_alloc(size_t size, size_t alignment);
+void* bootstrap_chunk_alloc(size_t size);
+void* bootstrap_aligned_chunk_alloc(size_t size, size_t alignment);
 
-allocation_entry* bootstrap_chunk_alloc(size_t size);
-allocation_entry* bootstrap_aligned_chunk_alloc(size_t size, size_t alignment);
+void chunk_free(uintptr_t address);
 
-allocation_entry* override_chunk_alloc(size_t size,
-                                       int    lock_override_index = -1);
+// Bytes mapped for a chunk allocation, or 0 if the address doesn't start one
+size_t chunk_allocation_size(uintptr_t address);
 
-void chunk_free(allocation_info returned_entry);
-void override_chunk_free(allocation_info returned_entry,
-                         int             lock_override_index = -1);
+// Grow an allocation without copying it, returning its new start, or nullptr
+//  if it's left as it was
+void* chunk_realloc(uintptr_t address, size_t new_size);
 
-#endif
\ No newline at end of file
+#endif
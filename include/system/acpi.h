@@ -223,8 +223,6 @@ struct srat_mem_affinity : entry_header {
 } __attribute__((packed));
 
 struct srat_x2apic_affinity : entry_header {
-    uint8_t  type;
-    uint8_t  length;
     uint8_t  reserved1[2];
     uint32_t domain;
     uint32_t x2APIC_ID;
@@ -40,13 +40,17 @@ namespace commands {
 int echo(int argc, char* argv[]);
 int test(int argc, char* argv[]);
 int test_alloc(int argc, char* argv[]);
+int alloc_bench(int argc, char* argv[]);
 int branch(int argc, char* argv[]);
 
 int cpu_stat(int argc, char* argv[]);
 int mem_stat(int argc, char* argv[]);
+int mem_prof(int argc, char* argv[]);
 int proc_stat(int argc, char* argv[]);
 
 int scheduling(int argc, char* argv[]);
+
+int fork_test(int argc, char* argv[]);
 } // namespace commands
 } // namespace kernel
 
@@ -28,6 +28,13 @@ struct apic_id {
     inline unsigned int thread_index() {
         return (id & ((1 << thread_bits) - 1));
     }
+
+    // Same for every thread of a physical core, and unique across packages
+    inline unsigned int physical_index() { return (id >> thread_bits); }
+
+    inline unsigned int package_index() {
+        return (id >> (thread_bits + core_bits));
+    }
 };
 
 namespace current_apic {
@@ -25,6 +25,47 @@
 class allocation_manager;
 
 namespace threading {
+
+// Levels processes are scheduled at, the lowest being run first and given
+//  the shortest slices
+constexpr unsigned int NUM_PRIORITIES = 8;
+
+// Cores an affinity mask can tell apart, any past these are always allowed
+constexpr unsigned int MAX_AFFINITY_CORES = 256;
+
+// For a process that hasn't run anywhere yet
+constexpr unsigned int NO_CORE = ~0U;
+
+// Logical cores a process may run on, by their index in topology.threads
+struct affinity_mask {
+    uint64_t bits[MAX_AFFINITY_CORES / 64];
+
+    affinity_mask() { allow_all(); }
+
+    bool allows(unsigned int core) const {
+        if (core >= MAX_AFFINITY_CORES) { return true; }
+        return (bits[core / 64] & (1UL << (core % 64)));
+    }
+
+    void allow(unsigned int core) {
+        if (core < MAX_AFFINITY_CORES) {
+            bits[core / 64] |= (1UL << (core % 64));
+        }
+    }
+
+    void allow_all() {
+        for (unsigned int i = 0; i < (MAX_AFFINITY_CORES / 64); i++) {
+            bits[i] = ~0UL;
+        }
+    }
+
+    void clear() {
+        for (unsigned int i = 0; i < (MAX_AFFINITY_CORES / 64); i++) {
+            bits[i] = 0;
+        }
+    }
+};
+
 struct processor_state {
     uint64_t rip;
     uint64_t rflags = 1 << 9;
@@ -175,9 +216,41 @@ struct process {
         bool wait_on_end = false;
     } config;
 
+    // Level the process starts at, and the one it's currently at, which
+    //  drops as it uses whole slices and rises again when it blocks
     unsigned int priority;
+    unsigned int level;
     unsigned int rounds;
 
+    // When it was last queued, for how long it waits to be run
+    uint64_t queued_at = 0;
+
+    // Where it may run and which NUMA domain its memory is on, with the
+    //  core it last ran on so it can be kept near its caches
+    affinity_mask affinity;
+    unsigned int  home_node = 0;
+    unsigned int  last_core = NO_CORE;
+
+    // Real-time parameters and state, in system timer ticks. A process with
+    //  a period is run by earliest deadline ahead of every level, getting up
+    //  to its runtime in each period, each round being due its deadline
+    //  after the period starts
+    struct realtime_t {
+        uint64_t period   = 0;
+        uint64_t runtime  = 0;
+        uint64_t deadline = 0;
+
+        uint64_t release           = 0; // Start of the current period
+        uint64_t absolute_deadline = 0;
+        uint64_t used              = 0; // Runtime used in this period
+
+        // Rounds that ran out of runtime or finished past their deadline
+        uint64_t overruns = 0;
+
+        // Share of a core it was admitted with, out of REALTIME_LOAD_ONE
+        uint64_t load = 0;
+    } realtime;
+
     std_k::callable<void>* main;
     std_k::ostream         out_stream;
 
@@ -191,11 +264,21 @@ struct process {
     void* user_stack;
     void* kernel_stack;
 
+    // With copy_parent set, the new process gets a copy-on-write clone of
+    //  the parent's space rather than being linked into it
     process(unsigned int target_priority, unsigned int rounds,
-            std_k::callable<void>* target, process* parent = 0);
+            std_k::callable<void>* target, process* parent = 0,
+            bool copy_parent = false);
 
     ~process();
 
+    bool is_realtime() const { return (realtime.period != 0); }
+
+    // Makes this a real-time process, before it's given to
+    //  system_scheduler.add_realtime. A deadline of 0 is the period
+    void set_realtime(uint64_t period_us, uint64_t runtime_us,
+                      uint64_t deadline_us = 0);
+
     static void init_wrapper(process* target);
 
     void prepare_wrapper() {
@@ -6,6 +6,7 @@
 #include "libk/avl_tree.h"
 #include "libk/callable.h"
 #include "libk/functional.h"
+#include "libk/heap.h"
 #include "libk/mutex.h"
 #include "libk/ostream.h"
 #include "libk/queue.h"
@@ -47,6 +48,24 @@ void enter_sleep();
 
 void start_threads();
 
+// Waits for something to run on the current core, in MWAIT on its run queue
+//  if the core has it so queueing work is enough to wake it, otherwise in HLT
+void idle_wait();
+
+// Set once cores other than the boot core may be running
+extern bool threads_started;
+
+// Sent to a core whose scheduling tick is stopped when work is queued for it
+constexpr uint8_t RESCHEDULE_VECTOR = 0xa3;
+
+// Time processes are stamped with as they're queued, from the system timer
+uint64_t scheduler_clock();
+
+// Real-time loads are fractions of a core in these units, with a share of
+//  each core always left over for everything else
+constexpr uint64_t REALTIME_LOAD_ONE   = (uint64_t)1 << 20;
+constexpr uint64_t REALTIME_LOAD_LIMIT = (REALTIME_LOAD_ONE * 95) / 100;
+
 using pid_t = uint64_t;
 
 extern class process_list_t {
@@ -107,33 +126,80 @@ extern class process_list_t {
 } process_list;
 
 extern struct system_scheduler_t {
-    std_k::queue<process*> run_queue;
-    std_k::mutex           lock;
-    bool                   paused = false;
+    bool paused = false;
 
-    bool   empty() const { return run_queue.empty(); }
-    size_t size() const { return run_queue.size(); }
+    // Each logical core keeps its own run queue inside its thread_scheduler,
+    // so these only aggregate or place work across those queues
+    size_t size() const;
 
-    process* get() {
-        if (empty() || paused) { return nullptr; }
+    process* get(thread_scheduler* target);
 
-        lock.lock();
-        process* target = nullptr;
-        if (!run_queue.empty()) {
-            target = run_queue.front();
-            run_queue.pop();
-        }
-        lock.unlock();
+    // Takes work from the nearest core with enough more of it than the
+    //  thief, the first process being returned and the rest queued on the
+    //  thief. The further away the victim, the larger the imbalance needed
+    process* steal(thread_scheduler* thief);
 
-        return target;
+    // Places the process on the core nearest where it last ran, or its home
+    //  node if it hasn't, out of those about as lightly loaded as any it's
+    //  allowed on
+    void add_process(process* target);
+    void add_process(process* target, unsigned int core_index);
+
+    // Admits a real-time process to the first core it fits on, keeping each
+    //  core's total load under REALTIME_LOAD_LIMIT. Returns false, leaving
+    //  the process with the caller, if it doesn't fit anywhere
+    bool add_realtime(process* target);
+
+    // Has the nearest idle core without a tick that would take some of the
+    //  source's work look for work to steal
+    void wake_idle_core(thread_scheduler* source);
+} system_scheduler;
+
+// A core's waiting processes, in a FIFO for each level with a bitmap of the
+//  ones that aren't empty, so the next to run is found with a bit scan
+//  however many are waiting
+struct run_queues {
+    std_k::queue<process*> levels[NUM_PRIORITIES];
+    uint32_t               occupied = 0;
+    size_t                 count    = 0;
+
+    // How long everything taken from each level had waited
+    uint64_t total_wait[NUM_PRIORITIES] = {};
+    uint64_t max_wait[NUM_PRIORITIES]   = {};
+    uint64_t num_taken[NUM_PRIORITIES]  = {};
+
+    // Read without the queue lock by other cores
+    bool   empty() const { return (size() == 0); }
+    size_t size() const { return __atomic_load_n(&count, __ATOMIC_RELAXED); }
+
+    void push(process* target) {
+        levels[target->level].push(target);
+        occupied |= (1U << target->level);
+        __atomic_store_n(&count, count + 1, __ATOMIC_RELAXED);
     }
 
-    void add_process(process* target) {
-        lock.lock();
-        run_queue.push(target);
-        lock.unlock();
+    // Takes from the highest level, unless the head of a lower one has
+    //  waited past the starvation limit, in which case the lowest such one
+    //  goes first and is moved up a level
+    process* pop(uint64_t now);
+
+    // Takes the newest process from the lowest level that's allowed on the
+    //  core, for moving it there
+    process* pop_back(unsigned int core);
+};
+
+struct deadline_less {
+    bool operator()(process* left, process* right) {
+        return (left->realtime.absolute_deadline
+                < right->realtime.absolute_deadline);
     }
-} system_scheduler;
+};
+
+struct release_less {
+    bool operator()(process* left, process* right) {
+        return (left->realtime.release < right->realtime.release);
+    }
+};
 
 struct thread_scheduler {
     logical_core* owner;
@@ -150,6 +216,39 @@ struct thread_scheduler {
                   scheduling_function;
     apic<>::task* scheduling_timer_task = nullptr;
 
+    // Processes waiting to run on this core
+    run_queues   run_queue;
+    std_k::mutex queue_lock;
+    bool         active = false;
+
+    // Written with every push, as the line an idle core in MWAIT watches
+    uint64_t queue_pushes = 0;
+
+    // Real-time processes admitted to this core, which never leave it. Ready
+    //  ones are run by earliest deadline before anything in the run queue,
+    //  the rest wait for their next period
+    std_k::heap<process*, deadline_less> realtime_ready;
+    std_k::heap<process*, release_less>  realtime_waiting;
+    std_k::mutex                         realtime_lock;
+    uint64_t                             realtime_load     = 0;
+    uint64_t                             realtime_overruns = 0;
+
+    // When the current task was started, for charging real-time runtime
+    uint64_t slice_start = 0;
+
+    // When this core last looked for work to pull over from busier ones
+    uint64_t last_balance = 0;
+
+    // Where the core is sent back to cpu_sleep_state from, so each time it
+    //  goes idle starts over on the same stack rather than below wherever
+    //  it was interrupted
+    uintptr_t idle_stack = 0;
+
+    // Whether the scheduling tick is running. It's stopped while the core
+    //  is idle or has a single task to itself, and only started again once
+    //  something else is waiting for the core
+    bool ticking = false;
+
     thread_scheduler() {}
     thread_scheduler(logical_core* owner)
         : owner(owner)
@@ -157,16 +256,88 @@ struct thread_scheduler {
         , local_timer(&owner->local_apic)
         , scheduling_function(run, this, 0, 0) {}
 
+    size_t queue_size() const { return run_queue.size(); }
+    size_t load() const {
+        return run_queue.size() + ((current_task != nullptr) ? 1 : 0);
+    }
+
+    void queue_process(process* target) {
+        uint64_t flags = save_and_disable_interrupts();
+        target->queued_at = scheduler_clock();
+        queue_lock.lock();
+        run_queue.push(target);
+        queue_pushes++;
+        queue_lock.unlock();
+        restore_interrupts(flags);
+    }
+
+    void add_process(process* target) {
+        queue_process(target);
+
+        // Without its tick, the core won't notice this by itself. Pairs
+        //  with the queue being checked again once the tick is stopped, and
+        //  once the core's idle state is set. One in MWAIT was already woken
+        //  by the push
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&owner->idle_state, __ATOMIC_RELAXED)
+            == core_monitoring) {
+            return;
+        }
+        if (!__atomic_load_n(&ticking, __ATOMIC_RELAXED)) { wake(); }
+    }
+
+    void wake() {
+        if (__atomic_load_n(&active, __ATOMIC_ACQUIRE)) {
+            current_apic::send_apic_command(owner->local_apic.id,
+                                            RESCHEDULE_VECTOR);
+        }
+    }
+
+    process* take_process() {
+        if (run_queue.empty()) { return nullptr; }
+
+        // Only called from this core's scheduling interrupt, so just skip
+        // this round if another core is working with the queue
+        uint64_t now = scheduler_clock();
+        if (!queue_lock.try_lock()) { return nullptr; }
+        process* target = run_queue.pop(now);
+        queue_lock.unlock();
+
+        return target;
+    }
+
+    // Anything run() would start, so the run queue doesn't count while the
+    //  system scheduler is paused
+    bool has_work() {
+        if (!realtime_ready.empty()) { return true; }
+        return (!system_scheduler.paused && !run_queue.empty());
+    }
+
     void enter_sleep() {
-        // Clear task and setup scheduling timer
+        // Clear task and setup scheduling timer, for one tick to pick up
+        //  anything queued before the core was started
         current_task = nullptr;
+        ticking      = true;
+        __atomic_store_n(&active, true, __ATOMIC_RELEASE);
 
         scheduling_timer_task = local_timer->push_task_rate(
             SCHEDULING_DEFAULT_RATE, &scheduling_function, 1);
 
+        // Anything below here is never returned to, and the offset matches
+        //  the alignment of a function just called
+        uintptr_t stack;
+        asm volatile("movq %%rsp, %[stack]" : [stack] "=r"(stack));
+        idle_stack = (stack & ~(uintptr_t)0xf) - 8;
+
         enable_interrupts();
 
-        while (1) { asm volatile("hlt"); }
+        // Piles and zeroed frames are topped up whenever there's nothing
+        //  to run
+        while (1) {
+            chunking::refill_piles();
+            paging::refill_zeroed_frames();
+            idle_wait();
+        }
     }
 
     bool in_sleep() { return (current_task == nullptr); }
@@ -175,6 +346,29 @@ struct thread_scheduler {
                     interrupt_frame* frame);
 
     void yield_current(general_regs_state* task_regs, interrupt_frame* frame);
+
+    // Starts the tick for the current task's slice
+    void start_tick();
+
+    // For a wake from another core, while this core's tick is stopped or
+    //  a real-time process has been admitted to it
+    void reschedule(general_regs_state* task_regs, interrupt_frame* frame);
+
+    // Charges a real-time task for the time since slice_start, then puts it
+    //  back as ready, or to wait for its next period once its round is
+    //  finished or it has used up its runtime. Needs realtime_lock
+    void park_realtime(process* task, uint64_t now, bool finished);
+
+    // Moves everything whose period has started to the ready heap. Needs
+    //  realtime_lock
+    void release_realtime(uint64_t now);
+
+    // Whether a ready real-time task should take over from the current one
+    bool realtime_preempts();
+
+    // System timer ticks until the current task's runtime runs out or the
+    //  next period starts, or ~0 with nothing real-time on this core
+    uint64_t next_realtime_event(uint64_t now);
 };
 
 } // namespace threading
@@ -4,6 +4,7 @@
 #include "apic.h"
 #include "device/device.h"
 #include "libk/asm.h"
+#include "memory/chunking_predef.h"
 #include "memory/x86_tables.h"
 #include "system/acpi.h"
 
@@ -15,13 +16,54 @@ namespace chunking {
 struct chunk_pile;
 }
 
+namespace paging {
+struct shootdown_queue;
+struct pcid_cache;
+struct range_cache;
+struct zero_pool;
+} // namespace paging
+
+struct slab_cache;
+
+namespace mem_stats {
+struct core_counters;
+}
+
+// What a core is doing while it has nothing to run, so whoever queues work
+//  for it knows whether it has to be sent an interrupt to notice
+enum core_idle_state : uint32_t {
+    core_busy,       // Running a task, or on its way to one
+    core_halted,     // In HLT, only woken by an interrupt
+    core_monitoring, // In MWAIT on its run queue, woken by anything queued
+};
+
+// How far apart two logical cores are, nearest first, for keeping work
+//  close to its caches and memory
+enum core_distance : unsigned int {
+    same_core,
+    smt_sibling,   // Other thread of the same physical core
+    same_socket,   // Shares the package's last level cache
+    same_domain,   // Another package, but the same memory
+    remote_domain, // Across NUMA domains
+    NUM_CORE_DISTANCES
+};
+
 struct logical_core : public device {
     bool functional;
     bool x2apic_thread;
     bool boot_thread;
 
+    // NUMA domain this thread belongs to
+    unsigned int domain;
+
     apic<true, false>            local_apic;
     chunking::chunk_pile*        memory_piles;
+    slab_cache*                  slab_caches;
+    paging::shootdown_queue*     tlb_queue;
+    paging::pcid_cache*          pcids;
+    paging::range_cache*         va_cache;
+    paging::zero_pool*           zeroed_frames;
+    mem_stats::core_counters*    mem_counters;
     threading::thread_scheduler* scheduler;
     void*                        system_stack;
     void*                        system_stack_top;
@@ -29,6 +71,12 @@ struct logical_core : public device {
     x86_tables::gdt_table             gdt;
     x86_tables::interrupt_stack_table ist;
 
+    core_idle_state idle_state;
+
+    bool is_idle() const {
+        return (__atomic_load_n(&idle_state, __ATOMIC_RELAXED) != core_busy);
+    }
+
     void start_thread(void (*target_code)());
 
     friend bool operator==(logical_core& lhs, logical_core& rhs) {
@@ -61,10 +109,29 @@ struct socket {
     uint32_t     id;
 };
 
+constexpr unsigned int MAX_DOMAIN_RANGES = 8;
+
+struct memory_range {
+    uintptr_t start;
+    uintptr_t end;
+};
+
 struct numa_domain {
     unsigned int num_socket;
     uintptr_t    start;
     uintptr_t    end;
+
+    unsigned int num_ranges;
+    memory_range ranges[MAX_DOMAIN_RANGES];
+
+    inline bool contains(uintptr_t address) {
+        for (unsigned int i = 0; i < num_ranges; i++) {
+            if (address >= ranges[i].start && address < ranges[i].end) {
+                return true;
+            }
+        }
+        return false;
+    }
 };
 
 struct system {
@@ -85,6 +152,30 @@ struct system {
     inline logical_core* get_thread(apic_id id) {
         return &(threads[get_total_index((id))]);
     }
+
+    // Distance between two logical cores, by their index in threads
+    inline core_distance distance(unsigned int from, unsigned int to) {
+        if (from == to) { return same_core; }
+
+        apic_id from_id = threads[from].local_apic.id;
+        apic_id to_id   = threads[to].local_apic.id;
+        if (from_id.physical_index() == to_id.physical_index()) {
+            return smt_sibling;
+        }
+        if (from_id.package_index() == to_id.package_index()) {
+            return same_socket;
+        }
+        if (threads[from].domain == threads[to].domain) { return same_domain; }
+        return remote_domain;
+    }
+
+    // Domain owning a physical address, domain 0 if none claim it
+    inline unsigned int get_domain(uintptr_t address) {
+        for (unsigned int i = 0; i < num_domains; i++) {
+            if (domains[i].contains(address)) { return i; }
+        }
+        return 0;
+    }
 };
 
 extern struct system topology;
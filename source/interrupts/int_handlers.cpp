@@ -13,6 +13,10 @@
 #include "io/keyboard.h"
 #include "libk/asm.h"
 #include "libk/callable.h"
+#include "memory/addressing.h"
+#include "memory/common_region.h"
+#include "memory/demand_zero.h"
+#include "memory/shootdown.h"
 #include "system/error.h"
 #include "terminal/terminal.h"
 #include "threading/threading.h"
@@ -172,6 +176,27 @@ __attribute__((interrupt)) void segment_fault(interrupt_frame*  frame,
 __attribute__((interrupt)) void page_fault(interrupt_frame*  frame,
                                            unsigned long int error_code) {
 
+    uintptr_t fault_address;
+    asm volatile("movq %%cr2, %[address]" : [address] "=r"(fault_address));
+
+    // Not-present faults inside a reservation just need the page filled in
+    if (!(error_code & 1) && paging::demand_zero_fault(fault_address)) {
+        return;
+    }
+
+    // Writes to present pages of a cloned space need their own copy. The
+    //  common region is remapped by every new process, so the faulting
+    //  task is found through this core's scheduler instead
+    threading::process* task = nullptr;
+    if (threading::threads_started && current_thread()->scheduler != nullptr) {
+        task = current_thread()->scheduler->current_task;
+    }
+    if ((error_code & 3) == 3 && fault_address < paging::user_half_end
+        && task != nullptr && task->task_space != nullptr
+        && paging::copy_on_write_fault(task->task_space, fault_address)) {
+        return;
+    }
+
     raise_error(003, const_cast<char*>("page_fault"));
 
     send_EOI();
@@ -372,6 +397,13 @@ __attribute__((interrupt)) void call_int(interrupt_frame* frame) {
     target->call();
 }
 
+__attribute__((interrupt)) void shootdown_int(interrupt_frame* frame) {
+
+    (void)frame;
+    paging::service_shootdowns();
+    send_EOI();
+}
+
 /* #endregion*/
 
 extern "C" {
@@ -422,6 +454,29 @@ __attribute__((naked)) void yield_int() {
     asm volatile("sti\n\t");
     asm volatile("iretq \n\t");
 }
+
+extern "C" {
+void real_reschedule_int(general_regs_state* task_regs,
+                         interrupt_frame*    task_frame) {
+    // Find this core's scheduler
+    threading::thread_scheduler* scheduler = current_thread()->scheduler;
+
+    scheduler->reschedule(task_regs, task_frame);
+
+    send_EOI();
+}
+}
+
+__attribute__((naked)) void reschedule_int() {
+    asm volatile("cli\n\t");
+    PUSH_GENERAL_REGS();
+    asm volatile("lea (%rsp), %rdi \n\t\
+             lea 0x78(%rsp), %rsi \n\t\
+             call real_reschedule_int \n\t");
+    POP_GENERAL_REGS();
+    asm volatile("sti\n\t");
+    asm volatile("iretq \n\t");
+}
 } // namespace interrupts
 
 #pragma GCC diagnostic pop
@@ -17,8 +17,10 @@
 #include "libk/macro.h"
 #include "memory/addressing.h"
 #include "memory/p_memory.h"
+#include "memory/shootdown.h"
 #include "memory/x86_tables.h"
 #include "system/acpi.h"
+#include "threading/threading.h"
 
 namespace interrupts {
 
@@ -192,6 +194,9 @@ void interrupts_init(acpi::madt_table* madt) {
                          (void (*)(interrupt_frame*))apic_int);
     set_direct_interrupt(0xa1, INT_GATE_32,
                          (void (*)(interrupt_frame*))yield_int);
+    set_direct_interrupt(paging::SHOOTDOWN_VECTOR, INT_GATE_32, shootdown_int);
+    set_direct_interrupt(threading::RESCHEDULE_VECTOR, INT_GATE_32,
+                         (void (*)(interrupt_frame*))reschedule_int);
 
     // Spurious Interrupts (0xf8 to 0xff)
     for (uint8_t i = 0xf8; i >= 0xf8; i++) {
@@ -15,8 +15,10 @@ bool fpu_init() {
 
     uint16_t fpu_status = 1;
 
+    // Write protect is set along with it, as everything runs in ring 0 and
+    //  copy-on-write pages would otherwise be written straight through
     uint64_t cr0_and = ~((1 << 2) | (1 << 3));
-    uint64_t cr0_or  = (1 << 1);
+    uint64_t cr0_or  = (1 << 1) | (1 << 16);
 
     uint64_t cr4_or = ((1 << 9) | (1 << 10) | (1 << 18));
 
@@ -9,11 +9,156 @@
 
 #include "addressing.h"
 
+#include "libk/asm.h"
+#include "memory/common_region.h"
+#include "page_info.h"
 #include "sub_memory.h"
+#include "threading/apic.h"
+#include "threading/threading.h"
 
 namespace paging {
 
 kernel_only_address_space kernel_address_space;
+page_level_4_table        kernel_level_4_template;
+bool                      use_gigabyte_pages = false;
+
+// Cores only need telling apart once the others have been started
+static uint32_t current_table_owner() {
+    return threading::threads_started ? (uint32_t)current_apic::get_id() : 0;
+}
+
+uint64_t table_mutex::lock() {
+    uint64_t flags = save_and_disable_interrupts();
+    uint32_t core  = current_table_owner();
+
+    if (depth != 0 && __atomic_load_n(&owner, __ATOMIC_ACQUIRE) == core) {
+        // Already held further up this core's stack
+        depth++;
+        return flags;
+    }
+
+    base.lock();
+    owner = core;
+    depth = 1;
+    return flags;
+}
+
+void table_mutex::unlock(uint64_t flags) {
+    if (--depth == 0) {
+        __atomic_store_n(&owner, no_owner, __ATOMIC_RELAXED);
+        base.unlock();
+    }
+    restore_interrupts(flags);
+}
+
+bool table_mutex::held_here() {
+    return depth != 0
+           && (__atomic_load_n(&owner, __ATOMIC_ACQUIRE)
+               == current_table_owner());
+}
+
+void table_mutex::stock() {
+    // Someone is already stocking, possibly further up this core's stack
+    if (!stock_lock.try_lock()) { return; }
+
+    while (__atomic_load_n(&num_spare, __ATOMIC_ACQUIRE) < spare_target) {
+        uintptr_t frame  = take_zeroed_frame();
+        bool      zeroed = (frame != 0);
+        if (!zeroed) { frame = palloc(); }
+
+        // Out of memory, whatever is already stocked will have to do
+        if (frame == 0) { break; }
+
+        uint64_t flags = lock();
+
+        spare_frames[num_spare++] = spare_frame{frame, zeroed};
+        unlock(flags);
+    }
+
+    stock_lock.unlock();
+}
+
+uintptr_t table_mutex::take_frame(bool& zeroed) {
+    if (held_here() && num_spare > 0) {
+        spare_frame spare = spare_frames[--num_spare];
+        zeroed            = spare.zeroed;
+        return spare.frame;
+    }
+
+    // Taking a zeroed frame doesn't enter the allocators
+    uintptr_t frame = take_zeroed_frame();
+    zeroed          = (frame != 0);
+    return zeroed ? frame : palloc();
+}
+
+// Level 4 entries the kernel maps anything under, being the identity maps',
+//  the heap's and the common region's. Only these have their windows made at
+//  boot, as doing so for the rest of the kernel's half would cost frames for
+//  nothing
+static bool kernel_window_slot(size_t index) {
+    if (index == identity_map_pdp) { return true; }
+
+    size_t heap_first = (kernel_heap_base % page_level_4_table_size)
+                        / page_directory_pointer_size;
+    size_t heap_end
+        = heap_first
+          + ((page_info_coverage + page_directory_pointer_size - 1)
+             / page_directory_pointer_size);
+    size_t common
+        = ((uintptr_t)common_region::common_region_start
+           % page_level_4_table_size)
+          / page_directory_pointer_size;
+
+    return (index >= heap_first && index < heap_end) || index == common;
+}
+
+// Copies the windows onto the kernel's shared tables into a new space's
+//  window tables. For each level 4 entry, the PDP's window is an entry of
+//  pt[1]. Its directories' windows are a PT under pd[1], seen through pt[5].
+//  Its page tables' windows are a PD under pdp[1], seen through pt[3], whose
+//  tables are in turn seen through a PT under pd[3], itself seen through
+//  pt[7]. The image's directories sit beside the windows in pdp[0], seen
+//  through pt[2], with their page tables seen through PTs under pd[2],
+//  themselves seen through pt[6]
+static void share_kernel_windows(page_directory_pointer_table* pdp,
+                                 page_directory_table*         pd,
+                                 page_table*                   pt) {
+    page_table* loaded_pt1
+        = &pt_tables[(0x40000 * 0x1fe) + (0x200 * 0x1fe) + 0x1ff];
+    page_table* loaded_pt2
+        = &pt_tables[(0x40000 * 0x1fe) + (0x200 * 0x1ff) + 0x1fe];
+    page_table* loaded_pt3
+        = &pt_tables[(0x40000 * 0x1fe) + (0x200 * 0x1ff) + 0x1ff];
+    page_table* loaded_pt5
+        = &pt_tables[(0x40000 * 0x1ff) + (0x200 * 0x1fe) + 0x1ff];
+    page_table* loaded_pt6
+        = &pt_tables[(0x40000 * 0x1ff) + (0x200 * 0x1ff) + 0x1fe];
+    page_table* loaded_pt7
+        = &pt_tables[(0x40000 * 0x1ff) + (0x200 * 0x1ff) + 0x1ff];
+    page_directory_table* loaded_pd1 = &pd_tables[(0x200 * 0x1fe) + 0x1ff];
+    page_directory_table* loaded_pd2 = &pd_tables[(0x200 * 0x1ff) + 0x1fe];
+    page_directory_table* loaded_pd3 = &pd_tables[(0x200 * 0x1ff) + 0x1ff];
+    page_directory_pointer_table* loaded_pdp0 = &pdp_tables[0x1fe];
+    page_directory_pointer_table* loaded_pdp1 = &pdp_tables[0x1ff];
+
+    for (size_t i = 0; i < 0x1fe; i++) {
+        // The image is mapped once while booting, so its tables are fixed
+        pdp[0].data[i] = loaded_pdp0->data[i];
+        pt[2].data[i]  = loaded_pt2->data[i];
+        pd[2].data[i]  = loaded_pd2->data[i];
+        pt[6].data[i]  = loaded_pt6->data[i];
+
+        if (kernel_slot(i)) { pt[1].data[i] = loaded_pt1->data[i]; }
+        if (!kernel_window_slot(i)) { continue; }
+
+        pd[1].data[i]  = loaded_pd1->data[i];
+        pt[5].data[i]  = loaded_pt5->data[i];
+        pdp[1].data[i] = loaded_pdp1->data[i];
+        pt[3].data[i]  = loaded_pt3->data[i];
+        pd[3].data[i]  = loaded_pd3->data[i];
+        pt[7].data[i]  = loaded_pt7->data[i];
+    }
+}
 
 /*
  * Initial mapping layout:
@@ -56,8 +201,8 @@ void initialize_table_mapping(page_level_4_table* level_4_table) {
     page_directory_table*         pd  = new page_directory_table[4];
     page_table*                   pt  = new page_table[8];
 
-    // Clear all tables
-    for (int i = 0; i < 512; i++) level_4_table->data[i] = 0;
+    // Clear all tables, the level 4 table's other entries are left to the
+    //  caller
     for (int i = 0; i < 2; i++) {
         for (int j = 0; j < 512; j++) { pdp[i].data[j] = 0; }
     }
@@ -68,6 +213,10 @@ void initialize_table_mapping(page_level_4_table* level_4_table) {
         for (int j = 0; j < 512; j++) { pt[i].data[j] = 0; }
     }
 
+    // The windows onto the kernel's shared tables are the same in every
+    //  space, so are taken from whichever one is loaded
+    share_kernel_windows(pdp, pd, pt);
+
     // Prepare the initial tables
     // PML4T
     level_4_table->data[0x1fe]
@@ -216,414 +365,220 @@ void initialize_table_mapping(page_level_4_table* level_4_table) {
     // allocated
 }
 
-void address_space::identity_map_page(uintptr_t target_address) {
-    *(get_page(target_address)) = ((target_address & real_address_bitmask)
-                                   | p_present | p_write_enabled);
-    refresh_page((void*)target_address);
-}
+address_space* address_space::clone() {
+    // Copies are made on write faults, where nothing can be allocated
+    if (!prepare_frame_windows()) { return nullptr; }
+
+    address_space* child = new address_space();
+    child->free_ranges.copy_from(free_ranges);
+
+    uint64_t flags = table_lock.lock();
+    frame_refs.lock.lock();
+
+    // Counts are backed first, so nothing is shared if one can't be
+    size_t first_entry = user_half_start / page_directory_pointer_size;
+    size_t num_entries = user_half_end / page_directory_pointer_size;
+    for (size_t i = first_entry; i < num_entries; i++) {
+        page_directory_pointer_table_entry entry = primary_table->data[i];
+        if ((entry & pdp_present)
+            && !frame_refs.prepare(entry & physical_address_bitmask)) {
+            frame_refs.lock.unlock();
+            table_lock.unlock(flags);
+            delete child;
+            return nullptr;
+        }
+    }
 
-void address_space::identity_map_pt(uintptr_t target_address) {
-    page_table* target_table = get_page_table(target_address);
-
-    // Loop through entries of the target table
-    target_address = (target_address - (target_address % page_table_size))
-                     | p_present | p_write_enabled;
-    for (int i = 0; i < 512; i++) {
-        target_table->data[i] = target_address;
-        target_address += PAGE_SIZE;
-        refresh_page((void*)target_address);
+    // Only the top level is copied, everything under it is shared until
+    //  one side writes to it
+    for (size_t i = first_entry; i < num_entries; i++) {
+        page_directory_pointer_table_entry entry = primary_table->data[i];
+        if (!(entry & pdp_present)) { continue; }
+
+        entry = (entry & ~(uint64_t)pdp_write_enabled) | pdp_copy_on_write;
+        primary_table->data[i]        = entry;
+        child->primary_table->data[i] = entry;
+        frame_refs.share(entry & physical_address_bitmask);
     }
-}
 
-void address_space::identity_map_pd(uintptr_t target_address) {
-    uintptr_t             original_address = target_address;
-    page_directory_table* target_directory = get_page_directory(target_address);
-
-    // Loop through the page tables
-    target_address = (target_address - (target_address % page_directory_size))
-                     | p_present | p_write_enabled;
-    for (int i = 0; i < 512; i++) {
-        page_table* target_table = (page_table*)target_directory->data[i];
-
-        // Check if this table exists
-        if (target_table == 0) {
-            // Doesn't exist, need to create it first
-            uintptr_t p_address = palloc();
-            target_table = &pt_tables[(original_address / page_table_size)];
-            map_page_to(p_address, (uintptr_t)target_table);
-            for (int j = 0; j < 512; j++) { target_table->data[j] = 0; }
-
-            target_directory->data[i]
-                = p_address | pt_present | pt_write_enabled;
+    copy_on_write        = true;
+    child->copy_on_write = true;
+
+    frame_refs.lock.unlock();
+    table_lock.unlock(flags);
+
+    // Nothing cached from before can be left allowing writes
+    shootdown_all();
+
+    // The child's windows don't reach the tables it was given yet. They
+    //  can't change under it, as either side copies them before writing
+    bool adopted = true;
+    {
+        mapping_transaction<address_space> mapping(*child);
+        for (size_t i = first_entry; i < num_entries && adopted; i++) {
+            adopted = mapping.adopt_tables(i);
         }
+    }
 
-        // Identity map the entries of this table
-        for (int j = 0; j < 512; j++) {
-            target_table->data[j] = target_address;
-            target_address += PAGE_SIZE;
-            refresh_page((void*)target_address);
+    if (!adopted) {
+        // Given back, leaving the parent's entries marked, which only costs
+        //  it a fault on its next write to each
+        frame_refs.lock.lock();
+        for (size_t i = first_entry; i < num_entries; i++) {
+            page_directory_pointer_table_entry entry
+                = child->primary_table->data[i];
+            if (!(entry & pdp_present)) { continue; }
+
+            child->primary_table->data[i] = 0;
+            frame_refs.release(entry & physical_address_bitmask);
         }
+        frame_refs.lock.unlock();
+
+        delete child;
+        return nullptr;
     }
+    return child;
 }
 
-void address_space::identity_map_region(uintptr_t target_address, size_t size) {
+bool copy_on_write_fault(address_space* space, uintptr_t address) {
+    if (space == nullptr || !space->copy_on_write) { return false; }
 
-    // Ensure that addresses (and size) fall along page lines
-    size += (target_address % PAGE_SIZE);
-    target_address -= (target_address % PAGE_SIZE);
-
-    while (size) {
-        // Break off into different levels of mapping
-        if ((size > page_directory_size)
-            && ((target_address & (page_directory_size - 1)) == 0)) {
-            // Map next page directory
-            identity_map_pd(target_address);
-            target_address += page_directory_size;
-            if (size > page_directory_size) {
-                size -= page_directory_size;
-            } else {
-                size = 0;
-            }
-
-        } else if ((size > page_table_size)
-                   && ((target_address & (page_table_size - 1)) == 0)) {
-            // Map next page table
-            identity_map_pt(target_address);
-            target_address += page_table_size;
-            if (size > page_table_size) {
-                size -= page_table_size;
-            } else {
-                size = 0;
-            }
-
-        } else {
-            // Map next page
-            identity_map_page(target_address);
-            target_address += PAGE_SIZE;
-            if (size > PAGE_SIZE) {
-                size -= PAGE_SIZE;
-            } else {
-                size = 0;
-            }
-        }
-    }
+    mapping_transaction<address_space> mapping(*space);
+    return mapping.resolve_write(address);
+}
+
+void address_space::identity_map_page(uintptr_t target_address) {
+    map_page_to(target_address, target_address);
+}
+
+void address_space::identity_map_pt(uintptr_t target_address) {
+    map_pt_to(target_address, target_address);
+}
+
+void address_space::identity_map_pd(uintptr_t target_address) {
+    map_pd_to(target_address, target_address);
+}
+
+void address_space::identity_map_region(uintptr_t target_address, size_t size) {
+    map_region_to(target_address, target_address, size);
 }
 
 void address_space::map_page_to(uintptr_t source_address,
-                                uintptr_t target_address, bool lock_override) {
-    *(get_page(target_address, lock_override))
-        = ((source_address & real_address_bitmask) | p_present
-           | p_write_enabled);
-    refresh_page((void*)target_address);
+                                uintptr_t target_address) {
+    mapping_transaction<address_space> mapping(*this);
+    mapping.map_page(source_address, target_address);
 }
 
 void address_space::map_pt_to(uintptr_t source_address,
-                              uintptr_t target_address, bool lock_override) {
-    page_table* target_table = get_page_table(target_address, lock_override);
-
-    // Loop through entries of the target table
-    source_address = (source_address - (source_address % page_table_size))
-                     | p_present | p_write_enabled;
-    for (int i = 0; i < 512; i++) {
-        target_table->data[i] = source_address;
-        source_address += PAGE_SIZE;
-        refresh_page((void*)target_address);
-    }
+                              uintptr_t target_address) {
+    mapping_transaction<address_space> mapping(*this);
+    mapping.map_pt(source_address, target_address);
 }
 
 void address_space::map_pd_to(uintptr_t source_address,
-                              uintptr_t target_address, bool lock_override) {
-    page_directory_table* target_directory
-        = get_page_directory(target_address, lock_override);
-
-    // Loop through the page tables
-    source_address = (source_address - (source_address % page_directory_size))
-                     | p_present | p_write_enabled;
-    for (int i = 0; i < 512; i++) {
-        page_table* target_table = (page_table*)target_directory->data[i];
-
-        // Check if this table exists
-        if (target_table == 0) {
-            // Doesn't exist, need to create it first
-            uintptr_t p_address = (uintptr_t)palloc(lock_override);
-            target_table = &pt_tables[(target_address / page_table_size)];
-            map_page_to(p_address, (uintptr_t)target_table, lock_override);
-            for (int j = 0; j < 512; j++) { target_table->data[j] = 0; }
-
-            target_directory->data[i]
-                = p_address | pt_present | pt_write_enabled;
-        }
-
-        // Map the entries of this table
-        for (int j = 0; j < 512; j++) {
-            target_table->data[j] = source_address;
-            source_address += PAGE_SIZE;
-            refresh_page((void*)target_address);
-        }
-    }
+                              uintptr_t target_address) {
+    mapping_transaction<address_space> mapping(*this);
+    mapping.map_pd(source_address, target_address);
 }
 
 void address_space::map_region_to(uintptr_t source_address,
-                                  uintptr_t target_address, size_t size,
-                                  bool lock_override) {
-
-    // Ensure that addresses (and size) fall along page lines
-    size += (target_address % PAGE_SIZE);
-    target_address -= (target_address % PAGE_SIZE);
-    source_address -= (source_address % PAGE_SIZE);
-
-    while (size) {
-        // Break off into different levels of mapping
-        if ((size > page_directory_size)
-            && ((target_address & (page_directory_size - 1)) == 0)) {
-            // Map next page directory
-            map_pd_to(source_address, target_address, lock_override);
-            source_address += page_directory_size;
-            target_address += page_directory_size;
-            if (size > page_directory_size) {
-                size -= page_directory_size;
-            } else {
-                size = 0;
-            }
-
-        } else if ((size > page_table_size)
-                   && ((target_address & (page_table_size - 1)) == 0)) {
-            // Map next page table
-            map_pt_to(source_address, target_address, lock_override);
-            source_address += page_table_size;
-            target_address += page_table_size;
-            if (size > page_table_size) {
-                size -= page_table_size;
-            } else {
-                size = 0;
-            }
-
-        } else {
-            // Map next page
-            map_page_to(source_address, target_address, lock_override);
-            source_address += PAGE_SIZE;
-            target_address += PAGE_SIZE;
-            if (size > PAGE_SIZE) {
-                size -= PAGE_SIZE;
-            } else {
-                size = 0;
-            }
-        }
-    }
+                                  uintptr_t target_address, size_t size) {
+    mapping_transaction<address_space> mapping(*this);
+    mapping.map_region(source_address, target_address, size);
 }
 
 void kernel_only_address_space::initialize() {
 
+    use_gigabyte_pages = gigabyte_pages_supported();
+
     new (&sub_page_memory) sub_mem_manager();
+    new (&table_lock) table_mutex();
+
+    // The heap covers as much of the shared part of the kernel's half as the
+    //  page descriptors reach
+    uintptr_t heap_base = kernel_heap_base;
+    uintptr_t heap_end  = heap_base + page_info_coverage;
+
+    new (&free_ranges) range_allocator();
+    free_ranges.initialize(heap_base, heap_end - heap_base, true);
 
-    next_alloc_address
-        = (void*)(((uintptr_t)&kernel_end & ~(PAGE_SIZE - 1)) + PAGE_SIZE);
+    // Descriptors for every page of the heap
+    page_info.initialize(
+        heap_base, (page_descriptor*)get_new_address(page_info_window_size));
+
+    // Sharing counts for every frame, only backed once something is shared
+    frame_refs.initialize((uint32_t*)get_new_address(frame_refs_window_size));
+
+    // Reserve the range the slab classes grow into
+    new (&slab_memory) slab_allocator();
+    slab_memory.initialize((uintptr_t)get_new_address(SLAB_WINDOW_SIZE));
 
     // Need to make sure that all kernel space PDPs exist
     //      PDP indices 256-509
-    for (size_t i = 256; i < 510; i++) {
+    for (size_t i = kernel_first_pdp; i < kernel_end_pdp; i++) {
         get_page_directory_pointer_table(
             (uintptr_t)(page_directory_pointer_size * i));
     }
+
+    // The kernel's tables are reached through the windows of whichever
+    //  space is loaded, so the tables making up the windows for anywhere it
+    //  maps are made now, for every space to share
+    for (size_t i = 0; i < 0x1fe; i++) {
+        if (!kernel_window_slot(i)) { continue; }
+
+        get_page_table((uintptr_t)&pd_tables[i * 0x200]);
+        get_page_directory((uintptr_t)&pt_tables[i * 0x40000]);
+        get_page_table(
+            (uintptr_t)&pt_tables[(0x40000 * 0x1ff) + (0x200 * i)]);
+    }
+
+    // Which leaves the kernel's entries fixed from here on, for every space
+    //  to start with
+    for (size_t i = 0; i < 512; i++) {
+        kernel_level_4_template.data[i] = kernel_slot(i) ? pml4_table->data[i]
+                                                         : 0;
+    }
 }
 
 void kernel_only_address_space::identity_map_page(uintptr_t target_address) {
-    *(get_page(target_address)) = ((target_address & real_address_bitmask)
-                                   | p_present | p_write_enabled);
-    refresh_page((void*)target_address);
+    map_page_to(target_address, target_address);
 }
 
 void kernel_only_address_space::identity_map_pt(uintptr_t target_address) {
-    page_table* target_table = get_page_table(target_address);
-
-    // Loop through entries of the target table
-    target_address = (target_address - (target_address % page_table_size))
-                     | p_present | p_write_enabled;
-    for (int i = 0; i < 512; i++) {
-        target_table->data[i] = target_address;
-        target_address += PAGE_SIZE;
-        refresh_page((void*)target_address);
-    }
+    map_pt_to(target_address, target_address);
 }
 
 void kernel_only_address_space::identity_map_pd(uintptr_t target_address) {
-    uintptr_t             original_address = target_address;
-    page_directory_table* target_directory = get_page_directory(target_address);
-
-    // Loop through the page tables
-    target_address = (target_address - (target_address % page_directory_size))
-                     | p_present | p_write_enabled;
-    for (int i = 0; i < 512; i++) {
-        page_table* target_table = (page_table*)target_directory->data[i];
-
-        // Check if this table exists
-        if (target_table == 0) {
-            // Doesn't exist, need to create it first
-            uintptr_t p_address = palloc();
-            target_table = &pt_tables[(original_address / page_table_size)];
-            map_page_to(p_address, (uintptr_t)target_table);
-            for (int j = 0; j < 512; j++) { target_table->data[j] = 0; }
-
-            target_directory->data[i]
-                = p_address | pt_present | pt_write_enabled;
-        }
-
-        // Identity map the entries of this table
-        for (int j = 0; j < 512; j++) {
-            target_table->data[j] = target_address;
-            target_address += PAGE_SIZE;
-            refresh_page((void*)target_address);
-        }
-    }
+    map_pd_to(target_address, target_address);
 }
 
 void kernel_only_address_space::identity_map_region(uintptr_t target_address,
                                                     size_t    size) {
-
-    // Ensure that addresses (and size) fall along page lines
-    size += (target_address % PAGE_SIZE);
-    target_address -= (target_address % PAGE_SIZE);
-
-    while (size) {
-        // Break off into different levels of mapping
-        if ((size > page_directory_size)
-            && ((target_address & (page_directory_size - 1)) == 0)) {
-            // Map next page directory
-            identity_map_pd(target_address);
-            target_address += page_directory_size;
-            if (size > page_directory_size) {
-                size -= page_directory_size;
-            } else {
-                size = 0;
-            }
-
-        } else if ((size > page_table_size)
-                   && ((target_address & (page_table_size - 1)) == 0)) {
-            // Map next page table
-            identity_map_pt(target_address);
-            target_address += page_table_size;
-            if (size > page_table_size) {
-                size -= page_table_size;
-            } else {
-                size = 0;
-            }
-
-        } else {
-            // Map next page
-            identity_map_page(target_address);
-            target_address += PAGE_SIZE;
-            if (size > PAGE_SIZE) {
-                size -= PAGE_SIZE;
-            } else {
-                size = 0;
-            }
-        }
-    }
+    map_region_to(target_address, target_address, size);
 }
 
 void kernel_only_address_space::map_page_to(uintptr_t source_address,
-                                            uintptr_t target_address,
-                                            bool      lock_override) {
-    *(get_page(target_address, lock_override))
-        = ((source_address & real_address_bitmask) | p_present
-           | p_write_enabled);
-    refresh_page((void*)target_address);
+                                            uintptr_t target_address) {
+    mapping_transaction<kernel_only_address_space> mapping(*this);
+    mapping.map_page(source_address, target_address);
 }
 
 void kernel_only_address_space::map_pt_to(uintptr_t source_address,
-                                          uintptr_t target_address,
-                                          bool      lock_override) {
-    page_table* target_table = get_page_table(target_address, lock_override);
-
-    // Loop through entries of the target table
-    source_address = (source_address - (source_address % page_table_size))
-                     | p_present | p_write_enabled;
-    for (int i = 0; i < 512; i++) {
-        target_table->data[i] = source_address;
-        source_address += PAGE_SIZE;
-        refresh_page((void*)target_address);
-    }
+                                          uintptr_t target_address) {
+    mapping_transaction<kernel_only_address_space> mapping(*this);
+    mapping.map_pt(source_address, target_address);
 }
 
 void kernel_only_address_space::map_pd_to(uintptr_t source_address,
-                                          uintptr_t target_address,
-                                          bool      lock_override) {
-    page_directory_table* target_directory
-        = get_page_directory(target_address, lock_override);
-
-    // Loop through the page tables
-    source_address = (source_address - (source_address % page_directory_size))
-                     | p_present | p_write_enabled;
-    for (int i = 0; i < 512; i++) {
-        page_table* target_table = (page_table*)target_directory->data[i];
-
-        // Check if this table exists
-        if (target_table == 0) {
-            // Doesn't exist, need to create it first
-            uintptr_t p_address = (uintptr_t)palloc(lock_override);
-            target_table = &pt_tables[(target_address / page_table_size)];
-            map_page_to(p_address, (uintptr_t)target_table, lock_override);
-            for (int j = 0; j < 512; j++) { target_table->data[j] = 0; }
-
-            target_directory->data[i]
-                = p_address | pt_present | pt_write_enabled;
-        }
-
-        // Map the entries of this table
-        for (int j = 0; j < 512; j++) {
-            target_table->data[j] = source_address;
-            source_address += PAGE_SIZE;
-            refresh_page((void*)target_address);
-        }
-    }
+                                          uintptr_t target_address) {
+    mapping_transaction<kernel_only_address_space> mapping(*this);
+    mapping.map_pd(source_address, target_address);
 }
 
 void kernel_only_address_space::map_region_to(uintptr_t source_address,
                                               uintptr_t target_address,
-                                              size_t size, bool lock_override) {
-
-    // Ensure that addresses (and size) fall along page lines
-    size += (target_address % PAGE_SIZE);
-    target_address -= (target_address % PAGE_SIZE);
-    source_address -= (source_address % PAGE_SIZE);
-
-    while (size) {
-        // Break off into different levels of mapping
-        if ((size > page_directory_size)
-            && ((target_address & (page_directory_size - 1)) == 0)) {
-            // Map next page directory
-            map_pd_to(source_address, target_address, lock_override);
-            source_address += page_directory_size;
-            target_address += page_directory_size;
-            if (size > page_directory_size) {
-                size -= page_directory_size;
-            } else {
-                size = 0;
-            }
-
-        } else if ((size > page_table_size)
-                   && ((target_address & (page_table_size - 1)) == 0)) {
-            // Map next page table
-            map_pt_to(source_address, target_address, lock_override);
-            source_address += page_table_size;
-            target_address += page_table_size;
-            if (size > page_table_size) {
-                size -= page_table_size;
-            } else {
-                size = 0;
-            }
-
-        } else {
-            // Map next page
-            map_page_to(source_address, target_address, lock_override);
-            source_address += PAGE_SIZE;
-            target_address += PAGE_SIZE;
-            if (size > PAGE_SIZE) {
-                size -= PAGE_SIZE;
-            } else {
-                size = 0;
-            }
-        }
-    }
+                                              size_t size) {
+    mapping_transaction<kernel_only_address_space> mapping(*this);
+    mapping.map_region(source_address, target_address, size);
 }
 } // namespace paging
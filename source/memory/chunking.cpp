@@ -9,6 +9,7 @@
 
 #include "chunking.h"
 
+#include "libk/sorting.h"
 #include "paging.h"
 #include "system/init.h"
 #include "system/multiboot.h"
@@ -16,36 +17,56 @@
 
 namespace chunking {
 
-chunk reservoir_chunks[NUM_MEMORY_PILES][RESERVOIR_DEFAULT_SIZE];
+chunk_block reservoir_blocks[MAX_NUMA_DOMAINS][NUM_MEMORY_PILES];
 
-chunk_reservoir memory_reservoirs[NUM_MEMORY_PILES];
+chunk_reservoir memory_reservoirs[MAX_NUMA_DOMAINS][NUM_MEMORY_PILES];
 
-chunk chunk_reservoir::get_chunk(bool lock_override) {
+chunk chunk_reservoir::get_chunk() {
 
-    if (!lock_override) access_lock.lock();
+    access_lock.lock();
 
     chunk return_value;
-    if ((uintptr_t)last >= (uintptr_t)start) {
-        return_value = *last;
-        last         = (chunk*)((uintptr_t)last - sizeof(chunk));
-        if (!lock_override) access_lock.unlock();
+    if (pop(return_value)) {
+        access_lock.unlock();
 
     } else if (pile_index < (NUM_MEMORY_PILES - 1)) {
-        if (!lock_override) access_lock.unlock();
+        access_lock.unlock();
+
+        // Try to rebuild chunks of this size from returned smaller ones
+        //  before breaking down a larger one. A pile's lock may be held
+        //  here, so only whatever scratch space is already there is used
+        if (pile_index > 0
+            && memory_reservoirs[domain][pile_index - 1].size() >= 0x10) {
+            memory_reservoirs[domain][pile_index - 1].coalesce(false);
+
+            access_lock.lock();
+            bool found = pop(return_value);
+            access_lock.unlock();
+            if (found) { return return_value; }
+        }
 
         // Get chunk from next largest reservoir to fill this one
-        chunk break_down_chunk = memory_reservoirs[pile_index + 1].get_chunk();
+        chunk break_down_chunk
+            = memory_reservoirs[domain][pile_index + 1].get_chunk();
 
         if (break_down_chunk.size == 0) {
             if (!initialized) { return chunk(0, 0); }
 
-            // None available in reservoir, search other threads' piles
+            // None available in reservoir, search the piles of other threads
+            //  in this domain
             unsigned int thread = 0;
             while (1) {
-                chunk_pile* target_pile
-                    = &topology.threads[thread].memory_piles[pile_index + 1];
-                break_down_chunk = target_pile->get_chunk();
-                if (break_down_chunk.size != 0) { break; }
+                if (topology.threads[thread].domain == domain) {
+                    chunk_pile* target_pile
+                        = &topology.threads[thread]
+                               .memory_piles[pile_index + 1];
+                    break_down_chunk = target_pile->get_chunk();
+                    if (break_down_chunk.size != 0) {
+                        mem_stats::count(mem_stats::reservoir_steal,
+                                         pile_index);
+                        break;
+                    }
+                }
 
                 thread++;
                 if (thread == topology.num_logical) { return chunk(0, 0); }
@@ -53,6 +74,7 @@ chunk chunk_reservoir::get_chunk(bool lock_override) {
         }
 
         // Break it down into smaller chunks
+        mem_stats::count(mem_stats::reservoir_split, pile_index);
         chunk new_chunks[0x10];
         for (int i = 0; i < 0x10; i++) {
             new_chunks[i].p_start = break_down_chunk.p_start;
@@ -61,10 +83,11 @@ chunk chunk_reservoir::get_chunk(bool lock_override) {
             break_down_chunk.p_start += chunk_size;
         }
 
-        add_chunks(new_chunks, 0xf, lock_override);
+        // Left without coalescing, as a pile's lock may be held here
+        push_chunks(new_chunks, 0xf);
         return_value = new_chunks[0xf];
     } else {
-        if (!lock_override) access_lock.unlock();
+        access_lock.unlock();
 
         return chunk(0, 0);
     }
@@ -72,6 +95,175 @@ chunk chunk_reservoir::get_chunk(bool lock_override) {
     return return_value;
 }
 
+int chunk_reservoir::push_chunks(chunk* new_chunks, int num_chunks) {
+
+    int added        = 0;
+    int current_size = 0;
+    while (1) {
+        access_lock.lock();
+
+        while (added < num_chunks && has_room()) {
+            if (new_chunks[added].size) { push(new_chunks[added]); }
+            added++;
+        }
+
+        current_size = total;
+        access_lock.unlock();
+
+        if (added == num_chunks) { break; }
+
+        // Out of room, so add another block, without holding the lock in
+        //  case the allocation needs chunks from this reservoir
+        chunk_block* block = (chunk_block*)malloc(sizeof(chunk_block));
+        if (block == nullptr) { break; }
+
+        access_lock.lock();
+        link_block(block);
+        access_lock.unlock();
+    }
+
+    return current_size;
+}
+
+void refill_piles() {
+    if (!initialized) { return; }
+
+    chunk_pile* piles = current_thread()->memory_piles;
+    for (unsigned int i = 0; i < NUM_MEMORY_PILES; i++) {
+        piles[i].idle_refill();
+    }
+}
+
+bool chunk_reservoir::grow_scratch() {
+    int    wanted_size = size() + RESERVOIR_BLOCK_CHUNKS;
+    chunk* new_scratch = (chunk*)malloc(sizeof(chunk) * wanted_size);
+    if (new_scratch == nullptr) { return false; }
+
+    access_lock.lock();
+    chunk* old_scratch = new_scratch;
+    if (wanted_size > scratch_size) {
+        old_scratch  = scratch;
+        scratch      = new_scratch;
+        scratch_size = wanted_size;
+    }
+    access_lock.unlock();
+
+    if (old_scratch != nullptr) { free(old_scratch); }
+    return true;
+}
+
+void chunk_reservoir::coalesce(bool can_grow) {
+
+    if (pile_index >= (NUM_MEMORY_PILES - 1)) { return; }
+
+    size_t merged_size = chunk_size << 4;
+    chunk  merged_chunks[COALESCE_BATCH_SIZE];
+    int    num_merged;
+
+    do {
+        num_merged = 0;
+
+        access_lock.lock();
+        while (total > scratch_size) {
+            access_lock.unlock();
+            if (!can_grow || !grow_scratch()) { return; }
+            access_lock.lock();
+        }
+
+        // Gather the chunks from every block, all of them full besides the
+        //  top one
+        int          num_chunks = total;
+        chunk_block* block      = top;
+        int          index      = num_chunks - top_count;
+        std_k::memcpy(&scratch[index], block->chunks,
+                      sizeof(chunk) * top_count);
+        while (block->below != nullptr) {
+            block = block->below;
+            index -= RESERVOIR_BLOCK_CHUNKS;
+            std_k::memcpy(&scratch[index], block->chunks,
+                          sizeof(chunk) * RESERVOIR_BLOCK_CHUNKS);
+        }
+
+        // With the chunks sorted by address, any aligned run of 16
+        //  contiguous chunks makes up one chunk of the next size
+        std_k::heap_sort<chunk>(scratch, num_chunks);
+
+        // Whatever isn't merged is pushed back, starting from the bottom
+        top       = block;
+        top_count = 0;
+        total     = 0;
+
+        index = 0;
+        while (index < num_chunks) {
+            chunk& current = scratch[index];
+            if (num_merged < (int)COALESCE_BATCH_SIZE
+                && !(current.p_start % merged_size)
+                && (index + 0xf) < num_chunks
+                && (scratch[index + 0xf].p_start - current.p_start)
+                       == (chunk_size * 0xf)) {
+                merged_chunks[num_merged++] = chunk(merged_size,
+                                                    current.p_start);
+                index += 0x10;
+            } else {
+                push(current);
+                index++;
+            }
+        }
+
+        // Don't go through the whole reservoir again until it has doubled
+        next_coalesce = (total * 2 > (int)RESERVOIR_DEFAULT_SIZE)
+                            ? (total * 2)
+                            : RESERVOIR_DEFAULT_SIZE;
+
+        access_lock.unlock();
+
+        // Only pass the larger chunks on once this reservoir is released
+        if (num_merged) {
+            memory_reservoirs[domain][pile_index + 1].add_chunks(
+                merged_chunks, num_merged, can_grow);
+        }
+    } while (num_merged == (int)COALESCE_BATCH_SIZE);
+}
+
+void add_to_domain(chunk new_chunk) {
+    unsigned int domain = topology.get_domain(new_chunk.p_start);
+    unsigned int index  = get_chunk_index(new_chunk.size);
+
+    // Chunks spanning more than one domain get broken down until they don't
+    if (index > 0
+        && topology.get_domain(new_chunk.p_start + new_chunk.size - 1)
+               != domain) {
+        size_t smaller_size = new_chunk.size >> 4;
+        for (uintptr_t i = 0; i < 0x10; i++) {
+            add_to_domain(
+                chunk(smaller_size, new_chunk.p_start + (smaller_size * i)));
+        }
+        return;
+    }
+
+    memory_reservoirs[domain][index].add_chunk(new_chunk);
+}
+
+void distribute_domains() {
+
+    if (topology.num_domains <= 1) { return; }
+
+    // Pull everything out of the first domain, and send each chunk to the
+    //  domain it actually belongs to
+    for (unsigned int i = 0; i < NUM_MEMORY_PILES; i++) {
+        chunk_reservoir& source = memory_reservoirs[0][i];
+
+        int    max_chunks = source.size();
+        chunk* moved_chunks
+            = (chunk*)malloc(sizeof(chunk) * (max_chunks ? max_chunks : 1));
+        int num_chunks = source.take_chunks(moved_chunks, max_chunks);
+
+        for (int j = 0; j < num_chunks; j++) { add_to_domain(moved_chunks[j]); }
+
+        free(moved_chunks);
+    }
+}
+
 void turn_to_chunks(uintptr_t start_address, size_t size) {
 
     // Start at page-aligned address
@@ -82,27 +274,19 @@ void turn_to_chunks(uintptr_t start_address, size_t size) {
 
     if (size < PAGE_SIZE) { return; }
 
-    // Can turn this area of memory into chunks
-    uint64_t     current_size  = PAGE_SIZE << ((NUM_MEMORY_PILES - 1) * 4);
-    unsigned int current_index = NUM_MEMORY_PILES - 1;
-    while (size >= PAGE_SIZE && current_size >= PAGE_SIZE) {
-
-        unsigned int num_chunks = size / current_size;
-        size %= current_size;
-        while (num_chunks) {
-            // Create next chunk
-            chunk new_chunk(current_size, start_address);
-
-            // Add it to the appropriate reservoir
-            memory_reservoirs[current_index].add_chunk(new_chunk);
-
-            // Increase the target's address
-            start_address += current_size;
-            num_chunks--;
+    // Carve out the largest chunk that both fits and is naturally aligned
+    //  at each step, so the larger chunks can be mapped with large pages
+    while (size >= PAGE_SIZE) {
+        uint64_t current_size = get_chunk_size(NUM_MEMORY_PILES - 1);
+        while (current_size > size || (start_address % current_size) != 0) {
+            current_size >>= 4;
         }
 
-        current_size >>= 4;
-        current_index--;
+        // Add it to the appropriate reservoir
+        add_to_domain(chunk(current_size, start_address));
+
+        start_address += current_size;
+        size -= current_size;
     }
 }
 
@@ -150,9 +334,12 @@ void mmap_to_chunks(multiboot_mmap_entry target) {
 
 void construct_chunks(multiboot_boot_info* mb_info) {
 
-    // Create the reservoirs
-    for (unsigned int i = 0; i < NUM_MEMORY_PILES; i++) {
-        new (&memory_reservoirs[i]) chunk_reservoir(i);
+    // Create the reservoirs, everything goes to the first domain until the
+    //  system's topology is known
+    for (unsigned int domain = 0; domain < MAX_NUMA_DOMAINS; domain++) {
+        for (unsigned int i = 0; i < NUM_MEMORY_PILES; i++) {
+            new (&memory_reservoirs[domain][i]) chunk_reservoir(domain, i);
+        }
     }
 
     // Break the multiboot entries down into the chunk reservoirs
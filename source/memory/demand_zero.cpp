@@ -0,0 +1,234 @@
+/**
+ * @file demand_zero.cpp
+ * @author Shane Menzies
+ * @brief Allocations backed page by page as they're first touched
+ * @date 10/17/26
+ *
+ *
+ */
+
+#include "demand_zero.h"
+
+#include "addressing.h"
+#include "frames.h"
+#include "libk/asm.h"
+#include "libk/cstring.h"
+#include "mem_stats.h"
+#include "page_info.h"
+#include "super_memory.h"
+#include "system/init.h"
+
+namespace paging {
+
+// Frames handed back per transaction when freeing a reservation
+constexpr size_t demand_zero_batch = 64;
+
+static reservation_table reservations;
+
+// First range starting after the address
+size_t reservation_table::index_after(uintptr_t address) const {
+    size_t low  = 0;
+    size_t high = count;
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        if (ranges[middle].start <= address) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+void reservation_table::grow() {
+    if (!grow_lock.try_lock()) { return; }
+
+    size_t         new_capacity = capacity * 2;
+    address_range* new_ranges
+        = (address_range*)chunk_alloc(sizeof(address_range) * new_capacity);
+
+    address_range* old_ranges = new_ranges;
+    if (new_ranges != nullptr) {
+        uint64_t flags = save_and_disable_interrupts();
+        lock.lock();
+
+        std_k::memcpy(new_ranges, ranges, count * sizeof(address_range));
+        old_ranges = ranges;
+        ranges     = new_ranges;
+        capacity   = new_capacity;
+
+        lock.unlock();
+        restore_interrupts(flags);
+    }
+
+    if (old_ranges != nullptr && old_ranges != initial_ranges) {
+        chunk_free((uintptr_t)old_ranges);
+    }
+
+    grow_lock.unlock();
+}
+
+bool reservation_table::add(address_range target) {
+    if ((__atomic_load_n(&count, __ATOMIC_RELAXED) + 1) >= capacity) {
+        grow();
+    }
+
+    uint64_t flags = save_and_disable_interrupts();
+    lock.lock();
+
+    bool added = (count < capacity);
+    if (added) {
+        size_t index = index_after(target.start);
+        std_k::memmove(&ranges[index + 1], &ranges[index],
+                       (count - index) * sizeof(address_range));
+        ranges[index] = target;
+        count++;
+    }
+
+    lock.unlock();
+    restore_interrupts(flags);
+    return added;
+}
+
+void reservation_table::remove(uintptr_t start) {
+    uint64_t flags = save_and_disable_interrupts();
+    lock.lock();
+
+    size_t index = index_after(start);
+    if (index > 0 && ranges[index - 1].start == start) {
+        index--;
+        std_k::memmove(&ranges[index], &ranges[index + 1],
+                       (count - index - 1) * sizeof(address_range));
+        count--;
+    }
+
+    lock.unlock();
+    restore_interrupts(flags);
+}
+
+void reservation_table::resize(uintptr_t start, size_t size) {
+    uint64_t flags = save_and_disable_interrupts();
+    lock.lock();
+
+    size_t index = index_after(start);
+    if (index > 0 && ranges[index - 1].start == start) {
+        ranges[index - 1].size = size;
+    }
+
+    lock.unlock();
+    restore_interrupts(flags);
+}
+
+bool reservation_table::find(uintptr_t address, address_range& found) {
+    uint64_t flags = save_and_disable_interrupts();
+    lock.lock();
+
+    size_t index = index_after(address);
+    bool   inside = (index > 0) && (address < ranges[index - 1].end());
+    if (inside) { found = ranges[index - 1]; }
+
+    lock.unlock();
+    restore_interrupts(flags);
+    return inside;
+}
+
+void* demand_zero_alloc(size_t size, size_t alignment) {
+    size = round_up_page_aligned(size);
+    if (alignment < PAGE_SIZE) { alignment = PAGE_SIZE; }
+    if (!prepare_frame_windows()) { return nullptr; }
+
+    uintptr_t start = (uintptr_t)kernel_address_space.get_new_address(
+        size, alignment);
+    if (start == 0) { return nullptr; }
+
+    page_descriptor* info = page_info.claim(start, page_reserved);
+    if (info == nullptr || !reservations.add(address_range{start, size})) {
+        if (info != nullptr) { info->owner = page_unused; }
+        kernel_address_space.release_address((void*)start, size);
+        return nullptr;
+    }
+
+    info->length = size;
+    mem_stats::count(mem_stats::reservation);
+    return (void*)start;
+}
+
+void demand_zero_free(uintptr_t address) {
+    page_descriptor* info = page_info.get(address);
+    if (info == nullptr || info->owner != page_reserved) { return; }
+
+    size_t size = info->length;
+    reservations.remove(address);
+
+    // Frames can only go back once no core can still be writing to them
+    uintptr_t current   = address;
+    size_t    remaining = size;
+    while (remaining) {
+        uintptr_t frames[demand_zero_batch];
+        size_t    num_frames;
+        size_t    done;
+        {
+            mapping_transaction<kernel_only_address_space> mapping(
+                kernel_address_space);
+            done = mapping.take_pages(current, remaining, frames,
+                                      demand_zero_batch, num_frames);
+        }
+
+        for (size_t i = 0; i < num_frames; i++) { pfree(frames[i]); }
+        current += done;
+        remaining -= done;
+    }
+
+    info->owner = page_unused;
+    kernel_address_space.release_address((void*)address, size);
+}
+
+bool demand_zero_grow(uintptr_t address, size_t new_size) {
+    page_descriptor* info = page_info.get(address);
+    if (info == nullptr || info->owner != page_reserved) { return false; }
+
+    new_size = round_up_page_aligned(new_size);
+    if (new_size <= info->length) { return true; }
+
+    // Nothing is backed yet past the end, so taking the addresses is enough
+    size_t extra = new_size - info->length;
+    if (!kernel_address_space.claim_address((void*)(address + info->length),
+                                            extra)) {
+        return false;
+    }
+
+    reservations.resize(address, new_size);
+    info->length = new_size;
+    return true;
+}
+
+bool demand_zero_fault(uintptr_t address) {
+    if (!initialized) { return false; }
+
+    address_range reservation;
+    if (!reservations.find(address, reservation)) { return false; }
+
+    // Zeroed before it's mapped, so no other core can see it half done,
+    //  ideally already by this core while it was idle
+    uintptr_t frame = take_zeroed_frame();
+    if (frame == 0) {
+        // Out of memory, so it's left to be reported as a fault
+        frame = palloc();
+        if (frame == 0) { return false; }
+        zero_frame(frame);
+    }
+
+    bool filled;
+    {
+        mapping_transaction<kernel_only_address_space> mapping(
+            kernel_address_space);
+        filled = mapping.fill_page(frame, round_down_page_aligned(address));
+    }
+
+    // Another core touched the same page first
+    if (!filled) { pfree(frame); }
+    mem_stats::count(mem_stats::reservation_fault);
+    return true;
+}
+
+} // namespace paging
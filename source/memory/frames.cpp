@@ -0,0 +1,245 @@
+/**
+ * @file frames.cpp
+ * @author Shane Menzies
+ * @brief Ownership counts and scratch windows for physical frames
+ * @date 10/17/26
+ *
+ *
+ */
+
+#include "frames.h"
+
+#include "addressing.h"
+#include "libk/asm.h"
+#include "libk/cstring.h"
+#include "system/init.h"
+#include "threading/threading.h"
+#include "threading/topology.h"
+
+namespace paging {
+
+frame_ref_map frame_refs;
+
+// One window page per core, used to fill frames before they're mapped
+//  where anything else can see them
+static std_k::mutex scratch_lock;
+static uintptr_t    scratch_base    = 0;
+static page_entry** scratch_entries = nullptr;
+
+void frame_ref_map::initialize(uint32_t* window) {
+    new (&backing_lock) std_k::mutex();
+    new (&lock) std_k::mutex();
+
+    for (size_t i = 0; i < (frame_refs_window_pages / 64); i++) {
+        backed[i] = 0;
+    }
+
+    counts = window;
+}
+
+bool frame_ref_map::back_page(size_t window_page) {
+    uint64_t flags = save_and_disable_interrupts();
+    backing_lock.lock();
+
+    // Someone else may have gotten here first
+    if (!is_backed(window_page)) {
+        uintptr_t target = (uintptr_t)counts + (window_page * PAGE_SIZE);
+        uintptr_t frame  = take_zeroed_frame();
+        bool      zeroed = (frame != 0);
+        if (!zeroed) { frame = palloc(); }
+        if (frame == 0) {
+            backing_lock.unlock();
+            restore_interrupts(flags);
+            return false;
+        }
+
+        kernel_address_space.map_page_to(frame, target);
+        if (!zeroed) { std_k::memset((void*)target, 0, PAGE_SIZE); }
+
+        __atomic_or_fetch(&backed[window_page / 64],
+                          ((uint64_t)1 << (window_page % 64)),
+                          __ATOMIC_RELEASE);
+    }
+
+    backing_lock.unlock();
+    restore_interrupts(flags);
+    return true;
+}
+
+uint32_t frame_ref_map::sharers(uintptr_t frame) {
+    uint32_t* count = count_for(frame);
+    if (count == nullptr
+        || !is_backed(((frame / PAGE_SIZE) * sizeof(uint32_t)) / PAGE_SIZE)) {
+        return 0;
+    }
+    return *count;
+}
+
+bool frame_ref_map::prepare(uintptr_t frame) {
+    if (count_for(frame) == nullptr) { return true; }
+
+    size_t window_page = ((frame / PAGE_SIZE) * sizeof(uint32_t)) / PAGE_SIZE;
+    return (is_backed(window_page) || back_page(window_page));
+}
+
+bool frame_ref_map::share(uintptr_t frame) {
+    uint32_t* count = count_for(frame);
+    if (count == nullptr) { return true; }
+
+    if (!prepare(frame)) { return false; }
+    (*count)++;
+    return true;
+}
+
+bool frame_ref_map::release(uintptr_t frame) {
+    if (sharers(frame) == 0) { return true; }
+
+    (*count_for(frame))--;
+    return false;
+}
+
+bool prepare_frame_windows() {
+    if (__atomic_load_n(&scratch_entries, __ATOMIC_ACQUIRE) != nullptr) {
+        return true;
+    }
+
+    scratch_lock.lock();
+    if (scratch_entries == nullptr) {
+        size_t       num_slots = topology.num_logical;
+        page_entry** entries
+            = (page_entry**)malloc(sizeof(page_entry*) * num_slots);
+        uintptr_t base = (uintptr_t)kernel_address_space.get_new_address(
+            num_slots * PAGE_SIZE);
+
+        bool mapped = false;
+        if (entries != nullptr && base != 0) {
+            mapping_transaction<kernel_only_address_space> mapping(
+                kernel_address_space);
+            for (size_t i = 0; i < num_slots; i++) {
+                entries[i] = mapping.entry_for(base + (i * PAGE_SIZE));
+            }
+            mapping.commit();
+            mapped = !mapping.failed();
+        }
+
+        if (mapped) {
+            scratch_base = base;
+            __atomic_store_n(&scratch_entries, entries, __ATOMIC_RELEASE);
+        } else {
+            if (entries != nullptr) { free(entries); }
+            if (base != 0) {
+                kernel_address_space.release_address((void*)base,
+                                                     num_slots * PAGE_SIZE);
+            }
+        }
+    }
+    scratch_lock.unlock();
+
+    return scratch_entries != nullptr;
+}
+
+// Points this core's window at a frame, with interrupts left disabled so
+//  nothing else on the core can reuse the window in the meantime
+static void* open_window(uintptr_t frame, uint64_t& flags) {
+    flags = save_and_disable_interrupts();
+
+    size_t slot
+        = threading::threads_started ? (current_thread() - topology.threads)
+                                     : 0;
+    void* window = (void*)(scratch_base + (slot * PAGE_SIZE));
+
+    // Only this core ever uses the slot, so a local flush is enough
+    *scratch_entries[slot] = frame | p_present | p_write_enabled;
+    refresh_page(window);
+    return window;
+}
+
+static void close_window(void* window, uint64_t flags) {
+    size_t slot = ((uintptr_t)window - scratch_base) / PAGE_SIZE;
+    *scratch_entries[slot] = 0;
+    refresh_page(window);
+
+    restore_interrupts(flags);
+}
+
+void zero_frame(uintptr_t frame) {
+    uint64_t flags;
+    void*    window = open_window(frame, flags);
+    std_k::memset(window, 0, PAGE_SIZE);
+    close_window(window, flags);
+}
+
+void copy_frame(uintptr_t frame, const void* source) {
+    uint64_t flags;
+    void*    window = open_window(frame, flags);
+    std_k::memcpy(window, source, PAGE_SIZE);
+    close_window(window, flags);
+}
+
+// Zeroes with non-temporal stores, so filling the pool doesn't push
+//  anything useful out of the cache
+static void stream_zero(void* window) {
+    uint64_t* target = (uint64_t*)window;
+    for (size_t i = 0; i < (PAGE_SIZE / sizeof(uint64_t)); i += 4) {
+        asm volatile("movnti %[zero], 0(%[target])\n\t"
+                     "movnti %[zero], 8(%[target])\n\t"
+                     "movnti %[zero], 16(%[target])\n\t"
+                     "movnti %[zero], 24(%[target])"
+                     :
+                     : [zero] "r"((uint64_t)0), [target] "r"(&target[i])
+                     : "memory");
+    }
+
+    // Has to land before the window is taken down
+    asm volatile("sfence" : : : "memory");
+}
+
+uintptr_t take_zeroed_frame() {
+    if (!threading::threads_started) { return 0; }
+
+    uint64_t   flags = save_and_disable_interrupts();
+    zero_pool* pool  = current_thread()->zeroed_frames;
+
+    uintptr_t frame = 0;
+    if (pool != nullptr && pool->count > 0) {
+        frame = pool->frames[--pool->count];
+    }
+
+    restore_interrupts(flags);
+    return frame;
+}
+
+void refill_zeroed_frames() {
+    if (!initialized || !threading::threads_started
+        || __atomic_load_n(&scratch_entries, __ATOMIC_ACQUIRE) == nullptr) {
+        return;
+    }
+
+    // A frame at a time with interrupts off, as the scheduler can leave
+    //  this loop for good whenever they're on
+    while (true) {
+        uint64_t   flags = save_and_disable_interrupts();
+        zero_pool* pool  = current_thread()->zeroed_frames;
+        if (pool == nullptr || pool->count == ZERO_POOL_SIZE) {
+            restore_interrupts(flags);
+            return;
+        }
+
+        // Out of memory, so whatever's left is better off handed out as is
+        uintptr_t frame = palloc();
+        if (frame == 0) {
+            restore_interrupts(flags);
+            return;
+        }
+
+        uint64_t window_flags;
+        void*    window = open_window(frame, window_flags);
+        stream_zero(window);
+        close_window(window, window_flags);
+
+        pool->frames[pool->count++] = frame;
+        restore_interrupts(flags);
+    }
+}
+
+} // namespace paging
@@ -8,9 +8,11 @@
  */
 
 #include "addressing.h"
-#include "allocation_manager.h"
 #include "chunking.h"
+#include "demand_zero.h"
+#include "libk/cstring.h"
 #include "p_memory.h"
+#include "page_info.h"
 #include "sub_memory.h"
 #include "super_memory.h"
 #include "system/init.h"
@@ -22,8 +24,6 @@ extern void* kernel_start;
 extern void* kernel_end;
 }
 
-allocation_manager kernel_allocation_manager;
-
 void* operator new(size_t size) { return malloc(size); }
 void* operator new[](size_t size) { return malloc(size); }
 
@@ -152,89 +152,135 @@ void* malloc(size_t size) {
     if (size == 0) { return 0; }
 
     // Hand real allocation to appropriate handler
-    if (size < SUB_PAGE_DATA_PER_PAGE) {
+    if (size <= SLAB_MAX_SIZE
+        && paging::kernel_address_space.slab_memory.available()) {
+        return paging::kernel_address_space.slab_memory.slab_alloc(size);
+    } else if (size < SUB_PAGE_DATA_PER_PAGE) {
         return paging::kernel_address_space.sub_page_memory.sub_alloc(size);
+    } else if (initialized && size >= paging::demand_zero_threshold) {
+        return paging::demand_zero_alloc(size);
+    } else if (initialized) {
+        return chunk_alloc(size);
     } else {
-        allocation_entry* return_entry;
-        if (initialized) {
-            return_entry = chunk_alloc(size);
-        } else {
-            return_entry = bootstrap_chunk_alloc(size);
-        }
-
-        kernel_allocation_manager.add_entry(return_entry);
-
-        return (void*)return_entry->value.address;
+        return bootstrap_chunk_alloc(size);
     }
 }
 
 /**
- * @brief Allocates an area of memory the size of size in bytes
+ * @brief Allocates an area of memory the size of size in bytes, aligned
+ *          on an alignment-byte boundary
  *
  * @param size      Bytes to allocate
+ * @param alignment Needed alignment in bytes
  * @return void*    Pointer to start of newly allocated memory
  */
-void* lock_override_alloc(size_t size, int override_lock_index) {
+void* aligned_alloc(size_t size, size_t alignment) {
 
     if (size == 0) { return 0; }
 
     // Hand real allocation to appropriate handler
-    allocation_entry* return_entry
-        = override_chunk_alloc(size, override_lock_index);
+    if (size <= SLAB_MAX_SIZE && alignment <= SLAB_MAX_SIZE
+        && paging::kernel_address_space.slab_memory.available()) {
+        return paging::kernel_address_space.slab_memory.slab_aligned_alloc(
+            size, alignment);
+    } else if (size < SUB_PAGE_DATA_PER_PAGE && alignment < (PAGE_SIZE / 2)) {
+        return paging::kernel_address_space.sub_page_memory.sub_aligned_alloc(
+            size, alignment);
+    } else if (initialized && size >= paging::demand_zero_threshold) {
+        return paging::demand_zero_alloc(size, alignment);
+    } else if (initialized) {
+        return aligned_chunk_alloc(size, alignment);
+    } else {
+        return bootstrap_aligned_chunk_alloc(size, alignment);
+    }
+}
 
-    kernel_allocation_manager.add_entry(return_entry);
+// Bytes usable in an allocation, or 0 if malloc didn't hand it out
+static size_t allocation_size(uintptr_t address) {
+    paging::page_descriptor* info = paging::page_info.get(address);
+    if (info == nullptr) {
+        if (!paging::kernel_address_space.sub_page_memory.owns_first_region(
+                address)) {
+            return 0;
+        }
+        return paging::kernel_address_space.sub_page_memory.sub_size(address);
+    }
 
-    return (void*)return_entry->value.address;
+    switch (info->owner) {
+        case paging::page_slab:
+            return paging::kernel_address_space.slab_memory.get_object_size(
+                address);
+        case paging::page_sub_region:
+            return paging::kernel_address_space.sub_page_memory.sub_size(
+                address);
+        case paging::page_chunk:
+            return chunk_allocation_size(address);
+        case paging::page_reserved:
+            return info->length;
+        default:
+            return 0;
+    }
 }
 
 /**
- * @brief Allocates an area of memory the size of size in bytes, aligned
- *          on an alignment-byte boundary
+ * @brief Resizes an allocation, keeping what's in it. Chunk allocations
+ *          and reservations are grown by adding to them where possible,
+ *          only falling back to a copy when they can't be
  *
- * @param size      Bytes to allocate
- * @param alignment Needed alignment in bytes
- * @return void*    Pointer to start of newly allocated memory
+ * @param target_address    Allocation to resize, or nullptr for a new one
+ * @param new_size          Bytes needed
+ * @return void*            Start of the resized allocation, or nullptr if
+ *                          it couldn't be resized, leaving it untouched
  */
-void* aligned_alloc(size_t size, size_t alignment) {
+void* realloc(void* target_address, size_t new_size) {
 
-    if (size == 0) { return 0; }
+    if (target_address == nullptr) { return malloc(new_size); }
+    if (new_size == 0) {
+        free(target_address);
+        return nullptr;
+    }
 
-    // Hand real allocation to appropriate handler
-    if (size < SUB_PAGE_DATA_PER_PAGE && alignment < (PAGE_SIZE / 2)) {
-        return paging::kernel_address_space.sub_page_memory.sub_aligned_alloc(
-            size, alignment);
-    } else {
-        allocation_entry* return_entry;
-        if (initialized) {
-            return_entry = aligned_chunk_alloc(size, alignment);
-        } else {
-            return_entry = bootstrap_aligned_chunk_alloc(size, alignment);
+    uintptr_t address  = (uintptr_t)target_address;
+    size_t    old_size = allocation_size(address);
+    if (old_size == 0) { return nullptr; }
+    if (new_size <= old_size) { return target_address; }
+
+    if (initialized) {
+        paging::page_descriptor* info = paging::page_info.get(address);
+        if (info != nullptr && info->owner == paging::page_chunk) {
+            void* grown = chunk_realloc(address, new_size);
+            if (grown != nullptr) { return grown; }
+        } else if (info != nullptr && info->owner == paging::page_reserved
+                   && paging::demand_zero_grow(address, new_size)) {
+            return target_address;
         }
+    }
 
-        kernel_allocation_manager.add_entry(return_entry);
+    void* new_address = malloc(new_size);
+    if (new_address == nullptr) { return nullptr; }
 
-        return (void*)return_entry->value.address;
-    }
+    std_k::memcpy(new_address, target_address, old_size);
+    free(target_address);
+    return new_address;
 }
 
-uintptr_t bootstrap_palloc(bool lock_override) {
+uintptr_t bootstrap_palloc() {
 
     // Get the required chunk
     chunking::chunk required_chunk
-        = chunking::memory_reservoirs[0].get_chunk(lock_override);
+        = chunking::memory_reservoirs[0][0].get_chunk();
     return required_chunk.p_start;
 }
 
-uintptr_t palloc(bool lock_override) {
+uintptr_t palloc() {
 
-    if (!initialized) { return (uintptr_t)bootstrap_palloc(lock_override); }
+    if (!initialized) { return (uintptr_t)bootstrap_palloc(); }
 
     // Start at piles
     chunking::chunk_pile* current_piles = current_thread()->memory_piles;
 
     // Get the required chunk
-    chunking::chunk required_chunk
-        = current_piles[0].get_chunk(false, lock_override);
+    chunking::chunk required_chunk = current_piles[0].get_chunk();
     return required_chunk.p_start;
 }
 
@@ -247,13 +293,30 @@ void free(void* target_address) {
 
     if (target_address == nullptr) return;
 
-    // Check with sub-page bounds first
-    if (!paging::kernel_address_space.sub_page_memory.try_sub_free(
-            (uintptr_t)target_address)) {
-        // Free returned chunks (super-page allocation)
-        allocation_info returned_entry
-            = kernel_allocation_manager.take_entry((uintptr_t)target_address);
-        chunk_free(returned_entry);
+    // Anything outside of the heap can only be from the first sub-page region
+    uintptr_t                address = (uintptr_t)target_address;
+    paging::page_descriptor* info    = paging::page_info.get(address);
+    if (info == nullptr) {
+        paging::kernel_address_space.sub_page_memory.try_sub_free(address);
+        return;
+    }
+
+    // Hand it back to whatever owns that page
+    switch (info->owner) {
+        case paging::page_slab:
+            paging::kernel_address_space.slab_memory.slab_free(address);
+            break;
+        case paging::page_sub_region:
+            paging::kernel_address_space.sub_page_memory.sub_free(address);
+            break;
+        case paging::page_chunk:
+            chunk_free(address);
+            break;
+        case paging::page_reserved:
+            paging::demand_zero_free(address);
+            break;
+        default:
+            break;
     }
 }
 
@@ -261,11 +324,10 @@ void pfree(uintptr_t physical_address) {
     chunking::chunk return_chunk;
     return_chunk.size    = 0x1000;
     return_chunk.p_start = physical_address;
-    chunking::memory_reservoirs[0].add_chunk(return_chunk);
-}
 
-void lock_override_free(void* target_address, int override_lock_index) {
-    allocation_info returned_entry
-        = kernel_allocation_manager.take_entry((uintptr_t)target_address);
-    override_chunk_free(returned_entry, override_lock_index);
+    if (initialized) {
+        current_thread()->memory_piles[0].return_chunk(return_chunk);
+    } else {
+        chunking::memory_reservoirs[0][0].add_chunk(return_chunk);
+    }
 }
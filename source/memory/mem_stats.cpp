@@ -0,0 +1,64 @@
+/**
+ * @file mem_stats.cpp
+ * @author Shane Menzies
+ * @brief Per-core counters for the allocators
+ * @date 10/17/26
+ *
+ *
+ */
+
+#include "mem_stats.h"
+
+#include "system/kernel.h"
+
+namespace mem_stats {
+
+core_counters boot_counters;
+uint64_t      window_start = 0;
+
+void core_counters::clear() {
+    for (unsigned int i = 0; i < NUM_CHUNK_EVENTS; i++) {
+        for (unsigned int j = 0; j < chunking::NUM_MEMORY_PILES; j++) {
+            chunk_events[i][j] = 0;
+        }
+    }
+    for (unsigned int i = 0; i < NUM_HEAP_EVENTS; i++) { heap_events[i] = 0; }
+    for (unsigned int i = 0; i < SLAB_NUM_CLASSES; i++) { slab_classes[i] = 0; }
+}
+
+void core_counters::merge(const core_counters& source) {
+    for (unsigned int i = 0; i < NUM_CHUNK_EVENTS; i++) {
+        for (unsigned int j = 0; j < chunking::NUM_MEMORY_PILES; j++) {
+            chunk_events[i][j] += source.chunk_events[i][j];
+        }
+    }
+    for (unsigned int i = 0; i < NUM_HEAP_EVENTS; i++) {
+        heap_events[i] += source.heap_events[i];
+    }
+    for (unsigned int i = 0; i < SLAB_NUM_CLASSES; i++) {
+        slab_classes[i] += source.slab_classes[i];
+    }
+}
+
+void gather(core_counters& target) {
+    target.clear();
+    target.merge(boot_counters);
+
+    if (!threading::threads_started) { return; }
+    for (unsigned int i = 0; i < topology.num_logical; i++) {
+        target.merge(*topology.threads[i].mem_counters);
+    }
+}
+
+void reset() {
+    boot_counters.clear();
+    if (threading::threads_started) {
+        for (unsigned int i = 0; i < topology.num_logical; i++) {
+            topology.threads[i].mem_counters->clear();
+        }
+    }
+
+    window_start = sys_int_timer->now();
+}
+
+} // namespace mem_stats
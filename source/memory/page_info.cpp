@@ -0,0 +1,68 @@
+/**
+ * @file page_info.cpp
+ * @author Shane Menzies
+ * @brief Per-page metadata for the kernel heap
+ * @date 10/17/26
+ *
+ *
+ */
+
+#include "page_info.h"
+
+#include "addressing.h"
+#include "libk/asm.h"
+
+namespace paging {
+
+page_info_map page_info;
+
+void page_info_map::initialize(uintptr_t heap_base, page_descriptor* window) {
+    new (&backing_lock) std_k::mutex();
+
+    for (size_t i = 0; i < (page_info_window_pages / 64); i++) {
+        backed[i] = 0;
+    }
+
+    base        = heap_base;
+    descriptors = window;
+}
+
+void page_info_map::back_page(size_t window_page) {
+    uint64_t flags = save_and_disable_interrupts();
+    backing_lock.lock();
+
+    // Someone else may have gotten here first
+    if (!is_backed(window_page)) {
+        uintptr_t target = (uintptr_t)descriptors + (window_page * PAGE_SIZE);
+        kernel_address_space.map_page_to(palloc(), target);
+
+        page_descriptor* new_descriptors = (page_descriptor*)target;
+        for (size_t i = 0; i < (PAGE_SIZE / sizeof(page_descriptor)); i++) {
+            new_descriptors[i].owner = page_unused;
+        }
+
+        __atomic_or_fetch(&backed[window_page / 64],
+                          ((uint64_t)1 << (window_page % 64)),
+                          __ATOMIC_RELEASE);
+    }
+
+    backing_lock.unlock();
+    restore_interrupts(flags);
+}
+
+page_descriptor* page_info_map::claim(uintptr_t address, page_owner owner) {
+    if (!covers(address)) return nullptr;
+
+    size_t index       = (address - base) / PAGE_SIZE;
+    size_t window_page = (index * sizeof(page_descriptor)) / PAGE_SIZE;
+    if (!is_backed(window_page)) { back_page(window_page); }
+
+    page_descriptor* target = &descriptors[index];
+    target->owner           = owner;
+    target->size_class      = 0;
+    target->num_chunks      = 0;
+    target->p_start         = 0;
+    return target;
+}
+
+} // namespace paging
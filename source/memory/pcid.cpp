@@ -0,0 +1,167 @@
+/**
+ * @file pcid.cpp
+ * @author Shane Menzies
+ * @brief Switching between address spaces tagged with PCIDs
+ * @date 10/17/26
+ *
+ *
+ */
+
+#include "pcid.h"
+
+#include "addressing.h"
+#include "libk/asm.h"
+#include "threading/threading.h"
+#include "threading/topology.h"
+
+namespace paging {
+
+uint64_t next_space_id = KERNEL_SPACE_ID;
+
+// Every core reports the same, so it's only kept once
+static bool use_invpcid = false;
+
+static inline pcid_cache* local_cache() {
+    if (!threading::threads_started) { return nullptr; }
+    return current_thread()->pcids;
+}
+
+void pcid_init() {
+    pcid_cache* cache = local_cache();
+    if (cache == nullptr) { return; }
+
+    uintptr_t table     = get_current_table();
+    cache->kernel_table = table & physical_address_bitmask;
+
+    // Can only be turned on while the bits of CR3 that become the PCID are
+    //  all clear
+    if (!pcid_supported() || (table & ~real_address_bitmask)) { return; }
+    use_invpcid = invpcid_supported();
+
+    asm volatile("movq %%cr4, %%rax \n\t\
+         orq $0x20000, %%rax \n\t\
+         movq %%rax, %%cr4"
+                 :
+                 :
+                 : "rax", "memory");
+    cache->enabled = true;
+}
+
+void load_address_space(address_space* space) {
+    pcid_cache* cache = local_cache();
+    if (cache == nullptr) { return; }
+
+    uint64_t id    = (space == nullptr) ? KERNEL_SPACE_ID : space->space_id;
+    uint64_t flags = save_and_disable_interrupts();
+    if (cache->loaded == id) {
+        restore_interrupts(flags);
+        return;
+    }
+
+    uintptr_t table = cache->kernel_table;
+    if (space != nullptr) {
+        if (space->table_address == 0) {
+            space->table_address
+                = kernel_address_space.virt_to_phys(space->primary_table);
+        }
+        table = space->table_address;
+    }
+
+    if (!cache->enabled) {
+        load_table(table);
+    } else {
+        unsigned int pcid = 0;
+        while (pcid < PCID_SLOTS && cache->owners[pcid] != id) { pcid++; }
+
+        // Not one this core has given out, so the next one in turn is taken,
+        //  and whatever it still held is flushed as it's loaded
+        bool flush = false;
+        if (pcid == PCID_SLOTS) {
+            pcid                = cache->next_victim;
+            cache->next_victim  = ((pcid + 1) < PCID_SLOTS) ? (pcid + 1) : 1;
+            cache->owners[pcid] = id;
+            flush               = true;
+        }
+
+        if (cache->stale & (1U << pcid)) {
+            cache->stale &= ~(1U << pcid);
+            flush = true;
+        }
+
+        load_table(table | pcid | (flush ? 0 : PCID_NO_FLUSH));
+    }
+
+    cache->loaded       = id;
+    cache->loaded_space = space;
+    restore_interrupts(flags);
+}
+
+address_space* enter_address_space(address_space* space) {
+    pcid_cache* cache = local_cache();
+    if (cache == nullptr) { return space; }
+
+    address_space* previous = cache->loaded_space;
+    load_address_space(space);
+    return previous;
+}
+
+void leave_address_space(address_space* space, address_space* previous) {
+    if (previous == space || local_cache() == nullptr) { return; }
+
+    threading::thread_scheduler* scheduler = current_thread()->scheduler;
+    if (scheduler != nullptr && scheduler->current_task != nullptr
+        && scheduler->current_task->task_space == space) {
+        return;
+    }
+
+    load_address_space(previous);
+}
+
+void flush_local(const uintptr_t* pages, size_t num_pages) {
+    pcid_cache* cache = local_cache();
+    if (cache == nullptr || !cache->enabled) {
+        if (num_pages > flush_page_threshold) {
+            refresh_all_pages();
+        } else {
+            for (size_t i = 0; i < num_pages; i++) {
+                refresh_page((void*)pages[i]);
+            }
+        }
+        return;
+    }
+
+    uint64_t     flags   = save_and_disable_interrupts();
+    unsigned int current = get_current_table() & ~real_address_bitmask;
+
+    if (num_pages > flush_page_threshold) {
+        if (use_invpcid) {
+            invalidate_pcid(invpcid_all_context, 0);
+            cache->stale = 0;
+        } else {
+            refresh_all_pages();
+            cache->stale = ((1U << PCID_SLOTS) - 1) & ~(1U << current);
+        }
+    } else {
+        for (size_t i = 0; i < num_pages; i++) {
+            refresh_page((void*)pages[i]);
+        }
+
+        // invlpg only reaches the loaded PCID, the others are either done
+        //  one address at a time or left to be flushed when next loaded
+        for (unsigned int pcid = 0; pcid < PCID_SLOTS; pcid++) {
+            if (pcid == current || cache->owners[pcid] == ~0UL) { continue; }
+
+            if (use_invpcid) {
+                for (size_t i = 0; i < num_pages; i++) {
+                    invalidate_pcid(invpcid_address, pcid, pages[i]);
+                }
+            } else {
+                cache->stale |= (1U << pcid);
+            }
+        }
+    }
+
+    restore_interrupts(flags);
+}
+
+} // namespace paging
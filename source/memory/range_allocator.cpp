@@ -0,0 +1,364 @@
+/**
+ * @file range_allocator.cpp
+ * @author Shane Menzies
+ * @brief Reusable ranges of virtual addresses
+ * @date 10/17/26
+ *
+ *
+ */
+
+#include "range_allocator.h"
+
+#include "libk/asm.h"
+#include "libk/cstring.h"
+#include "libk/misc.h"
+#include "memory/paging.h"
+#include "threading/threading.h"
+#include "threading/topology.h"
+
+namespace paging {
+
+void range_allocator::initialize(uintptr_t start, size_t size,
+                                 bool use_core_caches) {
+    new (&lock) std_k::mutex();
+    new (&grow_lock) std_k::mutex();
+
+    by_address      = initial_by_address;
+    by_size         = initial_by_size;
+    count           = 0;
+    capacity        = RANGE_INITIAL_CAPACITY;
+    total_free      = 0;
+    pending_count   = 0;
+    per_core_caches = use_core_caches;
+
+    if (size != 0) {
+        insert_range(address_range{start, size});
+        total_free = size;
+    }
+}
+
+// First range starting at or after the address
+size_t range_allocator::address_index(uintptr_t start) const {
+    size_t low  = 0;
+    size_t high = count;
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        if (by_address[middle].start < start) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// First range not ordered before the target
+size_t range_allocator::size_index(const address_range& target) const {
+    size_t low  = 0;
+    size_t high = count;
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        if (size_before(by_size[middle], target)) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// Callers make sure there's room first
+void range_allocator::insert_range(address_range target) {
+    size_t index = address_index(target.start);
+    std_k::memmove(&by_address[index + 1], &by_address[index],
+                   (count - index) * sizeof(address_range));
+    by_address[index] = target;
+
+    index = size_index(target);
+    std_k::memmove(&by_size[index + 1], &by_size[index],
+                   (count - index) * sizeof(address_range));
+    by_size[index] = target;
+
+    count++;
+}
+
+void range_allocator::remove_range(size_t index) {
+    address_range target = by_address[index];
+    std_k::memmove(&by_address[index], &by_address[index + 1],
+                   (count - index - 1) * sizeof(address_range));
+
+    index = size_index(target);
+    std_k::memmove(&by_size[index], &by_size[index + 1],
+                   (count - index - 1) * sizeof(address_range));
+
+    count--;
+}
+
+// Fails without changing anything if there might not be room for it
+bool range_allocator::add_free(address_range target) {
+    if (count == capacity) { return false; }
+
+    size_t added = target.size;
+    size_t index = address_index(target.start);
+
+    // Merge with the neighbour below
+    if (index > 0 && by_address[index - 1].end() == target.start) {
+        target.start = by_address[index - 1].start;
+        target.size += by_address[index - 1].size;
+        remove_range(--index);
+    }
+
+    // And the one above
+    if (index < count && target.end() == by_address[index].start) {
+        target.size += by_address[index].size;
+        remove_range(index);
+    }
+
+    insert_range(target);
+    total_free += added;
+    return true;
+}
+
+// Takes part of a free range, giving back whatever is left on either side,
+//  unless that would leave one more range than there's room for
+bool range_allocator::carve(address_range source, uintptr_t start,
+                            size_t size) {
+    if (start > source.start && (start + size) < source.end()
+        && count == capacity) {
+        return false;
+    }
+
+    remove_range(address_index(source.start));
+    total_free -= source.size;
+
+    if (start > source.start) {
+        address_range below{source.start, start - source.start};
+        insert_range(below);
+        total_free += below.size;
+    }
+    if ((start + size) < source.end()) {
+        address_range above{start + size, source.end() - (start + size)};
+        insert_range(above);
+        total_free += above.size;
+    }
+    return true;
+}
+
+uintptr_t range_allocator::take_range(size_t size, size_t alignment) {
+
+    // Smallest range that still fits once aligned
+    for (size_t i = size_index(address_range{0, size}); i < count; i++) {
+        address_range candidate = by_size[i];
+        uintptr_t     aligned
+            = std_k::round_up_multiple(candidate.start, alignment);
+        if (aligned < candidate.start
+            || (aligned - candidate.start) + size > candidate.size) {
+            continue;
+        }
+
+        if (carve(candidate, aligned, size)) { return aligned; }
+    }
+
+    return 0;
+}
+
+range_cache* range_allocator::local_cache() {
+    if (!per_core_caches || !threading::threads_started) { return nullptr; }
+    return current_thread()->va_cache;
+}
+
+void range_allocator::grow() {
+    // Already being grown, possibly further up this core's stack, and the
+    //  headroom covers whatever happens in the meantime
+    if (!grow_lock.try_lock()) { return; }
+
+    size_t         new_capacity = capacity * 2;
+    address_range* new_by_address
+        = (address_range*)malloc(sizeof(address_range) * new_capacity);
+    address_range* new_by_size
+        = (address_range*)malloc(sizeof(address_range) * new_capacity);
+
+    address_range* old_by_address = nullptr;
+    address_range* old_by_size    = nullptr;
+    if (new_by_address != nullptr && new_by_size != nullptr) {
+        uint64_t flags = save_and_disable_interrupts();
+        lock.lock();
+
+        std_k::memcpy(new_by_address, by_address,
+                      count * sizeof(address_range));
+        std_k::memcpy(new_by_size, by_size, count * sizeof(address_range));
+
+        old_by_address = by_address;
+        old_by_size    = by_size;
+        by_address     = new_by_address;
+        by_size        = new_by_size;
+        capacity       = new_capacity;
+
+        // Ranges that were freed while there was no room
+        while (pending_count > 0 && count < capacity) {
+            add_free(pending[--pending_count]);
+        }
+
+        lock.unlock();
+        restore_interrupts(flags);
+    } else {
+        old_by_address = new_by_address;
+        old_by_size    = new_by_size;
+    }
+
+    if (old_by_address != nullptr && old_by_address != initial_by_address) {
+        free(old_by_address);
+    }
+    if (old_by_size != nullptr && old_by_size != initial_by_size) {
+        free(old_by_size);
+    }
+
+    grow_lock.unlock();
+}
+
+uintptr_t range_allocator::allocate(size_t size, size_t alignment,
+                                    bool can_grow) {
+    size = round_up_page_aligned(size);
+    if (alignment < PAGE_SIZE) { alignment = PAGE_SIZE; }
+
+    if (can_grow && (num_ranges() + RANGE_GROW_HEADROOM) > capacity) {
+        grow();
+    }
+
+    uint64_t flags = save_and_disable_interrupts();
+
+    // Recently freed ranges of the same size first
+    range_cache* cache = local_cache();
+    if (cache != nullptr) {
+        for (size_t i = cache->count; i-- > 0;) {
+            address_range cached = cache->ranges[i];
+            if (cached.size == size && (cached.start % alignment) == 0) {
+                cache->ranges[i] = cache->ranges[--cache->count];
+                restore_interrupts(flags);
+                return cached.start;
+            }
+        }
+    }
+
+    lock.lock();
+    uintptr_t result = take_range(size, alignment);
+    lock.unlock();
+
+    restore_interrupts(flags);
+    return result;
+}
+
+void range_allocator::release(uintptr_t start, size_t size) {
+    size = round_up_page_aligned(size);
+    if (size == 0) { return; }
+
+    if ((num_ranges() + RANGE_GROW_HEADROOM) > capacity) { grow(); }
+
+    uint64_t flags = save_and_disable_interrupts();
+
+    range_cache* cache = local_cache();
+    if (cache != nullptr && size <= RANGE_CACHE_MAX_SIZE) {
+        if (cache->count == RANGE_CACHE_SIZE) {
+            // Spill the older half back to the shared lists, or as much of
+            //  it as they have room for
+            lock.lock();
+            size_t spilled = 0;
+            while (spilled < (RANGE_CACHE_SIZE / 2)
+                   && add_free(cache->ranges[spilled])) {
+                spilled++;
+            }
+            lock.unlock();
+
+            for (size_t i = spilled; i < cache->count; i++) {
+                cache->ranges[i - spilled] = cache->ranges[i];
+            }
+            cache->count -= spilled;
+        }
+
+        if (cache->count < RANGE_CACHE_SIZE) {
+            cache->ranges[cache->count++] = address_range{start, size};
+            restore_interrupts(flags);
+            return;
+        }
+    }
+
+    lock.lock();
+    while (!add_free(address_range{start, size})) {
+        // Parked until the next grow folds it back in, as this may be
+        //  running under the grow itself. Only with those full as well does
+        //  it have to wait for the arrays to grow
+        if (pending_count < RANGE_GROW_HEADROOM) {
+            pending[pending_count++] = address_range{start, size};
+            break;
+        }
+
+        lock.unlock();
+        restore_interrupts(flags);
+        grow();
+        flags = save_and_disable_interrupts();
+        lock.lock();
+    }
+    lock.unlock();
+
+    restore_interrupts(flags);
+}
+
+bool range_allocator::claim(uintptr_t start, size_t size, bool can_grow) {
+    size = round_up_page_aligned(size);
+    if (size == 0) { return true; }
+
+    if (can_grow && (num_ranges() + RANGE_GROW_HEADROOM) > capacity) {
+        grow();
+    }
+
+    uint64_t flags = save_and_disable_interrupts();
+    lock.lock();
+
+    // Only the last range starting at or below the address can hold it
+    size_t index   = address_index(start + 1);
+    bool   claimed = false;
+    if (index > 0 && by_address[index - 1].start <= start
+        && (start + size) <= by_address[index - 1].end()) {
+        claimed = carve(by_address[index - 1], start, size);
+    }
+
+    lock.unlock();
+    restore_interrupts(flags);
+    return claimed;
+}
+
+void range_allocator::copy_from(range_allocator& source) {
+    while (true) {
+        // Sized up outside of the locks, then checked again under them
+        while ((source.num_ranges() + RANGE_GROW_HEADROOM) > capacity) {
+            size_t old_capacity = capacity;
+            grow();
+            if (capacity == old_capacity) { return; }
+        }
+
+        uint64_t flags = save_and_disable_interrupts();
+        source.lock.lock();
+        lock.lock();
+
+        bool fits = (source.count <= capacity);
+        if (fits) {
+            std_k::memcpy(by_address, source.by_address,
+                          source.count * sizeof(address_range));
+            std_k::memcpy(by_size, source.by_size,
+                          source.count * sizeof(address_range));
+            std_k::memcpy(pending, source.pending,
+                          source.pending_count * sizeof(address_range));
+            count         = source.count;
+            total_free    = source.total_free;
+            pending_count = source.pending_count;
+        }
+
+        lock.unlock();
+        source.lock.unlock();
+        restore_interrupts(flags);
+
+        if (fits) { return; }
+    }
+}
+
+} // namespace paging
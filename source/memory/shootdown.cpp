@@ -0,0 +1,138 @@
+/**
+ * @file shootdown.cpp
+ * @author Shane Menzies
+ * @brief Cross-core TLB invalidation
+ * @date 10/17/26
+ *
+ *
+ */
+
+#include "shootdown.h"
+
+#include "libk/asm.h"
+#include "pcid.h"
+#include "threading/apic.h"
+#include "threading/threading.h"
+#include "threading/topology.h"
+
+namespace paging {
+
+// Targets are queued and waited on in batches of this many
+constexpr unsigned int SHOOTDOWN_BATCH = 64;
+
+void tlb_online() {
+    shootdown_queue* queue = current_thread()->tlb_queue;
+    if (queue == nullptr) { return; }
+
+    pcid_init();
+
+    // Drop anything cached from before requests were being sent here
+    refresh_all_pages();
+    __atomic_store_n(&queue->online, true, __ATOMIC_RELEASE);
+}
+
+void service_shootdowns() {
+    if (!threading::threads_started) { return; }
+
+    shootdown_queue* queue = current_thread()->tlb_queue;
+    if (queue == nullptr) { return; }
+
+    uint64_t flags = save_and_disable_interrupts();
+    queue->lock.lock();
+
+    // Take everything queued so far, later requests will send a new IPI
+    uintptr_t pages[flush_page_threshold];
+    size_t    num_pages  = queue->full_flush ? (flush_page_threshold + 1)
+                                             : queue->num_pages;
+    uint64_t  generation = queue->requested;
+    for (size_t i = 0; i < queue->num_pages && !queue->full_flush; i++) {
+        pages[i] = queue->pages[i];
+    }
+
+    queue->num_pages   = 0;
+    queue->full_flush  = false;
+    queue->ipi_pending = false;
+    queue->lock.unlock();
+
+    flush_local(pages, num_pages);
+    __atomic_store_n(&queue->completed, generation, __ATOMIC_RELEASE);
+
+    restore_interrupts(flags);
+}
+
+// Adds the pages to a core's queue, returning the generation to wait on
+static uint64_t queue_shootdown(logical_core* target, const uintptr_t* pages,
+                                size_t num_pages) {
+    shootdown_queue* queue = target->tlb_queue;
+
+    uint64_t flags = save_and_disable_interrupts();
+    queue->lock.lock();
+
+    if (queue->full_flush
+        || (queue->num_pages + num_pages) > flush_page_threshold) {
+        queue->full_flush = true;
+    } else {
+        for (size_t i = 0; i < num_pages; i++) {
+            queue->pages[queue->num_pages++] = pages[i];
+        }
+    }
+
+    uint64_t generation = ++queue->requested;
+
+    // Only the first request since the core last looked needs an IPI
+    bool send_ipi      = !queue->ipi_pending;
+    queue->ipi_pending = true;
+    queue->lock.unlock();
+
+    if (send_ipi) {
+        current_apic::send_apic_command(target->local_apic.id,
+                                        SHOOTDOWN_VECTOR);
+    }
+
+    restore_interrupts(flags);
+    return generation;
+}
+
+void shootdown(const uintptr_t* pages, size_t num_pages) {
+    if (num_pages == 0) { return; }
+
+    flush_local(pages, num_pages);
+    if (!threading::threads_started) { return; }
+
+    logical_core* self = current_thread();
+
+    uint64_t      generations[SHOOTDOWN_BATCH];
+    logical_core* targets[SHOOTDOWN_BATCH];
+    for (unsigned int base = 0; base < topology.num_logical;
+         base += SHOOTDOWN_BATCH) {
+
+        // Queue the whole batch first, so the targets all flush together
+        unsigned int num_targets = 0;
+        for (unsigned int i = base;
+             i < topology.num_logical && i < (base + SHOOTDOWN_BATCH); i++) {
+            logical_core* target = &topology.threads[i];
+            if (target == self || target->tlb_queue == nullptr
+                || !__atomic_load_n(&target->tlb_queue->online,
+                                    __ATOMIC_ACQUIRE)) {
+                continue;
+            }
+
+            generations[num_targets] = queue_shootdown(target, pages,
+                                                       num_pages);
+            targets[num_targets++]   = target;
+        }
+
+        // Then wait on them, running anything sent here in the meantime
+        //  so two cores shooting at each other can't get stuck
+        for (unsigned int i = 0; i < num_targets; i++) {
+            while (__atomic_load_n(&targets[i]->tlb_queue->completed,
+                                   __ATOMIC_ACQUIRE)
+                   < generations[i]) {
+                service_shootdowns();
+                asm volatile("pause");
+            }
+        }
+    }
+}
+
+} // namespace paging
@@ -9,18 +9,33 @@
 
 #include "sub_memory.h"
 
+#include "addressing.h"
+#include "libk/asm.h"
+#include "mem_stats.h"
+#include "page_info.h"
+#include "system/init.h"
 #include "system/pintos_std.h"
+#include "threading/topology.h"
 
 sub_mem_manager kernel_sub_mem_manager;
 
 void* sub_mem_manager::sub_alloc(size_t size) {
+    mem_stats::count(mem_stats::sub_alloc);
+
+    uint64_t flags = save_and_disable_interrupts();
+    lock.lock();
+
     sub_mem_region* current_region = &first_region;
 
     // Check existing regions
     while (1) {
         if (current_region->total_space_free > size) {
             void* returned_address = current_region->allocate_space(size);
-            if ((uintptr_t)returned_address != 0) { return returned_address; }
+            if ((uintptr_t)returned_address != 0) {
+                lock.unlock();
+                restore_interrupts(flags);
+                return returned_address;
+            }
         }
 
         if ((uintptr_t)current_region->next_region) {
@@ -31,15 +46,23 @@ void* sub_mem_manager::sub_alloc(size_t size) {
     }
 
     // Need to add another region to allocate on
-    current_region->next_region = new sub_mem_region();
-    if ((uintptr_t)current_region->next_region < earliest_address)
-        earliest_address = (uintptr_t)current_region->next_region;
-    if ((uintptr_t)current_region->next_region + PAGE_SIZE > latest_address)
-        latest_address = (uintptr_t)current_region->next_region + PAGE_SIZE;
-    return current_region->next_region->allocate_space(size);
+    current_region->next_region = new_region();
+    void* returned_address
+        = (current_region->next_region == nullptr)
+              ? nullptr
+              : current_region->next_region->allocate_space(size);
+
+    lock.unlock();
+    restore_interrupts(flags);
+    return returned_address;
 }
 
 void* sub_mem_manager::sub_aligned_alloc(size_t size, size_t alignment) {
+    mem_stats::count(mem_stats::sub_alloc);
+
+    uint64_t flags = save_and_disable_interrupts();
+    lock.lock();
+
     sub_mem_region* current_region = &first_region;
 
     // Check existing regions
@@ -47,7 +70,11 @@ void* sub_mem_manager::sub_aligned_alloc(size_t size, size_t alignment) {
         if (current_region->total_space_free > size) {
             void* returned_address
                 = current_region->allocate_aligned_space(size, alignment);
-            if ((uintptr_t)returned_address != 0) { return returned_address; }
+            if ((uintptr_t)returned_address != 0) {
+                lock.unlock();
+                restore_interrupts(flags);
+                return returned_address;
+            }
         }
 
         if ((uintptr_t)current_region->next_region) {
@@ -58,32 +85,229 @@ void* sub_mem_manager::sub_aligned_alloc(size_t size, size_t alignment) {
     }
 
     // Need to add another region to allocate on
-    current_region->next_region = new sub_mem_region();
-    if ((uintptr_t)current_region->next_region < earliest_address)
-        earliest_address = (uintptr_t)current_region->next_region;
-    if ((uintptr_t)current_region->next_region + PAGE_SIZE > latest_address)
-        latest_address = (uintptr_t)current_region->next_region + PAGE_SIZE;
-    return current_region->next_region->allocate_aligned_space(size, alignment);
+    current_region->next_region = new_region();
+    void* returned_address
+        = (current_region->next_region == nullptr)
+              ? nullptr
+              : current_region->next_region->allocate_aligned_space(size,
+                                                                    alignment);
+
+    lock.unlock();
+    restore_interrupts(flags);
+    return returned_address;
+}
+
+sub_mem_region* sub_mem_manager::new_region() {
+    mem_stats::count(mem_stats::sub_region);
+
+    uintptr_t target
+        = (uintptr_t)paging::kernel_address_space.get_new_address(PAGE_SIZE);
+    if (target == 0) { return nullptr; }
+
+    uintptr_t frame = palloc();
+    if (frame == 0) {
+        paging::kernel_address_space.release_address((void*)target,
+                                                     PAGE_SIZE);
+        return nullptr;
+    }
+
+    paging::kernel_address_space.map_page_to(frame, target);
+    paging::page_info.claim(target, paging::page_sub_region);
+
+    return new ((void*)target) sub_mem_region();
+}
+
+void sub_mem_manager::sub_free(uintptr_t address) {
+    mem_stats::count(mem_stats::sub_free);
+
+    sub_mem_region* target_region
+        = (sub_mem_region*)(address & ~(PAGE_SIZE - 1));
+
+    uint64_t flags = save_and_disable_interrupts();
+    lock.lock();
+
+    target_region->free_space((void*)address);
+
+    lock.unlock();
+    restore_interrupts(flags);
 }
 
 bool sub_mem_manager::try_sub_free(uintptr_t address) {
-    // Check rough bounds
-    if (address >= earliest_address && address <= latest_address) {
-        // Check with each region
-        sub_mem_region* current_region = &first_region;
-        while (1) {
-            if (address >= (uintptr_t)current_region
-                && address <= ((uintptr_t)current_region + PAGE_SIZE)) {
-                current_region->free_space((void*)address);
-                return true;
-            }
+    if (!owns_first_region(address)) { return false; }
+
+    sub_free(address);
+    return true;
+}
+
+// Magazines are only used once every core has its own set, before that all
+//  requests go straight to the depots
+static inline slab_cache* local_slab_cache() {
+    if (!initialized) return nullptr;
+    return current_thread()->slab_caches;
+}
+
+void slab_allocator::initialize(uintptr_t window_start) {
+    start = window_start;
+    end   = window_start + SLAB_WINDOW_SIZE;
+
+    for (unsigned int i = 0; i < SLAB_NUM_CLASSES; i++) {
+        new (&depots[i]) slab_depot();
+        depots[i].object_size = (SLAB_MIN_SIZE << i);
+        depots[i].next_page   = start + (SLAB_CLASS_WINDOW * i);
+        depots[i].window_end  = depots[i].next_page + SLAB_CLASS_WINDOW;
+    }
+}
+
+void* slab_allocator::slab_alloc(size_t size) {
+    unsigned int size_class = get_class(size);
+    slab_cache*  cache      = local_slab_cache();
+    mem_stats::count_slab(size_class);
+
+    if (cache == nullptr) { return depot_take(size_class); }
+
+    uint64_t       flags    = save_and_disable_interrupts();
+    slab_magazine& magazine = cache->magazines[size_class];
+
+    if (magazine.count == 0) { refill(magazine, size_class); }
+
+    void* returned_address = nullptr;
+    if (magazine.count != 0) {
+        returned_address = magazine.objects[--magazine.count];
+    }
+
+    restore_interrupts(flags);
+    return returned_address;
+}
+
+void* slab_allocator::slab_aligned_alloc(size_t size, size_t alignment) {
+    // Objects are naturally aligned to their (power-of-two) size, so bumping
+    //  the size up to the alignment is enough
+    if (alignment > size) { size = alignment; }
+    return slab_alloc(size);
+}
 
-            if ((uintptr_t)current_region->next_region)
-                current_region = current_region->next_region;
-            else
-                return false;
+void slab_allocator::slab_free(uintptr_t address) {
+    unsigned int size_class = (address - start) / SLAB_CLASS_WINDOW;
+    slab_cache*  cache      = local_slab_cache();
+    mem_stats::count(mem_stats::slab_free);
+
+    if (cache == nullptr) {
+        slab_object* object = (slab_object*)address;
+        depot_return(size_class, object, object, 1);
+        return;
+    }
+
+    uint64_t       flags    = save_and_disable_interrupts();
+    slab_magazine& magazine = cache->magazines[size_class];
+
+    if (magazine.count == SLAB_MAGAZINE_SIZE) { flush(magazine, size_class); }
+    magazine.objects[magazine.count++] = (void*)address;
+
+    restore_interrupts(flags);
+}
+
+void* slab_allocator::depot_take(unsigned int size_class) {
+    slab_depot& depot = depots[size_class];
+
+    while (1) {
+        uint64_t flags = save_and_disable_interrupts();
+        depot.lock.lock();
+
+        slab_object* object = depot.free_list;
+        if (object != nullptr) {
+            depot.free_list = object->next;
+            depot.free_count--;
         }
-    } else {
-        return false;
+
+        depot.lock.unlock();
+        restore_interrupts(flags);
+
+        if (object != nullptr) return (void*)object;
+        if (!grow(size_class)) return nullptr;
     }
-}
\ No newline at end of file
+}
+
+void slab_allocator::depot_return(unsigned int size_class, slab_object* first,
+                                  slab_object* last, size_t count) {
+    slab_depot& depot = depots[size_class];
+
+    uint64_t flags = save_and_disable_interrupts();
+    depot.lock.lock();
+
+    last->next      = depot.free_list;
+    depot.free_list = first;
+    depot.free_count += count;
+
+    depot.lock.unlock();
+    restore_interrupts(flags);
+}
+
+void slab_allocator::refill(slab_magazine& magazine, unsigned int size_class) {
+    slab_depot& depot = depots[size_class];
+    mem_stats::count(mem_stats::slab_refill);
+
+    // Growing the depot can end up allocating from this same magazine, so
+    //  the count has to be re-read after every attempt
+    while (magazine.count == 0) {
+        depot.lock.lock();
+        while (magazine.count < (SLAB_MAGAZINE_SIZE / 2)
+               && depot.free_list != nullptr) {
+            magazine.objects[magazine.count++] = (void*)depot.free_list;
+            depot.free_list                    = depot.free_list->next;
+            depot.free_count--;
+        }
+        depot.lock.unlock();
+
+        if (magazine.count == 0 && !grow(size_class)) return;
+    }
+}
+
+void slab_allocator::flush(slab_magazine& magazine, unsigned int size_class) {
+    mem_stats::count(mem_stats::slab_flush);
+
+    // Link the older half of the magazine together, then hand it over
+    unsigned int flushed = SLAB_MAGAZINE_SIZE / 2;
+    for (unsigned int i = 0; i < (flushed - 1); i++) {
+        ((slab_object*)magazine.objects[i])->next
+            = (slab_object*)magazine.objects[i + 1];
+    }
+
+    depot_return(size_class, (slab_object*)magazine.objects[0],
+                 (slab_object*)magazine.objects[flushed - 1], flushed);
+
+    // Move the rest down
+    for (unsigned int i = flushed; i < magazine.count; i++) {
+        magazine.objects[i - flushed] = magazine.objects[i];
+    }
+    magazine.count -= flushed;
+}
+
+bool slab_allocator::grow(unsigned int size_class) {
+    slab_depot& depot = depots[size_class];
+
+    // Claim the next page of this class's window
+    uintptr_t target_page
+        = __atomic_fetch_add(&depot.next_page, PAGE_SIZE, __ATOMIC_RELAXED);
+    if (target_page >= depot.window_end) { return false; }
+
+    uintptr_t p_address = palloc();
+    if (p_address == 0) { return false; }
+    paging::kernel_address_space.map_page_to(p_address, target_page);
+
+    paging::page_descriptor* info
+        = paging::page_info.claim(target_page, paging::page_slab);
+    info->size_class = size_class;
+
+    // Split the page into objects, and link them together
+    size_t       object_size = depot.object_size;
+    size_t       count       = PAGE_SIZE / object_size;
+    slab_object* first       = (slab_object*)target_page;
+    slab_object* current     = first;
+    for (size_t i = 1; i < count; i++) {
+        current->next = (slab_object*)((uintptr_t)current + object_size);
+        current       = current->next;
+    }
+
+    depot_return(size_class, first, current, count);
+    return true;
+}
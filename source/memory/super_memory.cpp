@@ -10,329 +10,323 @@
 #include "super_memory.h"
 
 #include "addressing.h"
-#include "allocation_manager.h"
+#include "chunking.h"
 #include "libk/misc.h"
+#include "mem_stats.h"
+#include "page_info.h"
+#include "system/init.h"
 #include "threading/threading.h"
 
-allocation_entry* chunk_alloc(size_t size) {
-    unsigned int required_chunks = chunking::get_num_chunks(size, true);
-
-    size_t added_size = (sizeof(chunking::chunk) * required_chunks)
-                        + sizeof(allocation_entry);
-    size += added_size;
-
-    chunking::chunk* chunk_location
-        = (chunking::chunk*)paging::kernel_address_space.get_new_address(size);
-    allocation_entry* entry
-        = (allocation_entry*)((uintptr_t)chunk_location
-                              + (sizeof(chunking::chunk) * required_chunks));
-    void* mapped_location
-        = (void*)((uintptr_t)entry + sizeof(allocation_entry));
-    void* next_to_map = chunk_location;
-
-    chunking::chunk_pile* current_piles = current_thread()->memory_piles;
-
-    // Get all the required chunks
-    uint64_t current_size = PAGE_SIZE << ((chunking::NUM_MEMORY_PILES - 1) * 4);
-    unsigned int current_index     = (chunking::NUM_MEMORY_PILES - 1);
-    unsigned int saved_chunk_index = 0;
-
-    chunking::chunk temp_buffer[0x10];
-    while (current_size >= PAGE_SIZE) {
-
-        unsigned int num_chunks = size / current_size;
-        size %= current_size;
-
-        if (!current_index && size) {
-            num_chunks++;
-            size = 0;
+// Every chunk is naturally aligned in memory, so lining the range up with
+//  its largest chunk lets that be mapped with 2 MiB or 1 GiB pages
+static size_t mapping_alignment(size_t size, size_t alignment) {
+    size_t largest_chunk = get_chunk_size(chunking::NUM_MEMORY_PILES - 1);
+    while (largest_chunk > size) { largest_chunk >>= 4; }
+    if (largest_chunk >= paging::page_directory_size) {
+        if (alignment < paging::page_directory_size) {
+            alignment = paging::page_directory_size;
         }
-
-        if (num_chunks > 0) {
-            // Get the needed chunks of this size
-            current_piles[current_index].get_chunks(num_chunks, temp_buffer);
-
-            // Save them in memory
-            for (unsigned int i = 0; i < num_chunks; i++) {
-                next_to_map = temp_buffer[i].map_to(next_to_map);
-                chunk_location[saved_chunk_index] = temp_buffer[i];
-                saved_chunk_index++;
-            }
+    } else if (largest_chunk >= paging::page_table_size) {
+        if (alignment < paging::page_table_size) {
+            alignment = paging::page_table_size;
         }
-
-        if (size == 0) { break; }
-
-        current_size >>= 4;
-        current_index--;
     }
 
-    entry->value.address    = (uintptr_t)mapped_location;
-    entry->value.chunks     = chunk_location;
-    entry->value.num_chunks = required_chunks;
-
-    return entry;
+    return alignment;
 }
 
-allocation_entry* aligned_chunk_alloc(size_t size, size_t alignment) {
-    unsigned int required_chunks = chunking::get_num_chunks(size, true);
-
-    size_t added_size = (sizeof(chunking::chunk) * required_chunks)
-                        + sizeof(allocation_entry);
-    added_size = std_k::round_up_multiple(added_size, alignment);
-    size += added_size;
-
-    chunking::chunk* chunk_location
-        = (chunking::chunk*)paging::kernel_address_space.get_new_address(size);
-    allocation_entry* entry
-        = (allocation_entry*)((uintptr_t)chunk_location
-                              + (sizeof(chunking::chunk) * required_chunks));
-    void* mapped_location = (void*)((uintptr_t)chunk_location + added_size);
-    void* next_to_map     = chunk_location;
-
-    chunking::chunk_pile* current_piles = current_thread()->memory_piles;
-
-    // Get all the required chunks
-    uint64_t current_size = PAGE_SIZE << ((chunking::NUM_MEMORY_PILES - 1) * 4);
-    unsigned int current_index     = (chunking::NUM_MEMORY_PILES - 1);
-    unsigned int saved_chunk_index = 0;
+/**
+ * @brief Takes the chunks making up a size, largest first
+ *
+ * @param size                  Bytes needed, a multiple of the page size
+ * @param current_piles         Piles to take from, or nullptr to go straight
+ *                              to the reservoirs
+ * @param chunk_list            Filled with the chunks, if not nullptr
+ * @return chunking::chunk      The last chunk taken
+ */
+static chunking::chunk gather_chunks(size_t size,
+                                     chunking::chunk_pile* current_piles,
+                                     chunking::chunk*      chunk_list) {
+    uint64_t current_size = get_chunk_size(chunking::NUM_MEMORY_PILES - 1);
+    unsigned int    current_index     = (chunking::NUM_MEMORY_PILES - 1);
+    unsigned int    saved_chunk_index = 0;
+    chunking::chunk last_chunk;
 
     chunking::chunk temp_buffer[0x10];
-    while (current_size >= PAGE_SIZE) {
+    while (size) {
 
         unsigned int num_chunks = size / current_size;
         size %= current_size;
 
-        if (!current_index && size) {
-            num_chunks++;
-            size = 0;
-        }
-
         if (num_chunks > 0) {
             // Get the needed chunks of this size
-            current_piles[current_index].get_chunks(num_chunks, temp_buffer);
+            if (current_piles != nullptr) {
+                current_piles[current_index].get_chunks(num_chunks,
+                                                        temp_buffer);
+            } else {
+                // Requests not made through the piles come from the first
+                //  domain
+                chunking::memory_reservoirs[0][current_index].get_chunks(
+                    num_chunks, temp_buffer);
+            }
 
-            // Save them in memory
+            // Save the chunks
             for (unsigned int i = 0; i < num_chunks; i++) {
-                next_to_map = temp_buffer[i].map_to(next_to_map);
-                chunk_location[saved_chunk_index] = temp_buffer[i];
+                last_chunk = temp_buffer[i];
+
+                if (chunk_list != nullptr) {
+                    chunk_list[saved_chunk_index] = temp_buffer[i];
+                }
                 saved_chunk_index++;
             }
         }
 
-        if (size == 0) { break; }
-
         current_size >>= 4;
         current_index--;
     }
 
-    entry->value.address    = (uintptr_t)mapped_location;
-    entry->value.chunks     = chunk_location;
-    entry->value.num_chunks = required_chunks;
-
-    return entry;
+    return last_chunk;
 }
 
-allocation_entry* bootstrap_chunk_alloc(size_t size) {
-    unsigned int required_chunks = chunking::get_num_chunks(size, true);
+// Bytes mapped for a chunk allocation
+static size_t mapped_size(paging::page_descriptor* info) {
+    if (info->num_chunks == 1) { return get_chunk_size(info->size_class); }
 
-    size_t added_size = (sizeof(chunking::chunk) * required_chunks)
-                        + sizeof(allocation_entry);
-    size += added_size;
-
-    chunking::chunk* chunk_location
-        = (chunking::chunk*)paging::kernel_address_space.get_new_address(size);
-    allocation_entry* entry
-        = (allocation_entry*)((uintptr_t)chunk_location
-                              + (sizeof(chunking::chunk) * required_chunks));
-    void* mapped_location
-        = (void*)((uintptr_t)entry + sizeof(allocation_entry));
-    void* next_to_map = chunk_location;
-
-    // Get all the required chunks
-    uint64_t current_size = PAGE_SIZE << ((chunking::NUM_MEMORY_PILES - 1) * 4);
-    unsigned int current_index     = (chunking::NUM_MEMORY_PILES - 1);
-    unsigned int saved_chunk_index = 0;
-
-    chunking::chunk temp_buffer[0x10];
-    while (current_size >= PAGE_SIZE) {
+    size_t total = 0;
+    for (unsigned int i = 0; i < info->num_chunks; i++) {
+        total += info->chunks[i].size;
+    }
+    return total;
+}
 
-        unsigned int num_chunks = size / current_size;
-        size %= current_size;
+/**
+ * @brief Builds an allocation out of chunks, mapped to a new range of
+ *          addresses, and records it in that range's page descriptor
+ *
+ * @param size                  Bytes needed
+ * @param alignment             Needed alignment of the returned address
+ * @param from_piles            Take chunks from the current thread's piles,
+ *                              rather than straight from the reservoirs
+ * @return void*                Start of the new allocation
+ */
+static void* allocate_chunks(size_t size, size_t alignment, bool from_piles) {
+    size = std_k::round_up_multiple(size, PAGE_SIZE);
+    unsigned int required_chunks = chunking::get_num_chunks(size);
+
+    // Only allocations made of more than one chunk need a separate list
+    chunking::chunk* chunk_list = nullptr;
+    if (required_chunks > 1) {
+        chunk_list = (chunking::chunk*)malloc(sizeof(chunking::chunk)
+                                              * required_chunks);
+    }
 
-        if (!current_index && size) {
-            num_chunks++;
-            size = 0;
-        }
+    uintptr_t mapped_location
+        = (uintptr_t)paging::kernel_address_space.get_new_address(
+            size, mapping_alignment(size, alignment));
+    if (mapped_location == 0) {
+        if (chunk_list != nullptr) { free(chunk_list); }
+        return nullptr;
+    }
 
-        if (num_chunks > 0) {
-            // Get the needed chunks of this size
-            chunking::memory_reservoirs[current_index].get_chunks(num_chunks,
-                                                                  temp_buffer);
+    chunking::chunk_pile* current_piles
+        = from_piles ? current_thread()->memory_piles : nullptr;
 
-            // Map the chunks and save them in memory
-            for (unsigned int i = 0; i < num_chunks; i++) {
-                next_to_map = temp_buffer[i].map_to(next_to_map);
-                chunk_location[saved_chunk_index] = temp_buffer[i];
-                saved_chunk_index++;
+    // Get all the required chunks
+    chunking::chunk last_chunk = gather_chunks(size, current_piles, chunk_list);
+
+    // Map them all in one go, so the tables are only locked and flushed once
+    {
+        paging::mapping_transaction<paging::kernel_only_address_space> mapping(
+            paging::kernel_address_space);
+
+        if (chunk_list != nullptr) {
+            uintptr_t next_to_map = mapped_location;
+            for (unsigned int i = 0; i < required_chunks; i++) {
+                mapping.map_region(chunk_list[i].p_start, next_to_map,
+                                   chunk_list[i].size);
+                next_to_map += chunk_list[i].size;
             }
+        } else {
+            mapping.map_region(last_chunk.p_start, mapped_location,
+                               last_chunk.size);
         }
+    }
 
-        if (size == 0) { break; }
-
-        current_size >>= 4;
-        current_index--;
+    // Record the allocation against its first page
+    mem_stats::count(mem_stats::chunk_alloc);
+    paging::page_descriptor* info
+        = paging::page_info.claim(mapped_location, paging::page_chunk);
+    info->num_chunks = required_chunks;
+    if (chunk_list != nullptr) {
+        info->chunks = chunk_list;
+    } else {
+        info->size_class = chunking::get_chunk_index(last_chunk.size);
+        info->p_start    = last_chunk.p_start;
     }
 
-    entry->value.address    = (uintptr_t)mapped_location;
-    entry->value.chunks     = chunk_location;
-    entry->value.num_chunks = required_chunks;
+    return (void*)mapped_location;
+}
 
-    // Make a new allocation entry
-    return entry;
+void* chunk_alloc(size_t size) {
+    return allocate_chunks(size, PAGE_SIZE, true);
 }
 
-allocation_entry* bootstrap_aligned_chunk_alloc(size_t size, size_t alignment) {
-    unsigned int required_chunks = chunking::get_num_chunks(size, true);
+void* aligned_chunk_alloc(size_t size, size_t alignment) {
+    return allocate_chunks(size, alignment, true);
+}
 
-    size_t added_size = (sizeof(chunking::chunk) * required_chunks)
-                        + sizeof(allocation_entry);
-    added_size = std_k::round_up_multiple(added_size, alignment);
-    size += added_size;
+void* bootstrap_chunk_alloc(size_t size) {
+    return allocate_chunks(size, PAGE_SIZE, false);
+}
 
-    chunking::chunk* chunk_location
-        = (chunking::chunk*)paging::kernel_address_space.get_new_address(size);
-    allocation_entry* entry
-        = (allocation_entry*)((uintptr_t)chunk_location
-                              + (sizeof(chunking::chunk) * required_chunks));
-    void* mapped_location = (void*)((uintptr_t)chunk_location + added_size);
-    void* next_to_map     = chunk_location;
+void* bootstrap_aligned_chunk_alloc(size_t size, size_t alignment) {
+    return allocate_chunks(size, alignment, false);
+}
 
-    // Get all the required chunks
-    uint64_t current_size = PAGE_SIZE << ((chunking::NUM_MEMORY_PILES - 1) * 4);
-    unsigned int current_index     = (chunking::NUM_MEMORY_PILES - 1);
-    unsigned int saved_chunk_index = 0;
+static void return_chunk(chunking::chunk returned_chunk) {
+    int target_index = chunking::get_chunk_index(returned_chunk.size);
 
-    chunking::chunk temp_buffer[0x10];
-    while (current_size >= PAGE_SIZE) {
+    // Keep the chunk on this core if possible
+    if (initialized) {
+        current_thread()->memory_piles[target_index].return_chunk(
+            returned_chunk);
+        return;
+    }
 
-        unsigned int num_chunks = size / current_size;
-        size %= current_size;
+    unsigned int domain = topology.get_domain(returned_chunk.p_start);
+    chunking::memory_reservoirs[domain][target_index].add_chunk(
+        returned_chunk);
+}
 
-        if (!current_index && size) {
-            num_chunks++;
-            size = 0;
-        }
+void chunk_free(uintptr_t address) {
+    paging::page_descriptor* info = paging::page_info.get(address);
+    if (info == nullptr || info->owner != paging::page_chunk) { return; }
+
+    // Drop the mapping on every core before the memory or its addresses can
+    //  be handed back out
+    size_t size = mapped_size(info);
+    {
+        paging::mapping_transaction<paging::kernel_only_address_space> mapping(
+            paging::kernel_address_space);
+        mapping.unmap_region(address, size);
+    }
 
-        if (num_chunks > 0) {
-            // Get the needed chunks of this size
-            chunking::memory_reservoirs[current_index].get_chunks(num_chunks,
-                                                                  temp_buffer);
+    // No core can reach the range anymore, so it can be reused
+    paging::kernel_address_space.release_address((void*)address, size);
 
-            // Map the chunks and save them in memory
-            for (unsigned int i = 0; i < num_chunks; i++) {
-                next_to_map = temp_buffer[i].map_to(next_to_map);
-                chunk_location[saved_chunk_index] = temp_buffer[i];
-                saved_chunk_index++;
-            }
+    if (info->num_chunks == 1) {
+        return_chunk(chunking::chunk(get_chunk_size(info->size_class),
+                                     info->p_start));
+    } else {
+        for (unsigned int i = 0; i < info->num_chunks; i++) {
+            return_chunk(info->chunks[i]);
         }
-
-        if (size == 0) { break; }
-
-        current_size >>= 4;
-        current_index--;
+        free(info->chunks);
     }
 
-    entry->value.address    = (uintptr_t)mapped_location;
-    entry->value.chunks     = chunk_location;
-    entry->value.num_chunks = required_chunks;
-
-    // Make a new allocation entry
-    return entry;
+    info->owner = paging::page_unused;
+    mem_stats::count(mem_stats::chunk_free);
 }
 
-allocation_entry* override_chunk_alloc(size_t size, int lock_override_index) {
-    unsigned int required_chunks = chunking::get_num_chunks(size, true);
-
-    size_t added_size = (sizeof(chunking::chunk) * required_chunks)
-                        + sizeof(allocation_entry);
-    size += added_size;
-
-    chunking::chunk* chunk_location
-        = (chunking::chunk*)paging::kernel_address_space.get_new_address(size);
-    allocation_entry* entry
-        = (allocation_entry*)((uintptr_t)chunk_location
-                              + (sizeof(chunking::chunk) * required_chunks));
-    void* mapped_location
-        = (void*)((uintptr_t)entry + sizeof(allocation_entry));
-    void* next_to_map = chunk_location;
-
-    // Get all the required chunks
-    uint64_t current_size = PAGE_SIZE << ((chunking::NUM_MEMORY_PILES - 1) * 4);
-    unsigned int current_index     = (chunking::NUM_MEMORY_PILES - 1);
-    unsigned int saved_chunk_index = 0;
-
-    chunking::chunk temp_buffer[0x10];
-    while (current_size >= PAGE_SIZE) {
+size_t chunk_allocation_size(uintptr_t address) {
+    paging::page_descriptor* info = paging::page_info.get(address);
+    if (info == nullptr || info->owner != paging::page_chunk) { return 0; }
+    return mapped_size(info);
+}
 
-        unsigned int num_chunks = size / current_size;
-        size %= current_size;
+/**
+ * @brief Grows a chunk allocation by adding chunks to it, so nothing in it
+ *          is ever copied. The new chunks go straight after the allocation
+ *          when those addresses are free, otherwise every chunk is mapped
+ *          again to a new range large enough for all of them
+ *
+ * @param address               Start of the allocation
+ * @param new_size              Bytes needed
+ * @param from_piles            Take chunks from the current thread's piles,
+ *                              rather than straight from the reservoirs
+ * @return void*                Start of the grown allocation, or nullptr if
+ *                              it couldn't be grown, leaving it untouched
+ */
+static void* grow_chunks(uintptr_t address, size_t new_size, bool from_piles) {
+    paging::page_descriptor* info = paging::page_info.get(address);
+    if (info == nullptr || info->owner != paging::page_chunk) {
+        return nullptr;
+    }
 
-        if (!current_index && size) {
-            num_chunks++;
-            size = 0;
+    new_size        = std_k::round_up_multiple(new_size, PAGE_SIZE);
+    size_t old_size = mapped_size(info);
+    if (new_size <= old_size) { return (void*)address; }
+
+    size_t       extra        = new_size - old_size;
+    unsigned int old_chunks   = info->num_chunks;
+    unsigned int total_chunks = old_chunks + chunking::get_num_chunks(extra);
+
+    chunking::chunk* chunk_list
+        = (chunking::chunk*)malloc(sizeof(chunking::chunk) * total_chunks);
+    if (chunk_list == nullptr) { return nullptr; }
+
+    // Addresses are settled before any chunks are taken, so there's nothing
+    //  to give back if neither works out
+    uintptr_t target = address;
+    if (!paging::kernel_address_space.claim_address(
+            (void*)(address + old_size), extra)) {
+        target = (uintptr_t)paging::kernel_address_space.get_new_address(
+            new_size, mapping_alignment(new_size, PAGE_SIZE));
+        if (target == 0) {
+            free(chunk_list);
+            return nullptr;
         }
+    }
 
-        if (num_chunks > 0) {
-            // Get the needed chunks of this size
-            chunking::memory_reservoirs[current_index].get_chunks(
-                num_chunks, temp_buffer,
-                ((int)current_index == lock_override_index) ? true : false);
-
-            // Map the chunks and save them in memory
-            for (unsigned int i = 0; i < num_chunks; i++) {
-                next_to_map = temp_buffer[i].lock_override_map_to(
-                    next_to_map, lock_override_index);
-                chunk_location[saved_chunk_index] = temp_buffer[i];
-                saved_chunk_index++;
-            }
+    chunking::chunk* old_list = nullptr;
+    if (old_chunks == 1) {
+        chunk_list[0]
+            = chunking::chunk(get_chunk_size(info->size_class), info->p_start);
+    } else {
+        old_list = info->chunks;
+        for (unsigned int i = 0; i < old_chunks; i++) {
+            chunk_list[i] = old_list[i];
         }
-
-        if (size == 0) { break; }
-
-        current_size >>= 4;
-        current_index--;
     }
 
-    entry->value.address    = (uintptr_t)mapped_location;
-    entry->value.chunks     = chunk_location;
-    entry->value.num_chunks = required_chunks;
-
-    // Make a new allocation entry
-    return entry;
-}
-
-void chunk_free(allocation_info returned_entry) {
-    chunking::chunk* returned_chunks = returned_entry.chunks;
-    unsigned int     num_chunks      = returned_entry.num_chunks;
+    gather_chunks(extra, from_piles ? current_thread()->memory_piles : nullptr,
+                  &chunk_list[old_chunks]);
+
+    {
+        paging::mapping_transaction<paging::kernel_only_address_space> mapping(
+            paging::kernel_address_space);
+
+        // Growing in place only needs the new chunks mapped
+        unsigned int first_chunk = (target == address) ? old_chunks : 0;
+        uintptr_t    next_to_map
+            = (target == address) ? (address + old_size) : target;
+        for (unsigned int i = first_chunk; i < total_chunks; i++) {
+            mapping.map_region(chunk_list[i].p_start, next_to_map,
+                               chunk_list[i].size);
+            next_to_map += chunk_list[i].size;
+        }
 
-    for (unsigned int i = 0; i < num_chunks; i++) {
-        chunking::chunk next_chunk = returned_chunks[i];
+        // The old range goes in the same flush
+        if (target != address) { mapping.unmap_region(address, old_size); }
+    }
 
-        chunking::memory_reservoirs[chunking::get_chunk_index(next_chunk.size)]
-            .add_chunk(next_chunk);
+    mem_stats::count((target == address) ? mem_stats::chunk_grow
+                                         : mem_stats::chunk_move);
+    if (target != address) {
+        paging::page_descriptor* new_info
+            = paging::page_info.claim(target, paging::page_chunk);
+        info->owner = paging::page_unused;
+        paging::kernel_address_space.release_address((void*)address, old_size);
+        info = new_info;
     }
-}
 
-void override_chunk_free(allocation_info returned_entry,
-                         int             lock_override_index) {
-    chunking::chunk* returned_chunks = returned_entry.chunks;
-    unsigned int     num_chunks      = returned_entry.num_chunks;
+    info->num_chunks = total_chunks;
+    info->chunks     = chunk_list;
+    if (old_list != nullptr) { free(old_list); }
 
-    for (unsigned int i = 0; i < num_chunks; i++) {
-        chunking::chunk next_chunk = returned_chunks[i];
-        int target_index           = chunking::get_chunk_index(next_chunk.size);
+    return (void*)target;
+}
 
-        chunking::memory_reservoirs[target_index].add_chunk(
-            next_chunk, (target_index == lock_override_index) ? true : false);
-    }
+void* chunk_realloc(uintptr_t address, size_t new_size) {
+    return grow_chunks(address, new_size, initialized);
 }
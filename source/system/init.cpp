@@ -19,7 +19,9 @@
 #include "libk/cstring.h"
 #include "libk/random.h"
 #include "memory/addressing.h"
+#include "memory/chunking.h"
 #include "memory/paging.h"
+#include "memory/shootdown.h"
 #include "memory/x86_tables.h"
 #include "multiboot.h"
 #include "pintos_std.h"
@@ -146,6 +148,7 @@ void late_init(multiboot_boot_info* mb_info) {
     detect_topology(
         (acpi::madt_table*)acpi::get_table(rsdp, acpi::table_signature::MADT),
         (acpi::srat_table*)acpi::get_table(rsdp, acpi::table_signature::SRAT));
+    chunking::distribute_domains();
 
     // Start system timer
     hpet* system_hpet = new hpet(
@@ -168,15 +171,13 @@ void late_init(multiboot_boot_info* mb_info) {
 
     // Setup local apic
     new (&thread->local_apic) apic<true, false>();
+    paging::tlb_online();
 
     // Find this core's scheduler
     threading::thread_scheduler* scheduler = thread->scheduler;
 
     if (scheduler == nullptr) { asm volatile("cli\n\t hlt"); }
 
-    // Setup the scheduler
-    scheduler = new (scheduler) threading::thread_scheduler(current_thread());
-
     // Initialization process is finished
     initialized = true;
 
@@ -0,0 +1,474 @@
+/**
+ * @file alloc_bench.cpp
+ * @author Shane Menzies
+ * @brief Allocator benchmark run across every logical core
+ * @date 10/17/26
+ *
+ *
+ */
+
+#include "commands.h"
+
+#include "io/io.h"
+#include "libk/asm.h"
+#include "libk/cstring.h"
+#include "libk/misc.h"
+#include "system/kernel.h"
+#include "terminal.h"
+#include "threading/process_def.h"
+#include "threading/threading.h"
+
+namespace kernel {
+
+#define BENCH_DEFAULT_OPS      100000
+#define BENCH_DEFAULT_MIN_SIZE 16
+#define BENCH_DEFAULT_MAX_SIZE 4096
+#define BENCH_HIST_SUB_BITS    3
+#define BENCH_HIST_BUCKETS     (64 << BENCH_HIST_SUB_BITS)
+#define BENCH_RING_SIZE        256
+#define BENCH_LIVE_SLOTS       512
+
+enum bench_pattern {
+    bench_pairs, // Each allocation freed straight away
+    bench_cross, // Allocations handed to the next core to be freed there
+    bench_mix,   // Random replacement of a set of live allocations
+};
+const char* const pattern_names[] = {"pairs", "cross", "mix"};
+
+enum bench_sizes {
+    sizes_fixed,   // Always the minimum size
+    sizes_uniform, // Evenly spread between the minimum and maximum
+    sizes_log,     // Evenly spread over the powers of two between them
+};
+const char* const size_names[] = {"fixed", "uniform", "log"};
+
+// Latencies in cycles, bucketed by power of two with each power split
+//  into eighths, so percentiles come out within an eighth of the truth
+struct latency_histogram {
+    uint32_t counts[BENCH_HIST_BUCKETS];
+    uint64_t total;
+
+    void clear() {
+        for (size_t i = 0; i < BENCH_HIST_BUCKETS; i++) { counts[i] = 0; }
+        total = 0;
+    }
+
+    static size_t bucket_for(uint64_t cycles) {
+        if (cycles < (1 << BENCH_HIST_SUB_BITS)) { return cycles; }
+
+        unsigned int top = 63 - __builtin_clzl(cycles);
+        unsigned int sub = (cycles >> (top - BENCH_HIST_SUB_BITS))
+                           & ((1 << BENCH_HIST_SUB_BITS) - 1);
+        return ((top - BENCH_HIST_SUB_BITS + 1) << BENCH_HIST_SUB_BITS) + sub;
+    }
+
+    // Largest latency that lands in the bucket
+    static uint64_t bucket_limit(size_t bucket) {
+        if (bucket < (1 << BENCH_HIST_SUB_BITS)) { return bucket; }
+
+        unsigned int shift = (bucket >> BENCH_HIST_SUB_BITS) - 1;
+        uint64_t     low   = ((1 << BENCH_HIST_SUB_BITS)
+                        + (bucket & ((1 << BENCH_HIST_SUB_BITS) - 1)))
+                       << shift;
+        return low + ((uint64_t)1 << shift) - 1;
+    }
+
+    inline void record(uint64_t cycles) {
+        counts[bucket_for(cycles)]++;
+        total++;
+    }
+
+    void merge(const latency_histogram& source) {
+        for (size_t i = 0; i < BENCH_HIST_BUCKETS; i++) {
+            counts[i] += source.counts[i];
+        }
+        total += source.total;
+    }
+
+    // Latency that parts out of every whole samples come in under
+    uint64_t percentile(uint64_t parts, uint64_t whole) const {
+        if (total == 0) { return 0; }
+
+        uint64_t rank = ((total * parts) + whole - 1) / whole;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < BENCH_HIST_BUCKETS; i++) {
+            seen += counts[i];
+            if (seen >= rank) { return bucket_limit(i); }
+        }
+        return bucket_limit(BENCH_HIST_BUCKETS - 1);
+    }
+};
+
+// Single producer, single consumer queue of allocations to be freed by
+//  another core
+struct handoff_ring {
+    void* slots[BENCH_RING_SIZE];
+
+    size_t head __attribute__((aligned(64)));
+    size_t tail __attribute__((aligned(64)));
+
+    void clear() {
+        head = 0;
+        tail = 0;
+    }
+
+    bool push(void* allocation) {
+        size_t current = __atomic_load_n(&head, __ATOMIC_RELAXED);
+        if ((current - __atomic_load_n(&tail, __ATOMIC_ACQUIRE))
+            == BENCH_RING_SIZE) {
+            return false;
+        }
+
+        slots[current % BENCH_RING_SIZE] = allocation;
+        __atomic_store_n(&head, current + 1, __ATOMIC_RELEASE);
+        return true;
+    }
+
+    void* pop() {
+        size_t current = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+        if (current == __atomic_load_n(&head, __ATOMIC_ACQUIRE)) {
+            return nullptr;
+        }
+
+        void* allocation = slots[current % BENCH_RING_SIZE];
+        __atomic_store_n(&tail, current + 1, __ATOMIC_RELEASE);
+        return allocation;
+    }
+};
+
+struct bench_run;
+
+struct bench_worker {
+    bench_run*   run;
+    unsigned int index;
+    uint64_t     rng;
+
+    uint64_t ops;
+    uint64_t start_tsc;
+    uint64_t end_tsc;
+    bool     producing;
+
+    latency_histogram alloc_latency;
+    latency_histogram free_latency;
+    handoff_ring      incoming;
+    void*             live[BENCH_LIVE_SLOTS];
+} __attribute__((aligned(64)));
+
+struct bench_run {
+    bench_pattern pattern;
+    bench_sizes   sizes;
+    size_t        min_size;
+    size_t        max_size;
+    uint64_t      ops_per_worker;
+    uint64_t      tsc_rate;
+
+    unsigned int  num_workers;
+    unsigned int  arrived;
+    unsigned int  finished;
+    bench_worker* workers;
+};
+
+// Polled, so results still get out with nothing listening for COM1
+static void serial_write(const char* string) {
+    for (size_t i = 0; string[i] != '\0'; i++) {
+        while (!(io_read_c(IO_ports::COM_1 + 5) & 0x20)) {
+            asm volatile("pause");
+        }
+        io_write_c(string[i], IO_ports::COM_1);
+    }
+}
+
+static uint64_t measure_tsc_rate() {
+    uint64_t period = sys_int_timer->convert_sec(0.01);
+    uint64_t start  = sys_int_timer->now();
+    uint64_t tsc    = read_tsc();
+    while ((sys_int_timer->now() - start) < period) { asm volatile("pause"); }
+    return (read_tsc() - tsc) * 100;
+}
+
+static inline uint64_t next_random(uint64_t& rng) {
+    rng ^= rng << 13;
+    rng ^= rng >> 7;
+    rng ^= rng << 17;
+    return rng;
+}
+
+static size_t pick_size(bench_run* run, uint64_t& rng) {
+    switch (run->sizes) {
+        case sizes_uniform:
+            return run->min_size
+                   + (next_random(rng) % (run->max_size - run->min_size + 1));
+        case sizes_log: {
+            unsigned int low  = 63 - __builtin_clzl(run->min_size);
+            unsigned int high = 63 - __builtin_clzl(run->max_size);
+            unsigned int power
+                = low + (unsigned int)(next_random(rng) % (high - low + 1));
+
+            size_t size = ((size_t)1 << power)
+                          + (next_random(rng) % ((size_t)1 << power));
+            if (size < run->min_size) { size = run->min_size; }
+            if (size > run->max_size) { size = run->max_size; }
+            return size;
+        }
+        default:
+            return run->min_size;
+    }
+}
+
+// Touched after timing, so the memory is really in use without page
+//  faults being counted against the allocator
+static void* timed_alloc(bench_worker* worker) {
+    size_t   size       = pick_size(worker->run, worker->rng);
+    uint64_t start      = read_tsc();
+    void*    allocation = malloc(size);
+    worker->alloc_latency.record(read_tsc() - start);
+
+    if (allocation != nullptr) { *(volatile char*)allocation = 1; }
+    return allocation;
+}
+
+static void timed_free(bench_worker* worker, void* allocation) {
+    uint64_t start = read_tsc();
+    free(allocation);
+    worker->free_latency.record(read_tsc() - start);
+}
+
+static void drain_incoming(bench_worker* worker) {
+    void* allocation;
+    while ((allocation = worker->incoming.pop()) != nullptr) {
+        timed_free(worker, allocation);
+    }
+}
+
+static void run_pairs(bench_worker* worker) {
+    for (uint64_t i = 0; i < worker->run->ops_per_worker; i++) {
+        void* allocation = timed_alloc(worker);
+        if (allocation != nullptr) { timed_free(worker, allocation); }
+    }
+    worker->ops = worker->run->ops_per_worker;
+}
+
+static void run_cross(bench_worker* worker) {
+    bench_run*    run  = worker->run;
+    bench_worker* next = &run->workers[(worker->index + 1) % run->num_workers];
+    bench_worker* previous
+        = &run->workers[(worker->index + run->num_workers - 1)
+                        % run->num_workers];
+
+    for (uint64_t i = 0; i < run->ops_per_worker; i++) {
+        void* allocation = timed_alloc(worker);
+        if (allocation == nullptr) { continue; }
+
+        // Freeing what's come in keeps a full ring from stalling the core
+        //  that should be emptying it
+        while (!next->incoming.push(allocation)) { drain_incoming(worker); }
+        if ((i % (BENCH_RING_SIZE / 4)) == 0) { drain_incoming(worker); }
+    }
+    __atomic_store_n(&worker->producing, false, __ATOMIC_RELEASE);
+
+    while (__atomic_load_n(&previous->producing, __ATOMIC_ACQUIRE)) {
+        drain_incoming(worker);
+    }
+    drain_incoming(worker);
+    worker->ops = run->ops_per_worker;
+}
+
+static void run_mix(bench_worker* worker) {
+    for (size_t i = 0; i < BENCH_LIVE_SLOTS; i++) { worker->live[i] = nullptr; }
+
+    // Replacing a random slot each time leaves allocations of every age and
+    //  size mixed together
+    for (uint64_t i = 0; i < worker->run->ops_per_worker; i++) {
+        size_t slot = next_random(worker->rng) % BENCH_LIVE_SLOTS;
+        if (worker->live[slot] != nullptr) {
+            timed_free(worker, worker->live[slot]);
+        }
+        worker->live[slot] = timed_alloc(worker);
+    }
+
+    for (size_t i = 0; i < BENCH_LIVE_SLOTS; i++) {
+        if (worker->live[i] != nullptr) { timed_free(worker, worker->live[i]); }
+    }
+    worker->ops = worker->run->ops_per_worker;
+}
+
+static void report_line(const char* label, uint64_t ops, uint64_t cycles,
+                        uint64_t tsc_rate, const latency_histogram& allocs,
+                        const latency_histogram& frees) {
+    char buffer[256];
+    std_k::sprintf(
+        buffer,
+        "alloc_bench,%s,%u,%u,%u,%u,%u,%u,%u,%u\n", label,
+        (unsigned int)ops,
+        (unsigned int)(cycles ? ((ops * tsc_rate) / cycles) : 0),
+        (unsigned int)allocs.percentile(50, 100),
+        (unsigned int)allocs.percentile(99, 100),
+        (unsigned int)allocs.percentile(999, 1000),
+        (unsigned int)frees.percentile(50, 100),
+        (unsigned int)frees.percentile(99, 100),
+        (unsigned int)frees.percentile(999, 1000));
+    serial_write(buffer);
+}
+
+// Lines are comma separated, with latencies in TSC cycles, so they can be
+//  picked out of the rest of the serial log and compared between runs
+static void report(bench_run* run) {
+    char buffer[256];
+    std_k::sprintf(buffer, "alloc_bench,begin,%s,%s,%u,%u,%u,%u,%u\n",
+                   pattern_names[run->pattern], size_names[run->sizes],
+                   (unsigned int)run->min_size, (unsigned int)run->max_size,
+                   (unsigned int)run->ops_per_worker, run->num_workers,
+                   (unsigned int)(run->tsc_rate / 1000));
+    serial_write(buffer);
+    serial_write("alloc_bench,core,ops,ops_per_sec,alloc_p50,alloc_p99,"
+                 "alloc_p999,free_p50,free_p99,free_p999\n");
+
+    latency_histogram* allocs = new latency_histogram();
+    latency_histogram* frees  = new latency_histogram();
+    allocs->clear();
+    frees->clear();
+
+    uint64_t total_ops = 0;
+    uint64_t first     = ~(0UL);
+    uint64_t last      = 0;
+    for (unsigned int i = 0; i < run->num_workers; i++) {
+        bench_worker* worker = &run->workers[i];
+        char          label[16];
+        std_k::sprintf(label, "%u", i);
+        report_line(label, worker->ops, worker->end_tsc - worker->start_tsc,
+                    run->tsc_rate, worker->alloc_latency,
+                    worker->free_latency);
+
+        allocs->merge(worker->alloc_latency);
+        frees->merge(worker->free_latency);
+        total_ops += worker->ops;
+        if (worker->start_tsc < first) { first = worker->start_tsc; }
+        if (worker->end_tsc > last) { last = worker->end_tsc; }
+    }
+
+    report_line("all", total_ops, last - first, run->tsc_rate, *allocs,
+                *frees);
+    serial_write("alloc_bench,end\n");
+
+    active_terminal->tprintf(
+        "alloc_bench: %u ops, p50 alloc %u cycles, p99 alloc %u cycles\n",
+        (unsigned int)total_ops, (unsigned int)allocs->percentile(50, 100),
+        (unsigned int)allocs->percentile(99, 100));
+
+    delete allocs;
+    delete frees;
+}
+
+static void bench_main(bench_worker* worker) {
+    bench_run* run = worker->run;
+
+    // Everyone starts together, so the cores really do contend
+    __atomic_add_fetch(&run->arrived, 1, __ATOMIC_ACQ_REL);
+    while (__atomic_load_n(&run->arrived, __ATOMIC_ACQUIRE)
+           < run->num_workers) {
+        asm volatile("pause");
+    }
+
+    worker->start_tsc = read_tsc();
+    switch (run->pattern) {
+        case bench_cross:
+            run_cross(worker);
+            break;
+        case bench_mix:
+            run_mix(worker);
+            break;
+        default:
+            run_pairs(worker);
+            break;
+    }
+    worker->end_tsc = read_tsc();
+
+    // The last one out reports for everyone
+    if (__atomic_add_fetch(&run->finished, 1, __ATOMIC_ACQ_REL)
+        == run->num_workers) {
+        report(run);
+        delete[] run->workers;
+        delete run;
+    }
+}
+
+static bool parse_keyword(const char* argument, const char* const names[],
+                          unsigned int num_names, unsigned int& index) {
+    for (unsigned int i = 0; i < num_names; i++) {
+        if (std_k::strcmp(argument, names[i]) == 0) {
+            index = i;
+            return true;
+        }
+    }
+    return false;
+}
+
+namespace commands {
+
+// alloc_bench [pairs|cross|mix] [fixed|uniform|log] [min] [max] [ops]
+int alloc_bench(int argc, char* argv[]) {
+    unsigned int pattern = bench_pairs;
+    unsigned int sizes   = sizes_log;
+    if (argc > 1 && !parse_keyword(argv[1], pattern_names, 3, pattern)) {
+        active_terminal->tprintf("Unknown pattern: \"%s\".\n", argv[1]);
+        return 1;
+    }
+    if (argc > 2 && !parse_keyword(argv[2], size_names, 3, sizes)) {
+        active_terminal->tprintf("Unknown size distribution: \"%s\".\n",
+                                 argv[2]);
+        return 1;
+    }
+
+    bench_run* run      = new bench_run();
+    run->pattern        = (bench_pattern)pattern;
+    run->sizes          = (bench_sizes)sizes;
+    run->min_size       = (argc > 3) ? std_k::string_to_number(argv[3])
+                                     : BENCH_DEFAULT_MIN_SIZE;
+    run->max_size       = (argc > 4) ? std_k::string_to_number(argv[4])
+                                     : BENCH_DEFAULT_MAX_SIZE;
+    run->ops_per_worker = (argc > 5) ? std_k::string_to_number(argv[5])
+                                     : BENCH_DEFAULT_OPS;
+    if (run->min_size == 0) { run->min_size = 1; }
+    if (run->max_size < run->min_size) { run->max_size = run->min_size; }
+
+    // Workers free the run once they're done, so nothing in it is touched
+    //  here after they've been started
+    unsigned int num_workers = topology.num_logical;
+
+    run->tsc_rate    = measure_tsc_rate();
+    run->num_workers = num_workers;
+    run->arrived     = 0;
+    run->finished    = 0;
+    run->workers     = new bench_worker[run->num_workers];
+
+    for (unsigned int i = 0; i < run->num_workers; i++) {
+        bench_worker* worker = &run->workers[i];
+        worker->run          = run;
+        worker->index        = i;
+        worker->rng          = read_tsc() | 1;
+        worker->ops          = 0;
+        worker->producing    = true;
+        worker->alloc_latency.clear();
+        worker->free_latency.clear();
+        worker->incoming.clear();
+    }
+
+    // One worker is pinned to each core, so balancing can't stack two on
+    //  one core and the cross frees really do cross cores
+    bench_worker* workers = run->workers;
+    for (unsigned int i = 0; i < num_workers; i++) {
+        auto* task = new std_k::preset_function<void(bench_worker*)>(
+            bench_main, &workers[i]);
+        threading::process* worker = new threading::process(1, 1, task);
+        worker->affinity.clear();
+        worker->affinity.allow(i);
+        threading::system_scheduler.add_process(worker, i);
+    }
+
+    active_terminal->tprintf(
+        "alloc_bench: %u workers started, results on COM1.\n", num_workers);
+    return 0;
+}
+
+} // namespace commands
+} // namespace kernel
@@ -14,6 +14,8 @@
 #include "libk/misc.h"
 #include "libk/sorting.h"
 #include "memory/chunking.h"
+#include "memory/mem_stats.h"
+#include "system/kernel.h"
 #include "terminal.h"
 #include "threading/process_def.h"
 #include "threading/threading.h"
@@ -26,14 +28,16 @@ unsigned int    num_commands    = 0;
 unsigned int    max_commands    = 0;
 command_entry** command_entries = 0;
 
-constexpr unsigned int num_kernel_commands = 8;
+constexpr unsigned int num_kernel_commands = 11;
 const char*            kernel_command_identifiers[num_kernel_commands]
-    = {"echo",   "test",     "cpu_stat",  "test_alloc",
-       "branch", "mem_stat", "proc_stat", "scheduling"};
+    = {"echo",        "test",     "cpu_stat",  "test_alloc",
+       "branch",      "mem_stat", "proc_stat", "scheduling",
+       "alloc_bench", "mem_prof", "fork_test"};
 int (*kernel_command_pointers[num_kernel_commands])(int argc, char** argv)
-    = {commands::echo,       commands::test,      commands::cpu_stat,
-       commands::test_alloc, commands::branch,    commands::mem_stat,
-       commands::proc_stat,  commands::scheduling};
+    = {commands::echo,       commands::test,        commands::cpu_stat,
+       commands::test_alloc, commands::branch,      commands::mem_stat,
+       commands::proc_stat,  commands::scheduling,  commands::alloc_bench,
+       commands::mem_prof,   commands::fork_test};
 
 void cmd_init() {
 
@@ -263,30 +267,171 @@ int mem_stat(int argc, char* argv[]) {
     active_terminal->tprintf("\tPre-allocated by Processor:\n");
     for (unsigned int i = 0; i < topology.num_logical; i++) {
         // Total of all pre-allocated chunks
-        size_t current_total = 0;
+        size_t current_total  = 0;
+        size_t current_remote = 0;
         for (unsigned int j = 0; j < chunking::NUM_MEMORY_PILES; j++) {
             current_total += (topology.threads[i].memory_piles[j].chunk_size
                               * topology.threads[i].memory_piles[j].size());
+            current_remote
+                += topology.threads[i].memory_piles[j].remote_chunks;
         }
 
-        active_terminal->tprintf("\t\tThread #%u - 0x%x bytes\n", i,
-                                 current_total);
+        active_terminal->tprintf(
+            "\t\tThread #%u (Domain %u) - 0x%x bytes, %u remote chunks\n", i,
+            topology.threads[i].domain, current_total, current_remote);
         total += current_total;
     }
     active_terminal->tprintf("\t\tTotal Pre-allocated - 0x%x bytes\n\n", total);
 
     // Print reservoir contents
     size_t reservoir_total = 0;
-    for (unsigned int i = 0; i < chunking::NUM_MEMORY_PILES; i++) {
-        reservoir_total += (chunking::memory_reservoirs[i].chunk_size
-                            * chunking::memory_reservoirs[i].size());
+    for (unsigned int d = 0; d < topology.num_domains; d++) {
+        size_t domain_total = 0;
+        for (unsigned int i = 0; i < chunking::NUM_MEMORY_PILES; i++) {
+            domain_total += (chunking::memory_reservoirs[d][i].chunk_size
+                             * chunking::memory_reservoirs[d][i].size());
+        }
+
+        active_terminal->tprintf(
+            "\tAvailable in Domain %u Reservoirs - 0x%x bytes\n", d,
+            domain_total);
+        reservoir_total += domain_total;
     }
-    active_terminal->tprintf("\tAvailable in Reservoirs - 0x%x bytes\n",
-                             reservoir_total);
     total += reservoir_total;
 
     active_terminal->tprintf("Total Free: 0x%x bytes\n", total);
 
+    // Fragmentation, as the share of free memory in chunks too small to
+    //  serve a request of each size on their own
+    size_t size_totals[chunking::NUM_MEMORY_PILES];
+    for (unsigned int j = 0; j < chunking::NUM_MEMORY_PILES; j++) {
+        size_totals[j] = 0;
+        for (unsigned int d = 0; d < topology.num_domains; d++) {
+            size_totals[j] += chunking::memory_reservoirs[d][j].chunk_size
+                              * chunking::memory_reservoirs[d][j].size();
+        }
+        for (unsigned int i = 0; i < topology.num_logical; i++) {
+            size_totals[j] += (topology.threads[i].memory_piles[j].chunk_size
+                               * topology.threads[i].memory_piles[j].size());
+        }
+    }
+
+    active_terminal->tprintf("Fragmentation:\n");
+    size_t unusable = 0;
+    for (unsigned int j = 1; j < chunking::NUM_MEMORY_PILES; j++) {
+        unusable += size_totals[j - 1];
+        active_terminal->tprintf(
+            "\tUnusable for %u KiB chunks - %u%%\n",
+            (unsigned int)(chunking::memory_reservoirs[0][j].chunk_size
+                           / 1024),
+            (unsigned int)(total ? ((unusable * 100) / total) : 0));
+    }
+
+    return 0;
+}
+
+// Share of a total, as a whole percentage
+static unsigned int percent_of(uint64_t part, uint64_t total) {
+    return (unsigned int)(total ? ((part * 100) / total) : 0);
+}
+
+int mem_prof(int argc, char* argv[]) {
+
+    if (argc > 1 && std_k::strcmp(argv[1], "reset") == 0) {
+        mem_stats::reset();
+        active_terminal->tprintf("Allocator counters reset.\n");
+        return 0;
+    }
+
+    uint64_t ticks_per_sec = sys_int_timer->convert_sec(1.0);
+    uint64_t elapsed       = sys_int_timer->now() - mem_stats::window_start;
+    if (elapsed == 0) { elapsed = 1; }
+
+    mem_stats::core_counters* totals = new mem_stats::core_counters();
+    mem_stats::gather(*totals);
+
+    active_terminal->tprintf("Allocator Profile (%u ms window):\n",
+                             (unsigned int)((elapsed * 1000) / ticks_per_sec));
+
+    // Allocation rates by processor, including whatever ran before the
+    //  cores had counters of their own
+    active_terminal->tprintf("\tAllocations by Processor:\n");
+    for (unsigned int i = 0; i <= topology.num_logical; i++) {
+        mem_stats::core_counters* counters = &mem_stats::boot_counters;
+        if (i < topology.num_logical) {
+            if (!threading::threads_started) { continue; }
+            counters = topology.threads[i].mem_counters;
+        }
+
+        uint64_t allocs = counters->heap_events[mem_stats::slab_alloc]
+                          + counters->heap_events[mem_stats::sub_alloc]
+                          + counters->heap_events[mem_stats::chunk_alloc]
+                          + counters->heap_events[mem_stats::reservation];
+        uint64_t hits   = 0;
+        uint64_t misses = 0;
+        for (unsigned int j = 0; j < chunking::NUM_MEMORY_PILES; j++) {
+            hits += counters->chunk_events[mem_stats::pile_hit][j];
+            misses += counters->chunk_events[mem_stats::reservoir_fallback][j];
+        }
+
+        if (i < topology.num_logical) {
+            active_terminal->tprintf("\t\tThread #%u - ", i);
+        } else {
+            active_terminal->tprintf("\t\tBefore threads - ");
+        }
+        active_terminal->tprintf(
+            "%u allocs (%u/s), %u%% pile hits\n", (unsigned int)allocs,
+            (unsigned int)((allocs * ticks_per_sec) / elapsed),
+            percent_of(hits, hits + misses));
+    }
+
+    active_terminal->tprintf("\tChunks by Size:\n");
+    for (unsigned int j = 0; j < chunking::NUM_MEMORY_PILES; j++) {
+        uint64_t hits = totals->chunk_events[mem_stats::pile_hit][j];
+        uint64_t misses
+            = totals->chunk_events[mem_stats::reservoir_fallback][j];
+        active_terminal->tprintf(
+            "\t\t%u KiB - %u from pile (%u%%), %u from reservoir, %u remote, "
+            "%u refills, %u spills, %u splits, %u steals\n",
+            (unsigned int)(get_chunk_size(j) / 1024), (unsigned int)hits,
+            percent_of(hits, hits + misses), (unsigned int)misses,
+            (unsigned int)totals->chunk_events[mem_stats::remote_take][j],
+            (unsigned int)totals->chunk_events[mem_stats::pile_refill][j],
+            (unsigned int)totals->chunk_events[mem_stats::pile_spill][j],
+            (unsigned int)totals->chunk_events[mem_stats::reservoir_split][j],
+            (unsigned int)totals->chunk_events[mem_stats::reservoir_steal][j]);
+    }
+
+    uint64_t* heap = totals->heap_events;
+    active_terminal->tprintf("\tSlab Objects by Size:\n");
+    for (unsigned int i = 0; i < SLAB_NUM_CLASSES; i++) {
+        active_terminal->tprintf("\t\t%u bytes - %u allocs\n",
+                                 (unsigned int)(SLAB_MIN_SIZE << i),
+                                 (unsigned int)totals->slab_classes[i]);
+    }
+    active_terminal->tprintf(
+        "\t\t%u frees, %u depot refills, %u depot flushes\n",
+        (unsigned int)heap[mem_stats::slab_free],
+        (unsigned int)heap[mem_stats::slab_refill],
+        (unsigned int)heap[mem_stats::slab_flush]);
+
+    active_terminal->tprintf(
+        "\tSub-page: %u allocs, %u frees, %u new regions\n",
+        (unsigned int)heap[mem_stats::sub_alloc],
+        (unsigned int)heap[mem_stats::sub_free],
+        (unsigned int)heap[mem_stats::sub_region]);
+    active_terminal->tprintf(
+        "\tChunk allocations: %u allocs, %u frees, %u grown in place, "
+        "%u moved\n",
+        (unsigned int)heap[mem_stats::chunk_alloc],
+        (unsigned int)heap[mem_stats::chunk_free],
+        (unsigned int)heap[mem_stats::chunk_grow],
+        (unsigned int)heap[mem_stats::chunk_move]);
+    active_terminal->tprintf("\tReservations: %u made, %u pages faulted in\n",
+                             (unsigned int)heap[mem_stats::reservation],
+                             (unsigned int)heap[mem_stats::reservation_fault]);
+
+    delete totals;
     return 0;
 }
 
@@ -307,12 +452,21 @@ int proc_stat(int argc, char* argv[]) {
         }
     }
 
-    // Print scheduler run queue
+    // Print each processor's run queue
     active_terminal->tprintf("\nWaiting Processes:\n");
-    for (unsigned int i = 0; i < threading::system_scheduler.size(); i++) {
-        active_terminal->tprintf(
-            "\t#%u - pid %u\n", i,
-            threading::system_scheduler.run_queue.base[i]->pid);
+    unsigned int waiting_index = 0;
+    for (unsigned int i = 0; i < topology.num_logical; i++) {
+        threading::run_queues* queues
+            = &topology.threads[i].scheduler->run_queue;
+        for (unsigned int level = 0; level < threading::NUM_PRIORITIES;
+             level++) {
+            for (unsigned int j = 0; j < queues->levels[level].size(); j++) {
+                active_terminal->tprintf(
+                    "\t#%u - pid %u (Thread #%u, Level %u)\n",
+                    waiting_index++, queues->levels[level].base[j]->pid, i,
+                    level);
+            }
+        }
     }
 
     return 0;
@@ -339,6 +493,7 @@ int scheduling(int argc, char* argv[]) {
 
     } else if (std_k::strncmp(argv[1], "status", 6) == 0) {
         // More detailed information on the scheduler states
+        uint64_t ticks_per_sec = sys_int_timer->convert_sec(1.0);
 
         // Print thread states
         active_terminal->tprintf("Thread Schedulers:\n");
@@ -355,6 +510,43 @@ int scheduling(int argc, char* argv[]) {
                     current_thread->scheduler->current_task->pid);
             }
 
+            active_terminal->tprintf(
+                "\t\tRun Queue: %u waiting (Lock State: %s)\n",
+                current_thread->scheduler->queue_size(),
+                (current_thread->scheduler->queue_lock.is_locked() ? "True"
+                                                                   : "False"));
+
+            // How long what was run from each level had to wait for it
+            threading::run_queues* queues
+                = &current_thread->scheduler->run_queue;
+            for (unsigned int level = 0; level < threading::NUM_PRIORITIES;
+                 level++) {
+                uint64_t taken = queues->num_taken[level];
+                if (taken == 0 && queues->levels[level].empty()) { continue; }
+
+                uint64_t average = (taken == 0)
+                                       ? 0
+                                       : (queues->total_wait[level] / taken);
+                active_terminal->tprintf(
+                    "\t\t\tLevel %u: %u waiting, %u run, wait avg %u us, "
+                    "max %u us\n",
+                    level, (unsigned int)queues->levels[level].size(),
+                    (unsigned int)taken,
+                    (unsigned int)((average * 1000000) / ticks_per_sec),
+                    (unsigned int)((queues->max_wait[level] * 1000000)
+                                   / ticks_per_sec));
+            }
+
+            threading::thread_scheduler* scheduler = current_thread->scheduler;
+            active_terminal->tprintf(
+                "\t\tReal-time: %u%% reserved, %u ready, %u waiting, "
+                "%u overruns\n",
+                (unsigned int)((scheduler->realtime_load * 100)
+                               / threading::REALTIME_LOAD_ONE),
+                (unsigned int)scheduler->realtime_ready.get_vec().size(),
+                (unsigned int)scheduler->realtime_waiting.get_vec().size(),
+                (unsigned int)scheduler->realtime_overruns);
+
             active_terminal->tprintf(
                 "\t\tAPIC (id = %u):\n",
                 current_thread->scheduler->local_timer->id.id);
@@ -372,20 +564,27 @@ int scheduling(int argc, char* argv[]) {
                 current_thread->scheduler->local_timer->time_to_next());
         }
 
-        // Print system state
+        // Print system state, totalled across the per-core run queues
         active_terminal->tprintf("System Scheduler:\n");
-        active_terminal->tprintf("\tLock State: ");
-        active_terminal->tprintf((threading::system_scheduler.lock.is_locked()
-                                      ? "True\n"
-                                      : "False\n"));
         active_terminal->tprintf("\tPaused: ");
         active_terminal->tprintf(
             (threading::system_scheduler.paused ? "True\n" : "False\n"));
-        active_terminal->tprintf("\tWaiting Processes:\n");
-        for (unsigned int i = 0; i < threading::system_scheduler.size(); i++) {
-            active_terminal->tprintf(
-                "\t\t#%u - pid %u\n", i,
-                threading::system_scheduler.run_queue.base[i]->pid);
+        active_terminal->tprintf("\tWaiting Processes: %u\n",
+                                 threading::system_scheduler.size());
+        unsigned int waiting_index = 0;
+        for (unsigned int i = 0; i < topology.num_logical; i++) {
+            threading::run_queues* queues
+                = &topology.threads[i].scheduler->run_queue;
+            for (unsigned int level = 0; level < threading::NUM_PRIORITIES;
+                 level++) {
+                for (unsigned int j = 0; j < queues->levels[level].size();
+                     j++) {
+                    active_terminal->tprintf(
+                        "\t\t#%u - pid %u (Thread #%u, Level %u)\n",
+                        waiting_index++, queues->levels[level].base[j]->pid,
+                        i, level);
+                }
+            }
         }
 
         return 0;
@@ -395,5 +594,75 @@ int scheduling(int argc, char* argv[]) {
         return 1;
     }
 }
+
+// Passed between fork_test's two sides, through the kernel's heap
+struct fork_run {
+    uintptr_t page;
+    bool      child_done;
+    bool      child_passed;
+};
+
+static void fork_child(fork_run* run) {
+    // Still sees what the parent wrote before the fork, whichever side
+    //  writes first
+    volatile uint64_t* value = (volatile uint64_t*)run->page;
+    bool               seen  = (*value == 1);
+    *value                   = 3;
+
+    run->child_passed = seen && (*value == 3);
+    __atomic_store_n(&run->child_done, true, __ATOMIC_RELEASE);
+}
+
+static void fork_parent(fork_run* run) {
+    threading::process*    self  = current_thread()->scheduler->current_task;
+    paging::address_space* space = self->task_space;
+
+    uintptr_t frame = palloc();
+    run->page       = (uintptr_t)space->get_new_address(PAGE_SIZE);
+    if (frame == 0 || run->page == 0) {
+        if (frame != 0) { pfree(frame); }
+        active_terminal->tprintf("fork_test: Out of memory.\n");
+        delete run;
+        return;
+    }
+    space->map_page_to(frame, run->page);
+
+    volatile uint64_t* value = (volatile uint64_t*)run->page;
+    *value                   = 1;
+
+    auto* task = new std_k::preset_function<void(fork_run*)>(fork_child, run);
+    threading::process* child = new threading::process(1, 1, task, self, true);
+    if (!child->task_space->copy_on_write) {
+        active_terminal->tprintf("fork_test: Couldn't clone the space.\n");
+    }
+    threading::system_scheduler.add_process(child);
+
+    *value = 2;
+    while (!__atomic_load_n(&run->child_done, __ATOMIC_ACQUIRE)) {
+        asm volatile("pause");
+    }
+
+    bool parent_passed = (*value == 2);
+    active_terminal->tprintf("fork_test: Parent %s, child %s.\n",
+                             parent_passed ? "passed" : "failed",
+                             run->child_passed ? "passed" : "failed");
+    delete run;
+}
+
+// Forks a process with a page mapped in its own half, then writes to it
+//  from both sides, each of which should only see its own writes
+int fork_test(int argc, char* argv[]) {
+    (void)argc;
+    (void)argv;
+
+    fork_run* run     = new fork_run();
+    run->page         = 0;
+    run->child_done   = false;
+    run->child_passed = false;
+
+    auto* task = new std_k::preset_function<void(fork_run*)>(fork_parent, run);
+    threading::system_scheduler.add_process(new threading::process(1, 1, task));
+    return 0;
+}
 } // namespace commands
 } // namespace kernel
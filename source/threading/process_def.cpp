@@ -10,12 +10,16 @@
 #include "process_def.h"
 
 #include "memory/p_memory.h"
+#include "system/kernel.h"
 #include "threading.h"
 
 namespace threading {
 process::process(unsigned int target_priority, unsigned int rounds,
-                 std_k::callable<void>* target, process* parent)
+                 std_k::callable<void>* target, process* parent,
+                 bool copy_parent)
     : priority(target_priority)
+    , level((target_priority < NUM_PRIORITIES) ? target_priority
+                                               : NUM_PRIORITIES - 1)
     , rounds(rounds)
     , main(target)
     , out_stream(active_terminal)
@@ -25,14 +29,27 @@ process::process(unsigned int target_priority, unsigned int rounds,
     if (parent_task == nullptr) {
         task_space = new paging::address_space();
     } else {
-        // Link to parent task's address space
-        task_space = new paging::address_space(parent_task->task_space);
+        // Either share the parent's memory until written, or link to it
+        task_space
+            = copy_parent ? parent_task->task_space->clone() : nullptr;
+        if (task_space == nullptr) {
+            task_space = new paging::address_space(parent_task->task_space);
+        }
 
         // Set this into the parent task's child tasks
         parent_task = common_region::current_process;
         parent_task->children.push_back(this);
     }
 
+    // Runs where its parent could, otherwise starting out on the creating
+    //  core's domain, where its first allocations are made
+    if (parent_task != nullptr) {
+        affinity  = parent_task->affinity;
+        home_node = parent_task->home_node;
+    } else if (threads_started) {
+        home_node = current_thread()->domain;
+    }
+
     // Need to add new table to address space
     lvl4_table = task_space->primary_table;
 
@@ -79,12 +96,28 @@ process::~process() {
     free(user_stack);
 }
 
+void process::set_realtime(uint64_t period_us, uint64_t runtime_us,
+                           uint64_t deadline_us) {
+    if (deadline_us == 0) { deadline_us = period_us; }
+
+    uint64_t ticks_per_sec = sys_int_timer->convert_sec(1.0);
+    realtime.period        = (period_us * ticks_per_sec) / 1000000;
+    realtime.runtime       = (runtime_us * ticks_per_sec) / 1000000;
+    realtime.deadline      = (deadline_us * ticks_per_sec) / 1000000;
+}
+
 void process::init_wrapper(process* target) {
     while (target->rounds != 0) {
         // Call actual target
         target->main->call();
 
         if (target->rounds > 0) target->rounds--;
+
+        // Each round of a real-time process is one per period, so it waits
+        //  for the next one by yielding
+        if (target->is_realtime() && target->rounds != 0) {
+            asm volatile("int $0xa1");
+        }
     }
 
     // Delete task by yielding remaining time
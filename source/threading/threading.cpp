@@ -12,9 +12,16 @@
 #include "interrupts/interrupts.h"
 #include "libk/asm.h"
 #include "memory/chunking.h"
+#include "memory/frames.h"
+#include "memory/mem_stats.h"
 #include "memory/p_memory.h"
+#include "memory/pcid.h"
+#include "memory/shootdown.h"
+#include "memory/sub_memory.h"
 #include "process_def.h"
 #include "system/acpi.h"
+#include "system/init.h"
+#include "system/kernel.h"
 #include "terminal/terminal.h"
 #include "time/timer.h"
 #include "topology.h"
@@ -22,7 +29,11 @@
 void __attribute__((noreturn)) cpu_sleep_state() {
     enable_interrupts();
 
-    while (1) { asm volatile("hlt \n\t"); }
+    while (1) {
+        chunking::refill_piles();
+        paging::refill_zeroed_frames();
+        threading::idle_wait();
+    }
 }
 
 namespace threading {
@@ -33,6 +44,96 @@ process_list_t process_list;
 
 system_scheduler_t system_scheduler;
 
+bool threads_started = false;
+
+// Every core reports the same, so it's only checked once
+static bool use_mwait = false;
+
+// Longest a process is left behind higher levels before it's run anyway, in
+//  system timer ticks
+constexpr double STARVATION_SECONDS = 0.1;
+static uint64_t  starvation_limit   = ~(0UL);
+
+// System timer ticks per second, for arming local timers from real-time
+//  deadlines
+static uint64_t system_timer_rate = 1;
+
+// How often a ticking core pulls work over from busier ones
+constexpr double BALANCE_SECONDS  = 0.04;
+static uint64_t  balance_interval = ~(0UL);
+
+// Load a victim needs over the thief, past the task either could be
+//  running, before work is moved across each distance. Leaving a socket or
+//  a domain behind costs the caches or the memory, so takes more
+static constexpr size_t balance_threshold[NUM_CORE_DISTANCES]
+    = {0, 0, 0, 1, 2};
+
+uint64_t scheduler_clock() { return sys_int_timer->now(); }
+
+// Stamps are taken on different cores, so one can be just after now
+static inline uint64_t waited_since(uint64_t now, uint64_t stamp) {
+    return (now > stamp) ? (now - stamp) : 0;
+}
+
+process* run_queues::pop(uint64_t now) {
+    if (occupied == 0) { return nullptr; }
+
+    unsigned int level   = __builtin_ctz(occupied);
+    bool         starved = false;
+
+    // Only the head of each level needs checking, as it's waited longest
+    uint32_t lower = occupied & ~(1U << level);
+    while (lower != 0) {
+        unsigned int candidate = 31 - __builtin_clz(lower);
+        if (waited_since(now, levels[candidate].front()->queued_at)
+            > starvation_limit) {
+            level   = candidate;
+            starved = true;
+            break;
+        }
+        lower &= ~(1U << candidate);
+    }
+
+    process* target = levels[level].front();
+    levels[level].pop();
+    if (levels[level].empty()) { occupied &= ~(1U << level); }
+    __atomic_store_n(&count, count - 1, __ATOMIC_RELAXED);
+
+    uint64_t waited = waited_since(now, target->queued_at);
+    total_wait[level] += waited;
+    if (waited > max_wait[level]) { max_wait[level] = waited; }
+    num_taken[level]++;
+
+    if (starved && target->level > 0) { target->level--; }
+    return target;
+}
+
+process* run_queues::pop_back(unsigned int core) {
+    uint32_t remaining = occupied;
+    while (remaining != 0) {
+        unsigned int level = 31 - __builtin_clz(remaining);
+        remaining &= ~(1U << level);
+
+        std_k::deque<process*>& queue = levels[level].base;
+        for (size_t i = queue.size(); i > 0; i--) {
+            process* target = queue[i - 1];
+            if (!target->affinity.allows(core)) { continue; }
+
+            // Everything behind it moves up, keeping the level in order
+            for (size_t j = i; j < queue.size(); j++) {
+                queue[j - 1] = queue[j];
+            }
+            queue.pop_back();
+            if (queue.empty()) { occupied &= ~(1U << level); }
+            __atomic_store_n(&count, count - 1, __ATOMIC_RELAXED);
+
+            return target;
+        }
+    }
+
+    return nullptr;
+}
+
 void thread_init() {
 
     // Enable floating point instructions
@@ -48,15 +149,14 @@ void thread_init() {
 
     // Setup local apic
     new (&thread->local_apic) apic<true, false>();
+    paging::tlb_online();
 
-    // Find this core's scheduler
+    // Find this core's scheduler (already set up by start_threads, so
+    // anything queued for this core in the meantime is kept)
     thread_scheduler* scheduler = thread->scheduler;
 
     if (scheduler == 0) { asm volatile("cli\n\t hlt"); }
 
-    // Setup the scheduler
-    scheduler = new (scheduler) thread_scheduler(current_thread());
-
     // Enter this core's sleep
     scheduler->enter_sleep();
 }
@@ -70,20 +170,42 @@ void enter_sleep() {
 }
 
 void start_threads() {
+    // Every core needs somewhere to be sent shootdowns before any of them
+    //  can send one, and the caches of freed addresses and zeroed frames are
+    //  looked for as soon as threads_started is set
+    for (unsigned int i = 0; i < topology.num_logical; i++) {
+        topology.threads[i].tlb_queue     = new paging::shootdown_queue;
+        topology.threads[i].pcids         = new paging::pcid_cache;
+        topology.threads[i].va_cache      = new paging::range_cache;
+        topology.threads[i].zeroed_frames = new paging::zero_pool;
+        topology.threads[i].mem_counters  = new mem_stats::core_counters();
+        topology.threads[i].idle_state    = core_busy;
+    }
+    use_mwait         = mwait_supported();
+    starvation_limit  = sys_int_timer->convert_sec(STARVATION_SECONDS);
+    system_timer_rate = sys_int_timer->convert_sec(1.0);
+    balance_interval  = sys_int_timer->convert_sec(BALANCE_SECONDS);
+    paging::prepare_frame_windows();
+    threads_started = true;
+
     // Loop through each logical thread of the system
     for (unsigned int i = 0; i < topology.num_logical; i++) {
 
         // Create this threads scheduler
-        topology.threads[i].scheduler = new thread_scheduler;
+        topology.threads[i].scheduler
+            = new thread_scheduler(&topology.threads[i]);
 
         // Initialize this thread's memory piles
         topology.threads[i].memory_piles
             = new chunking::chunk_pile[chunking::NUM_MEMORY_PILES];
         for (unsigned int pile = 0; pile < chunking::NUM_MEMORY_PILES; pile++) {
             new (&topology.threads[i].memory_piles[pile])
-                chunking::chunk_pile(pile);
+                chunking::chunk_pile(pile, topology.threads[i].domain);
         }
 
+        // And its magazines for small allocations
+        topology.threads[i].slab_caches = new slab_cache;
+
         // Start the thread and send it to the thread initialization,
         // (boot thread will go by itself)
         if (!topology.threads[i].boot_thread) {
@@ -92,58 +214,549 @@ void start_threads() {
     }
 }
 
+size_t system_scheduler_t::size() const {
+    size_t total = 0;
+    for (unsigned int i = 0; i < topology.num_logical; i++) {
+        if (topology.threads[i].scheduler != nullptr) {
+            total += topology.threads[i].scheduler->queue_size();
+        }
+    }
+
+    return total;
+}
+
+process* system_scheduler_t::get(thread_scheduler* target) {
+    if (paused) { return nullptr; }
+
+    // Local queue first, only going to other cores if that's empty
+    process* new_task = target->take_process();
+    if (new_task == nullptr) { new_task = steal(target); }
+
+    return new_task;
+}
+
+process* system_scheduler_t::steal(thread_scheduler* thief) {
+    unsigned int thief_index = (unsigned int)(thief->owner - topology.threads);
+    size_t       thief_load  = thief->load();
+
+    // Find the nearest sibling far enough ahead of the thief, going with
+    // the busiest of those at the same distance
+    thread_scheduler* victim          = nullptr;
+    core_distance     victim_distance = NUM_CORE_DISTANCES;
+    size_t            victim_load     = 0;
+    for (unsigned int i = 0; i < topology.num_logical; i++) {
+        thread_scheduler* sibling = topology.threads[i].scheduler;
+        if (sibling == nullptr || sibling == thief) { continue; }
+        if (sibling->queue_size() == 0) { continue; }
+
+        size_t        sibling_load = sibling->load();
+        core_distance distance     = topology.distance(thief_index, i);
+        if (sibling_load <= (thief_load + 1 + balance_threshold[distance])) {
+            continue;
+        }
+
+        if (distance < victim_distance
+            || (distance == victim_distance && sibling_load > victim_load)) {
+            victim          = sibling;
+            victim_distance = distance;
+            victim_load     = sibling_load;
+        }
+    }
+
+    if (victim == nullptr || !victim->queue_lock.try_lock()) {
+        return nullptr;
+    }
+
+    // Take enough to even out the load, from the back of the victim's
+    // lowest levels, leaving its most urgent work where it is, with the
+    // first one stolen being run immediately. Only processes allowed on
+    // the thief are taken
+    size_t   count  = (victim_load - thief_load) / 2;
+    process* stolen = victim->run_queue.pop_back(thief_index);
+    if (stolen != nullptr && count > 0) { count--; }
+
+    if (count > 0 && thief->queue_lock.try_lock()) {
+        while (count > 0) {
+            process* moved = victim->run_queue.pop_back(thief_index);
+            if (moved == nullptr) { break; }
+            thief->run_queue.push(moved);
+            count--;
+        }
+        thief->queue_lock.unlock();
+    }
+
+    victim->queue_lock.unlock();
+    return stolen;
+}
+
+// Load of a core for placing a process on it, or ~0 if it can't go there
+static size_t placement_load(process* target, unsigned int index) {
+    thread_scheduler* scheduler = topology.threads[index].scheduler;
+    if (scheduler == nullptr || !target->affinity.allows(index)) {
+        return ~(0UL);
+    }
+
+    // A core waiting for work can start it straight away
+    if (topology.threads[index].is_idle() && scheduler->run_queue.empty()) {
+        return 0;
+    }
+    return scheduler->load();
+}
+
+void system_scheduler_t::add_process(process* target) {
+
+    if (topology.threads == nullptr) { return; }
+
+    // Placement is judged from where the process last ran, otherwise from
+    // the core making the request, or the first on the process's home node
+    // if that's elsewhere
+    unsigned int reference = 0;
+    if (initialized) {
+        reference = (unsigned int)(current_thread() - topology.threads);
+    }
+    if (target->last_core < topology.num_logical) {
+        reference = target->last_core;
+    } else if (topology.threads[reference].domain != target->home_node) {
+        for (unsigned int i = 0; i < topology.num_logical; i++) {
+            if (topology.threads[i].domain == target->home_node
+                && target->affinity.allows(i)) {
+                reference = i;
+                break;
+            }
+        }
+    }
+
+    // Lightest load out of the cores it's allowed on. Cores that haven't
+    // started scheduling yet are only used if nothing else is available
+    size_t min_load   = ~(0UL);
+    bool   any_active = false;
+    for (unsigned int i = 0; i < topology.num_logical; i++) {
+        thread_scheduler* scheduler = topology.threads[i].scheduler;
+        size_t            load      = placement_load(target, i);
+        if (load == ~(0UL)) { continue; }
+
+        if (scheduler->active && !any_active) {
+            any_active = true;
+            min_load   = ~(0UL);
+        }
+        if (scheduler->active == any_active && load < min_load) {
+            min_load = load;
+        }
+    }
+
+    // Then the nearest core to the reference within a task of that, so it
+    // only leaves its caches when it would otherwise wait. An idle core is
+    // always taken over waiting behind something
+    size_t       slack         = (min_load == 0) ? 0 : 1;
+    unsigned int best_index    = reference;
+    unsigned int best_distance = NUM_CORE_DISTANCES;
+    size_t       best_load     = ~(0UL);
+    for (unsigned int i = 0; i < topology.num_logical; i++) {
+        unsigned int index = (reference + i) % topology.num_logical;
+        size_t       load  = placement_load(target, index);
+        if (load == ~(0UL) || load > (min_load + slack)
+            || topology.threads[index].scheduler->active != any_active) {
+            continue;
+        }
+
+        core_distance distance = topology.distance(reference, index);
+        if (distance < best_distance
+            || (distance == best_distance && load < best_load)) {
+            best_index    = index;
+            best_distance = distance;
+            best_load     = load;
+        }
+    }
+
+    // With no core it's allowed on running a scheduler, it's left with the
+    // reference core rather than dropped
+    add_process(target, best_index);
+}
+
+void system_scheduler_t::add_process(process* target, unsigned int core_index) {
+    thread_scheduler* scheduler = topology.threads[core_index].scheduler;
+    if (scheduler != nullptr) { scheduler->add_process(target); }
+}
+
+void idle_wait() {
+    logical_core*     core      = current_thread();
+    thread_scheduler* scheduler = core->scheduler;
+
+    // The state has to be visible before the queue is looked at, or work
+    //  queued in between would neither wake the core nor be seen by it
+    core_idle_state state = use_mwait ? core_monitoring : core_halted;
+    __atomic_store_n(&core->idle_state, state, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    if (!use_mwait) {
+        halt();
+        return;
+    }
+
+    // Armed before the queue is checked, so a push after the check still
+    //  ends the wait
+    monitor(&scheduler->queue_pushes);
+    if (!scheduler->has_work()) { mwait(); }
+
+    // Woken by the queue rather than an interrupt, so the scheduler is run
+    //  just as a wake from another core would have
+    if (scheduler->has_work()) {
+        asm volatile("int %0" : : "i"(RESCHEDULE_VECTOR));
+    }
+}
+
 void thread_scheduler::run(thread_scheduler*   target,
                            general_regs_state* task_regs,
                            interrupt_frame*    frame) {
-    process* new_task = system_scheduler.get();
+    uint64_t now = scheduler_clock();
+
+    // Real-time work goes first, so a real-time task being switched out is
+    //  put back with the others before the earliest deadline is picked
+    process* new_task = nullptr;
+    target->realtime_lock.lock();
+    if (target->current_task != nullptr
+        && target->current_task->is_realtime()) {
+        target->current_task->saved_state.save_state(task_regs, frame);
+        target->park_realtime(target->current_task, now, false);
+        target->current_task = nullptr;
+    }
+    target->release_realtime(now);
+    if (!target->realtime_ready.empty()) {
+        new_task = target->realtime_ready.top();
+        target->realtime_ready.pop_top();
+    }
+    target->realtime_lock.unlock();
+
+    // Busier cores are looked at now and then while this one has work of
+    //  its own, as well as whenever it runs dry
+    if (!system_scheduler.paused
+        && waited_since(now, target->last_balance) > balance_interval) {
+        target->last_balance = now;
+        process* pulled      = system_scheduler.steal(target);
+        if (pulled != nullptr) { target->queue_process(pulled); }
+    }
+
+    if (new_task == nullptr) { new_task = system_scheduler.get(target); }
 
     // If scheduler has no tasks, it returns null without locking
     if (new_task != nullptr) {
-        // Swap back old task
-        if (target->current_task != nullptr) {
-            target->current_task->saved_state.save_state(task_regs, frame);
-            system_scheduler.add_process(target->current_task);
+        // Swap back old task, keeping it on this core. Unless it's making
+        //  way for a real-time task, it was preempted at the end of its
+        //  slice, so it drops a level
+        process* old_task = target->current_task;
+        if (old_task != nullptr) {
+            if (!new_task->is_realtime()
+                && (old_task->level + 1) < NUM_PRIORITIES) {
+                old_task->level++;
+            }
+            old_task->saved_state.save_state(task_regs, frame);
+            target->queue_process(old_task);
         }
 
         // Start work on new task
         target->current_task = new_task;
+        new_task->last_core
+            = (unsigned int)(target->owner - topology.threads);
+        __atomic_store_n(&target->owner->idle_state, core_busy,
+                         __ATOMIC_RELAXED);
         target->current_task->saved_state.load_state(task_regs, frame);
 
+        // Tasks with nothing in the user's half only need the kernel's,
+        //  which is already loaded unless the last task had a space of
+        //  its own, so they skip the switch
+        paging::address_space* space = new_task->task_space;
+        paging::load_address_space(
+            (space != nullptr && space->has_user_mappings()) ? space
+                                                             : nullptr);
+
         // active_terminal->tprintf("Scheduler for cpu%x swapping to %p \n",
         //                          target->local_timer->id,
         //                          target->current_task->main);
     } else if (target->current_task == nullptr) {
         // Send cpu to sleep state if there's no task at all
         frame->return_instruction = (uint64_t)cpu_sleep_state;
+        if (target->idle_stack != 0) {
+            frame->return_stack_pointer = target->idle_stack;
+        }
+    }
+    target->slice_start = now;
+
+    // The tick is only needed while something is left waiting. Once it's
+    //  stopped the queue is checked again, as anything added before then
+    //  wouldn't have sent a wake
+    target->scheduling_timer_task = nullptr;
+    bool contended                = !target->run_queue.empty();
+    if (!contended) {
+        __atomic_store_n(&target->ticking, false, __ATOMIC_RELAXED);
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+        contended = !target->run_queue.empty();
     }
 
-    // Reset scheduling timer
-    int schedule_time = 1;
-    if (target->current_task != nullptr)
-        schedule_time = target->current_task->priority;
-
-    unsigned long schedule_rate = SCHEDULING_DEFAULT_RATE / schedule_time;
-    if (schedule_rate < 1) schedule_rate = 1;
+    if (contended) {
+        target->start_tick();
 
-    target->scheduling_timer_task = target->local_timer->push_task_rate(
-        schedule_rate, &target->scheduling_function, 1);
+        // Idle cores no longer tick to look for work, so have one take some
+        system_scheduler.wake_idle_core(target);
+    } else if (target->next_realtime_event(now) != ~(0UL)) {
+        // Only for the end of a real-time task's runtime or the next period
+        target->start_tick();
+    }
 
     // Will return to loaded state
     return;
 }
 
+void thread_scheduler::start_tick() {
+    // Slices get longer further down, where the work is least interactive.
+    //  Real-time tasks have no slice, only their runtime
+    uint64_t interval = ~(0UL);
+    if (current_task == nullptr || !current_task->is_realtime()) {
+        int schedule_time = 1;
+        if (current_task != nullptr) schedule_time = current_task->level + 1;
+
+        unsigned long schedule_rate = SCHEDULING_DEFAULT_RATE / schedule_time;
+        if (schedule_rate < 1) schedule_rate = 1;
+        interval = local_timer->convert_rate(schedule_rate);
+    }
+
+    // Cut short for whatever real-time event comes first
+    uint64_t event = next_realtime_event(scheduler_clock());
+    if (event != ~(0UL)) {
+        uint64_t local_event = (uint64_t)(((unsigned __int128)event
+                                           * local_timer->apic_rate)
+                                          / system_timer_rate);
+        if (local_event < interval) { interval = local_event; }
+    }
+    if (interval == 0) { interval = 1; }
+
+    __atomic_store_n(&ticking, true, __ATOMIC_RELAXED);
+    scheduling_timer_task = local_timer->push_task_interval(
+        interval, &scheduling_function, 1);
+}
+
+void thread_scheduler::reschedule(general_regs_state* task_regs,
+                                  interrupt_frame*    frame) {
+    // A newly admitted real-time task can't wait for the tick
+    if (realtime_preempts()) {
+        if (scheduling_timer_task != nullptr) {
+            scheduling_timer_task->rounds = 0;
+        }
+        run(this, task_regs, frame);
+        return;
+    }
+
+    // Idle, so the work can be started right away, even with a tick still
+    //  pending, as waiting for it would leave the core spinning in the idle
+    //  loop until then. The pending tick is dropped for the one run sets up
+    if (current_task == nullptr) {
+        if (ticking && scheduling_timer_task != nullptr) {
+            scheduling_timer_task->rounds = 0;
+        }
+        run(this, task_regs, frame);
+        return;
+    }
+
+    // Otherwise the current task gets the rest of a slice first, with
+    //  anything new picked up on the next tick
+    if (!ticking) { start_tick(); }
+}
+
+void system_scheduler_t::wake_idle_core(thread_scheduler* source) {
+    unsigned int source_index
+        = (unsigned int)(source->owner - topology.threads);
+    size_t source_load = source->load();
+
+    // The nearest idle core that would actually steal from the source once
+    // awake, as waking one too far away for the load only costs an IPI
+    thread_scheduler* nearest          = nullptr;
+    core_distance     nearest_distance = NUM_CORE_DISTANCES;
+    for (unsigned int i = 0; i < topology.num_logical; i++) {
+        thread_scheduler* scheduler = topology.threads[i].scheduler;
+        if (scheduler == nullptr || scheduler == source || !scheduler->active
+            || !scheduler->in_sleep()
+            || __atomic_load_n(&scheduler->ticking, __ATOMIC_RELAXED)) {
+            continue;
+        }
+
+        core_distance distance = topology.distance(i, source_index);
+        if (distance >= nearest_distance
+            || source_load
+                   <= (scheduler->load() + 1 + balance_threshold[distance])) {
+            continue;
+        }
+
+        nearest          = scheduler;
+        nearest_distance = distance;
+    }
+
+    if (nearest != nullptr) { nearest->wake(); }
+}
+
+bool system_scheduler_t::add_realtime(process* target) {
+    if (topology.threads == nullptr) { return false; }
+
+    // Has to fit in whichever of its period and deadline is shorter
+    process::realtime_t& realtime = target->realtime;
+    uint64_t             window   = (realtime.deadline < realtime.period)
+                                        ? realtime.deadline
+                                        : realtime.period;
+    if (realtime.runtime == 0 || realtime.runtime > window) { return false; }
+    realtime.load = (realtime.runtime * REALTIME_LOAD_ONE) / window;
+
+    unsigned int start = 0;
+    if (initialized) {
+        start = (unsigned int)(current_thread() - topology.threads);
+    }
+
+    for (unsigned int i = 0; i < topology.num_logical; i++) {
+        unsigned int      index     = (start + i) % topology.num_logical;
+        thread_scheduler* scheduler = topology.threads[index].scheduler;
+        if (scheduler == nullptr || !scheduler->active
+            || !target->affinity.allows(index)) {
+            continue;
+        }
+
+        uint64_t flags = save_and_disable_interrupts();
+        scheduler->realtime_lock.lock();
+
+        bool fits = (scheduler->realtime_load + realtime.load)
+                    <= REALTIME_LOAD_LIMIT;
+        if (fits) {
+            uint64_t now               = scheduler_clock();
+            realtime.release           = now;
+            realtime.absolute_deadline = now + realtime.deadline;
+            realtime.used              = 0;
+
+            scheduler->realtime_load += realtime.load;
+            scheduler->realtime_ready.push(target);
+            __atomic_fetch_add(&scheduler->queue_pushes, 1, __ATOMIC_RELAXED);
+        }
+
+        scheduler->realtime_lock.unlock();
+        restore_interrupts(flags);
+
+        if (fits) {
+            scheduler->wake();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+void thread_scheduler::park_realtime(process* task, uint64_t now,
+                                     bool finished) {
+    process::realtime_t& realtime = task->realtime;
+    realtime.used += waited_since(now, slice_start);
+
+    if (finished) {
+        if (now > realtime.absolute_deadline) {
+            realtime.overruns++;
+            realtime_overruns++;
+        }
+    } else if (realtime.used >= realtime.runtime) {
+        // Out of runtime, so it's held back until its next period
+        realtime.overruns++;
+        realtime_overruns++;
+        finished = true;
+    }
+
+    if (!finished) {
+        realtime_ready.push(task);
+        return;
+    }
+
+    // A task that has fallen whole periods behind starts over from now,
+    //  rather than running back to back to catch up
+    realtime.used = 0;
+    realtime.release += realtime.period;
+    if ((realtime.release + realtime.deadline) < now) {
+        realtime.release = now;
+    }
+    realtime.absolute_deadline = realtime.release + realtime.deadline;
+    realtime_waiting.push(task);
+}
+
+void thread_scheduler::release_realtime(uint64_t now) {
+    while (!realtime_waiting.empty()
+           && realtime_waiting.top()->realtime.release <= now) {
+        realtime_ready.push(realtime_waiting.top());
+        realtime_waiting.pop_top();
+    }
+}
+
+bool thread_scheduler::realtime_preempts() {
+    uint64_t flags = save_and_disable_interrupts();
+    realtime_lock.lock();
+
+    bool preempts = false;
+    if (!realtime_ready.empty()) {
+        preempts = (current_task == nullptr) || !current_task->is_realtime()
+                   || (realtime_ready.top()->realtime.absolute_deadline
+                       < current_task->realtime.absolute_deadline);
+    }
+
+    realtime_lock.unlock();
+    restore_interrupts(flags);
+    return preempts;
+}
+
+uint64_t thread_scheduler::next_realtime_event(uint64_t now) {
+    uint64_t next = ~(0UL);
+    if (current_task != nullptr && current_task->is_realtime()) {
+        process::realtime_t& realtime = current_task->realtime;
+        uint64_t used = realtime.used + waited_since(now, slice_start);
+        next          = (used < realtime.runtime) ? (realtime.runtime - used)
+                                                  : 0;
+    }
+
+    uint64_t flags = save_and_disable_interrupts();
+    realtime_lock.lock();
+    if (!realtime_waiting.empty()) {
+        uint64_t release = waited_since(
+            realtime_waiting.top()->realtime.release, now);
+        if (release < next) { next = release; }
+    }
+    realtime_lock.unlock();
+    restore_interrupts(flags);
+
+    return next;
+}
+
 void thread_scheduler::yield_current(general_regs_state* task_regs,
                                      interrupt_frame*    frame) {
-    // Need to cancel run timer early
-    scheduling_timer_task->rounds = 0;
+    // Need to cancel run timer early, if it's running
+    if (scheduling_timer_task != nullptr) {
+        scheduling_timer_task->rounds = 0;
+    }
 
     // Check if this task is actually finished
     if (current_task->rounds == 0) {
+        if (current_task->is_realtime()) {
+            realtime_lock.lock();
+            realtime_load -= current_task->realtime.load;
+            realtime_lock.unlock();
+        }
+
         if (!current_task->config.wait_on_end) { delete current_task; }
         current_task = nullptr;
 
         // active_terminal->tprintf("Scheduler for cpu%x finished task \n",
         //                          local_timer->id);
+    } else if (current_task->is_realtime()) {
+        // Done with this period's round, so it waits for the next
+        current_task->saved_state.save_state(task_regs, frame);
+        realtime_lock.lock();
+        park_realtime(current_task, scheduler_clock(), true);
+        realtime_lock.unlock();
+        current_task = nullptr;
+    } else {
+        // Gave up the core before its slice ran out, so it's moved up a
+        //  level and goes behind anything else waiting there
+        if (current_task->level > 0) { current_task->level--; }
+        current_task->saved_state.save_state(task_regs, frame);
+        queue_process(current_task);
+        current_task = nullptr;
     }
 
     run(this, task_regs, frame);
@@ -79,6 +79,16 @@ void logical_core::start_thread(void (*target_code)()) {
     }
 }
 
+static void set_core_domain(logical_core* cores, unsigned int num_cores,
+                            uint32_t id, unsigned int domain) {
+    for (unsigned int i = 0; i < num_cores; i++) {
+        if (cores[i].local_apic.id == id) {
+            cores[i].domain = domain;
+            return;
+        }
+    }
+}
+
 void detect_topology(acpi::madt_table* madt, acpi::srat_table* srat) {
 
     // Determine number of logical cores from MADT entries
@@ -111,6 +121,7 @@ void detect_topology(acpi::madt_table* madt, acpi::srat_table* srat) {
             logical_cores[num_logical].local_apic.id
                 = ((acpi::madt_processor_apic**)acpi_entries)[i]->apic_id;
             logical_cores[num_logical].x2apic_thread = false;
+            logical_cores[num_logical].domain        = 0;
             logical_cores[num_logical].boot_thread
                 = (logical_cores[num_logical].local_apic.id == boot_apic_id);
             num_logical++;
@@ -130,6 +141,7 @@ void detect_topology(acpi::madt_table* madt, acpi::srat_table* srat) {
                 = ((acpi::madt_processor_x2apic**)acpi_entries)[i]
                       ->processor_id;
             logical_cores[num_logical].x2apic_thread = true;
+            logical_cores[num_logical].domain        = 0;
             logical_cores[num_logical].boot_thread
                 = (logical_cores[num_logical].local_apic.id == boot_apic_id);
             num_logical++;
@@ -185,7 +197,14 @@ void detect_topology(acpi::madt_table* madt, acpi::srat_table* srat) {
                   | (((acpi::srat_apic_affinity**)acpi_entries)[i]->hi_DM[2]
                      << 24);
 
+            if (domain >= chunking::MAX_NUMA_DOMAINS) {
+                domain = chunking::MAX_NUMA_DOMAINS - 1;
+            }
             if ((domain + 1) > num_domains) { num_domains = (domain + 1); }
+
+            set_core_domain(
+                logical_cores, num_logical,
+                ((acpi::srat_apic_affinity**)acpi_entries)[i]->APIC_ID, domain);
         }
         i++;
     }
@@ -201,7 +220,15 @@ void detect_topology(acpi::madt_table* madt, acpi::srat_table* srat) {
             unsigned int domain
                 = ((acpi::srat_x2apic_affinity**)acpi_entries)[i]->domain;
 
+            if (domain >= chunking::MAX_NUMA_DOMAINS) {
+                domain = chunking::MAX_NUMA_DOMAINS - 1;
+            }
             if ((domain + 1) > num_domains) { num_domains = (domain + 1); }
+
+            set_core_domain(
+                logical_cores, num_logical,
+                ((acpi::srat_x2apic_affinity**)acpi_entries)[i]->x2APIC_ID,
+                domain);
         }
         i++;
     }
@@ -214,40 +241,53 @@ void detect_topology(acpi::madt_table* madt, acpi::srat_table* srat) {
     topology.domains = (numa_domain*)malloc(sizeof(numa_domain) * num_domains);
     for (unsigned int j = 0; j < num_domains; j++) {
         topology.domains[j].num_socket = 0;
-        topology.domains[j].start      = 0;
-        topology.domains[j].end        = ~(0);
+        topology.domains[j].num_ranges = 0;
+        topology.domains[j].start      = ~(0);
+        topology.domains[j].end        = 0;
     }
 
     // Process memory entries and apply those to the numa domains
-    num_entries = acpi::get_entries(srat, acpi::srat_entry_type::mem_affinity,
-                                    acpi_entries, num_entries);
-    i           = 0;
-    while (i < num_entries) {
-        if (((acpi::srat_mem_affinity**)acpi_entries)[i]->flags & 1) {
-            topology
-                .domains[((acpi::srat_mem_affinity**)acpi_entries)[i]->domain]
-                .start
-                = (((acpi::srat_mem_affinity**)acpi_entries)[i]->lo_base | 0ULL
-                   | ((((acpi::srat_mem_affinity**)acpi_entries)[i]->hi_base
-                       | 0ULL)
-                      << 32));
-
-            topology
-                .domains[((acpi::srat_mem_affinity**)acpi_entries)[i]->domain]
-                .end
-                = (topology
-                       .domains[((acpi::srat_mem_affinity**)acpi_entries)[i]
-                                    ->domain]
-                       .start
-                   + (((acpi::srat_mem_affinity**)acpi_entries)[i]->lo_length
-                      | 0ULL
-                      | ((((acpi::srat_mem_affinity**)acpi_entries)[i]
-                              ->hi_length
-                          | 0ULL)
-                         << 32)));
+    int num_mem_entries
+        = acpi::count_entries(srat, acpi::srat_entry_type::mem_affinity);
+    acpi::entry_header** mem_entries = (acpi::entry_header**)malloc(
+        sizeof(acpi::entry_header*) * num_mem_entries);
+    num_mem_entries
+        = acpi::get_entries(srat, acpi::srat_entry_type::mem_affinity,
+                            mem_entries, num_mem_entries);
+    for (i = 0; i < num_mem_entries; i++) {
+        acpi::srat_mem_affinity* entry
+            = ((acpi::srat_mem_affinity**)mem_entries)[i];
+        if (!(entry->flags & 1)) { continue; }
+
+        // Folded the same way as the cores' domains above
+        unsigned int domain = entry->domain;
+        if (domain >= chunking::MAX_NUMA_DOMAINS) {
+            domain = chunking::MAX_NUMA_DOMAINS - 1;
         }
+        if (domain >= num_domains) { continue; }
 
-        i++;
+        numa_domain* target = &topology.domains[domain];
+        if (target->num_ranges == MAX_DOMAIN_RANGES) { continue; }
+
+        uintptr_t start = (entry->lo_base | ((uint64_t)entry->hi_base << 32));
+        uintptr_t end
+            = start + (entry->lo_length | ((uint64_t)entry->hi_length << 32));
+
+        target->ranges[target->num_ranges].start = start;
+        target->ranges[target->num_ranges].end   = end;
+        target->num_ranges++;
+
+        if (start < target->start) { target->start = start; }
+        if (end > target->end) { target->end = end; }
+    }
+    free(mem_entries);
+
+    // Domains without any listed memory cover everything
+    for (unsigned int j = 0; j < num_domains; j++) {
+        if (topology.domains[j].num_ranges == 0) {
+            topology.domains[j].start = 0;
+            topology.domains[j].end   = ~(0);
+        }
     }
 
     // Detection of layout of sockets and physical/logical cores